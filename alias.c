@@ -24,6 +24,9 @@
  *
  *    24-Jan-1998 (Eric Kohl <ekohl@abo.rhein-zeitung.de>)
  *        Redirection safe!
+ *
+ *    17-Oct-2026
+ *        Added GetAliasGeneration() for the batch line parse cache.
  */
 
 
@@ -52,6 +55,7 @@ typedef struct tagALIAS
 static LPALIAS lpFirst = NULL;
 static LPALIAS lpLast = NULL;
 static DWORD   dwUsed = 0;
+static UINT    nGeneration = 0;  /* changed whenever an alias is */
 
 
 /* module internal functions */
@@ -86,6 +90,8 @@ DeleteAlias (LPTSTR pszName)
 	LPALIAS ptr = lpFirst;
 	LPALIAS prev = NULL;
 
+	nGeneration++;
+
 	while (ptr)
 	{
 		if (!_tcsicmp (ptr->lpName, pszName))
@@ -112,6 +118,8 @@ AddAlias (LPTSTR name, LPTSTR subst)
 	LPALIAS prev, entry;
 	LPTSTR s;
 
+	nGeneration++;
+
 	while (ptr)
 	{
 		if (!_tcsicmp (ptr->lpName, name))
@@ -217,6 +225,8 @@ VOID InitializeAlias (VOID)
 
 VOID DestroyAlias (VOID)
 {
+        nGeneration++;
+
         if (lpFirst == NULL)
                 return;
 
@@ -240,6 +250,16 @@ VOID DestroyAlias (VOID)
 }
 
 /* specified routines */
+
+/*
+ * Returns a number that changes whenever an alias is added, changed or
+ * removed, so results of alias expansion can be kept until then.
+ */
+UINT GetAliasGeneration (VOID)
+{
+	return nGeneration;
+}
+
 VOID ExpandAlias (LPTSTR cmd, INT maxlen)
 {
 	unsigned n = 0,
@@ -81,6 +81,262 @@ BOOL bEcho = TRUE;          /* The echo flag */
 TCHAR textline[BATCH_BUFFSIZE];
 
 
+/*
+ * Reads a whole batch file into memory and builds the table of line
+ * offsets. Lines may be terminated by CR/LF, LF or a single CR.
+ *
+ * Returns NULL if the file could not be read.
+ */
+
+LPBATCH_FILE LoadBatchFile (HANDLE hFile)
+{
+	BY_HANDLE_FILE_INFORMATION fi;
+	LPBATCH_FILE lpFile;
+	LONG  lHighPos = 0;
+	DWORD dwRead;
+	DWORD dwPos;
+	DWORD dwStart;
+	DWORD n;
+
+	if (!GetFileInformationByHandle (hFile, &fi) || fi.nFileSizeHigh != 0)
+		return NULL;
+
+	lpFile = (LPBATCH_FILE)malloc (sizeof (BATCH_FILE));
+	if (lpFile == NULL)
+	{
+		error_out_of_memory ();
+		return NULL;
+	}
+
+	lpFile->dwSize = fi.nFileSizeLow;
+	lpFile->ftLastWrite = fi.ftLastWriteTime;
+	lpFile->bLabels = FALSE;
+	lpFile->lpLabels = NULL;
+	lpFile->dwLabels = 0;
+	lpFile->lpView = NULL;
+
+	SetFilePointer (hFile, 0, &lHighPos, FILE_BEGIN);
+
+	lpFile->lpData = (LPSTR)malloc (lpFile->dwSize + 1);
+	if (lpFile->lpData == NULL)
+	{
+		error_out_of_memory ();
+		free (lpFile);
+		return NULL;
+	}
+
+	/* one read for the whole file */
+	dwPos = 0;
+	while (dwPos < lpFile->dwSize)
+	{
+		if (!ReadFile (hFile, lpFile->lpData + dwPos,
+		               lpFile->dwSize - dwPos, &dwRead, NULL) || dwRead == 0)
+			break;
+		dwPos += dwRead;
+	}
+	lpFile->dwSize = dwPos;
+	lpFile->lpData[dwPos] = '\0';
+
+	/* count the lines first, so the table is allocated only once */
+	n = 0;
+	for (dwPos = 0; dwPos < lpFile->dwSize; dwPos++)
+	{
+		if (lpFile->lpData[dwPos] == '\n' ||
+		    (lpFile->lpData[dwPos] == '\r' &&
+		     (dwPos + 1 == lpFile->dwSize || lpFile->lpData[dwPos + 1] != '\n')))
+			n++;
+	}
+	if (lpFile->dwSize && lpFile->lpData[lpFile->dwSize - 1] != '\n' &&
+	    lpFile->lpData[lpFile->dwSize - 1] != '\r')
+		n++;
+
+	lpFile->lpLines = (LPBATCH_LINE)malloc ((n + 1) * sizeof (BATCH_LINE));
+	if (lpFile->lpLines == NULL)
+	{
+		error_out_of_memory ();
+		free (lpFile->lpData);
+		free (lpFile);
+		return NULL;
+	}
+
+	n = 0;
+	dwStart = 0;
+	for (dwPos = 0; dwPos < lpFile->dwSize; dwPos++)
+	{
+		if (lpFile->lpData[dwPos] == '\r' || lpFile->lpData[dwPos] == '\n')
+		{
+			lpFile->lpLines[n].dwOffset = dwStart;
+			lpFile->lpLines[n].dwLength = dwPos - dwStart;
+			lpFile->lpLines[n].lpParsed = NULL;
+			n++;
+
+			if (lpFile->lpData[dwPos] == '\r' &&
+			    dwPos + 1 < lpFile->dwSize && lpFile->lpData[dwPos + 1] == '\n')
+				dwPos++;
+			dwStart = dwPos + 1;
+		}
+	}
+	if (dwStart < lpFile->dwSize)
+	{
+		lpFile->lpLines[n].dwOffset = dwStart;
+		lpFile->lpLines[n].dwLength = lpFile->dwSize - dwStart;
+		lpFile->lpLines[n].lpParsed = NULL;
+		n++;
+	}
+	lpFile->dwLines = n;
+
+#ifdef _DEBUG
+	DebugPrintf (_T("LoadBatchFile: %lu bytes, %lu lines\n"),
+	             lpFile->dwSize, lpFile->dwLines);
+#endif
+
+	return lpFile;
+}
+
+
+VOID FreeBatchFile (LPBATCH_FILE lpFile)
+{
+	DWORD n;
+
+	if (lpFile == NULL)
+		return;
+
+	for (n = 0; n < lpFile->dwLines; n++)
+	{
+		if (lpFile->lpLines[n].lpParsed)
+			FreeParsedLine (lpFile->lpLines[n].lpParsed);
+	}
+
+#ifdef FEATURE_BATCH_CACHE
+	if (lpFile->lpView)
+	{
+		/* data, lines and labels are all in the view */
+		UnmapViewOfFile (lpFile->lpView);
+		free (lpFile);
+		return;
+	}
+#endif
+
+	if (lpFile->lpLabels)
+		free (lpFile->lpLabels);
+	free (lpFile->lpLines);
+	free (lpFile->lpData);
+	free (lpFile);
+}
+
+
+VOID FreeParsedLine (LPPARSED_LINE lpLine)
+{
+	if (lpLine->lpVariables)
+		free (lpLine->lpVariables);
+	if (lpLine->lpDelayed)
+		free (lpLine->lpDelayed);
+	free (lpLine);
+}
+
+
+/*
+ * Reads the current batch file again if it was changed on disk since
+ * its image was loaded. The label index goes away with the old image
+ * and is rebuilt on the next GOTO. The current line number is kept.
+ *
+ * Returns FALSE if the file could not be read again.
+ */
+
+BOOL RefreshBatchFile (VOID)
+{
+	BY_HANDLE_FILE_INFORMATION fi;
+	LPBATCH_FILE lpFile;
+
+	if (bc == NULL || bc->lpFile == NULL)
+		return FALSE;
+
+	if (!GetFileInformationByHandle (bc->hBatchFile, &fi))
+		return TRUE;
+
+	if (fi.nFileSizeHigh == 0 &&
+	    fi.nFileSizeLow == bc->lpFile->dwSize &&
+	    CompareFileTime (&fi.ftLastWriteTime, &bc->lpFile->ftLastWrite) == 0)
+		return TRUE;
+
+#ifdef _DEBUG
+	DebugPrintf (_T("RefreshBatchFile: batch file has changed, reloading\n"));
+#endif
+
+	lpFile = LoadBatchFile (bc->hBatchFile);
+	if (lpFile == NULL)
+		return FALSE;
+
+	FreeBatchFile (bc->lpFile);
+	bc->lpFile = lpFile;
+
+	return TRUE;
+}
+
+
+/*
+ * Copies line number nLine of a batch file image into lpBuffer.
+ * Overlong lines are truncated to the buffer length.
+ *
+ * Returns FALSE if there is no such line.
+ */
+
+BOOL GetBatchLine (LPBATCH_FILE lpFile, DWORD nLine, LPTSTR lpBuffer, INT nBufferLength)
+{
+	LPSTR lpString;
+	INT len;
+
+	if (lpFile == NULL || nLine >= lpFile->dwLines)
+		return FALSE;
+
+	lpString = lpFile->lpData + lpFile->lpLines[nLine].dwOffset;
+	len = (INT)lpFile->lpLines[nLine].dwLength;
+	if (len > nBufferLength - 1)
+		len = nBufferLength - 1;
+
+#ifdef _UNICODE
+	len = MultiByteToWideChar (CP_ACP, 0, lpString, len, lpBuffer, nBufferLength - 1);
+#else
+	memcpy (lpBuffer, lpString, len);
+#endif
+	lpBuffer[len] = _T('\0');
+
+	return TRUE;
+}
+
+
+/*
+ * Returns where the parsed form of the line last returned by
+ * ReadBatchLine is kept, or NULL if it didn't come from the batch file
+ * image (FOR contexts).
+ */
+
+LPPARSED_LINE *GetParsedLineSlot (VOID)
+{
+	if (bc == NULL || bc->forvar || bc->lpFile == NULL ||
+	    bc->dwLine == 0 || bc->dwLine > bc->lpFile->dwLines)
+		return NULL;
+
+	return &bc->lpFile->lpLines[bc->dwLine - 1].lpParsed;
+}
+
+
+/*
+ * Returns the context of the running batch file, skipping FOR contexts,
+ * or NULL outside batch files.
+ */
+
+LPBATCH_CONTEXT GetBatchFileContext (VOID)
+{
+	LPBATCH_CONTEXT b = bc;
+
+	while (b != NULL && b->forvar)
+		b = b->prev;
+
+	return b;
+}
+
+
 /*
  * Returns a pointer to the n'th parameter of the current batch file.
  * If no such parameter exists returns pointer to empty string.
@@ -90,8 +346,6 @@ TCHAR textline[BATCH_BUFFSIZE];
 
 LPTSTR FindArg (INT n)
 {
-	LPTSTR pp;
-
 #ifdef _DEBUG
 	DebugPrintf (_T("FindArg: (%d)\n"), n);
 #endif
@@ -100,35 +354,46 @@ LPTSTR FindArg (INT n)
 		return NULL;
 
 	n += bc->shiftlevel;
-	pp = bc->params;
+	if (bc->params == NULL || n >= bc->params->nArgs)
+		return _T("");
 
-	/* Step up the strings till we reach the end */
-	/* or the one we want */
-	while (*pp && n--)
-		pp += _tcslen (pp) + 1;
-
-	return pp;
+	return bc->params->lpArgs[n];
 }
 
 
 /*
  * Batch_params builds a parameter list in newlay allocated memory.
- * The parameters consist of null terminated strings with a final
- * NULL character signalling the end of the parameters.
+ * The parameters are split into null terminated strings, which are
+ * indexed by an array of pointers in the same block, so a parameter is
+ * found without walking the ones before it. The list ends at the first
+ * empty parameter.
  *
 */
 
-LPTSTR BatchParams (LPTSTR s1, LPTSTR s2)
+LPBATCH_PARAMS BatchParams (LPTSTR s1, LPTSTR s2)
 {
-	LPTSTR dp = (LPTSTR)malloc ((_tcslen(s1) + _tcslen(s2) + 3) * sizeof (TCHAR));
+	LPBATCH_PARAMS lpParams;
+	LPTSTR dp;
+	LPTSTR p;
+	INT nMaxArgs;
+	INT len2 = _tcslen (s2);
+
+	/* every parameter but the first takes a separator */
+	nMaxArgs = len2 / 2 + 3;
+
+	lpParams = (LPBATCH_PARAMS)malloc (sizeof (BATCH_PARAMS) +
+	                                   nMaxArgs * sizeof (LPTSTR) +
+	                                   (_tcslen (s1) + len2 + 3) * sizeof (TCHAR));
 
 	/* JPP 20-Jul-1998 added error checking */
-	if (dp == NULL)
+	if (lpParams == NULL)
 	{
 		error_out_of_memory();
 		return NULL;
 	}
 
+	dp = (LPTSTR)&lpParams->lpArgs[nMaxArgs];
+
 	if (s1 && *s1)
 	{
 		s1 = _stpcpy (dp, s1);
@@ -139,11 +404,11 @@ LPTSTR BatchParams (LPTSTR s1, LPTSTR s2)
 
 	while (*s2)
 	{
-		if (_istspace (*s2) || _tcschr (_T(",;"), *s2))
+		if (_istspace (*s2) || *s2 == _T(',') || *s2 == _T(';'))
 		{
 			*s1++ = _T('\0');
 			s2++;
-			while (*s2 && _tcschr (_T(" ,;"), *s2))
+			while (*s2 == _T(' ') || *s2 == _T(',') || *s2 == _T(';'))
 				s2++;
 			continue;
 		}
@@ -155,6 +420,10 @@ LPTSTR BatchParams (LPTSTR s1, LPTSTR s2)
 			do
 				*s1++ = *s2++;
 			while (*s2 && (*s2 != st));
+
+			/* unterminated quote */
+			if (*s2 == _T('\0'))
+				break;
 		}
 
 		*s1++ = *s2++;
@@ -163,10 +432,34 @@ LPTSTR BatchParams (LPTSTR s1, LPTSTR s2)
 	*s1++ = _T('\0');
 	*s1 = _T('\0');
 
-	return dp;
+	/* index the parameters */
+	lpParams->nArgs = 0;
+	for (p = dp; *p && lpParams->nArgs < nMaxArgs; p += _tcslen (p) + 1)
+		lpParams->lpArgs[lpParams->nArgs++] = p;
+
+	return lpParams;
 }
 
 
+#ifdef FEATURE_TRACE
+/*
+ * Number of batch contexts, which tells the trace events of nested
+ * batch files apart.
+ */
+
+static DWORD BatchDepth (VOID)
+{
+	LPBATCH_CONTEXT b;
+	DWORD n = 0;
+
+	for (b = bc; b != NULL; b = b->prev)
+		n++;
+
+	return n;
+}
+#endif
+
+
 /*
  * If a batch file is current, exits it, freeing the context block and
  * chaining back to the previous one.
@@ -193,6 +486,9 @@ VOID ExitBatch (LPTSTR msg)
 			bc->hBatchFile = INVALID_HANDLE_VALUE;
 		}
 
+		if (bc->lpFile)
+			FreeBatchFile (bc->lpFile);
+
 		if (bc->params)
 			free(bc->params);
 
@@ -205,6 +501,20 @@ VOID ExitBatch (LPTSTR msg)
 		/* Preserve echo state across batch calls */
 		bEcho = bc->bEcho;
 
+#ifdef FEATURE_PROFILE
+		if (bc->lpProfile)
+			ProfileBatchExit (bc->lpProfile);
+#endif
+
+#ifdef FEATURE_TRACE
+		if (bTrace && !bc->forvar && bc->lpFile)
+			TraceEvent (TRACE_BATCH, 'e', _T(""), BatchDepth ());
+#endif
+
+		/* implicit ENDLOCAL, FOR contexts leave them to their batch */
+		if (!bc->forvar)
+			LeaveEnvScopes (bc->nEnvScopes);
+
 		bc = bc->prev;
 		free(t);
 	}
@@ -224,8 +534,10 @@ VOID ExitBatch (LPTSTR msg)
 BOOL Batch (LPTSTR fullname, LPTSTR firstword, LPTSTR param)
 {
 	HANDLE hFile;
+	LPBATCH_FILE lpFile;
 
-	hFile = CreateFile (fullname, GENERIC_READ, FILE_SHARE_READ, NULL,
+	/* Allow the file to be edited while it runs, GOTO notices the change */
+	hFile = CreateFile (fullname, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
 						OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL |
 						FILE_FLAG_SEQUENTIAL_SCAN, NULL);
 
@@ -240,6 +552,25 @@ BOOL Batch (LPTSTR fullname, LPTSTR firstword, LPTSTR param)
 		return FALSE;
 	}
 
+	/* Read the whole file now, lines are taken from the image */
+#ifdef FEATURE_BATCH_CACHE
+	lpFile = LoadCachedBatchFile (fullname, hFile);
+	if (lpFile == NULL)
+	{
+		lpFile = LoadBatchFile (hFile);
+		if (lpFile != NULL)
+			StoreCachedBatchFile (fullname, hFile, lpFile);
+	}
+#else
+	lpFile = LoadBatchFile (hFile);
+#endif
+	if (lpFile == NULL)
+	{
+		ConErrPrintf (_T("Error reading batch file\n"));
+		CloseHandle (hFile);
+		return FALSE;
+	}
+
 	/* Kill any and all FOR contexts */
 	while (bc && bc->forvar)
 		ExitBatch (NULL);
@@ -252,10 +583,13 @@ BOOL Batch (LPTSTR fullname, LPTSTR firstword, LPTSTR param)
 		if (n == NULL)
 		{
 			error_out_of_memory ();
+			FreeBatchFile (lpFile);
+			CloseHandle (hFile);
 			return FALSE;
 		}
 
 		n->prev = bc;
+		n->lpProfile = NULL;
 		bc = n;
 	}
 	else if (bc->hBatchFile != INVALID_HANDLE_VALUE)
@@ -263,18 +597,38 @@ BOOL Batch (LPTSTR fullname, LPTSTR firstword, LPTSTR param)
 		/* Then we are transferring to another batch */
 		CloseHandle (bc->hBatchFile);
 		bc->hBatchFile = INVALID_HANDLE_VALUE;
+		FreeBatchFile (bc->lpFile);
 		free (bc->params);
+		LeaveEnvScopes (bc->nEnvScopes);
+#ifdef FEATURE_TRACE
+		if (bTrace)
+			TraceEvent (TRACE_BATCH, 'e', _T(""), BatchDepth ());
+#endif
 	}
 
 	bc->hBatchFile = hFile;
+	bc->lpFile = lpFile;
+	bc->dwLine = 0;
 	bc->bEcho = bEcho; /* Preserve echo across batch calls */
 	bc->shiftlevel = 0;
+	bc->nEnvScopes = GetEnvScopeDepth ();
 
 	bc->ffind = NULL;
 	bc->forvar = _T('\0');
 	bc->forproto = NULL;
 	bc->params = BatchParams (firstword, param);
 
+#ifdef FEATURE_PROFILE
+	if (bProfile)
+		ProfileBatch (fullname);
+#endif
+
+#ifdef FEATURE_TRACE
+	/* async events, the batch file outlives the command starting it */
+	if (bTrace)
+		TraceEvent (TRACE_BATCH, 'b', fullname, BatchDepth ());
+#endif
+
 #ifdef _DEBUG
 	DebugPrintf (_T("Batch: returns TRUE\n"));
 #endif
@@ -300,6 +654,11 @@ LPTSTR ReadBatchLine (LPBOOL bLocalEcho)
 	LPTSTR first;
 	LPTSTR ip;
 
+#ifdef FEATURE_PROFILE
+	if (bProfile)
+		ProfileLine (FALSE);
+#endif
+
 	/* No batch */
 	if (bc == NULL)
 		return NULL;
@@ -395,10 +754,14 @@ LPTSTR ReadBatchLine (LPBOOL bLocalEcho)
 
 			*bLocalEcho = bEcho;
 
+#ifdef FEATURE_PROFILE
+			if (bProfile)
+				ProfileLine (TRUE);
+#endif
 			return textline;
 		}
 
-		if (!FileGetString (bc->hBatchFile, textline, sizeof (textline)))
+		if (!GetBatchLine (bc->lpFile, bc->dwLine, textline, BATCH_BUFFSIZE))
 		{
 #ifdef _DEBUG
 			DebugPrintf (_T("ReadBatchLine(): Reached EOF!\n"));
@@ -415,12 +778,14 @@ LPTSTR ReadBatchLine (LPBOOL bLocalEcho)
 #ifdef _DEBUG
 		DebugPrintf (_T("ReadBatchLine(): textline: \'%s\'\n"), textline);
 #endif
+		bc->dwLine++;
 
 		/* Strip leading spaces and trailing space/control chars */
 		for (first = textline; _istspace (*first); first++)
 			;
 
-		for (ip = first + _tcslen (first) - 1; _istspace (*ip) || _istcntrl (*ip); ip--)
+		for (ip = first + _tcslen (first) - 1;
+		     ip >= first && (_istspace (*ip) || _istcntrl (*ip)); ip--)
 			;
 
 		*++ip = _T('\0');
@@ -444,6 +809,11 @@ LPTSTR ReadBatchLine (LPBOOL bLocalEcho)
 		break;
 	}
 
+#ifdef FEATURE_PROFILE
+	if (bProfile)
+		ProfileLine (TRUE);
+#endif
+
 	return first;
 }
 
@@ -8,16 +8,156 @@
 #define _BATCH_H_INCLUDED_
 
 
+/*
+ * In-memory image of a batch file. The file is read once when the batch
+ * is started and split into lines, so reading lines, GOTO and CALL do
+ * not need any further file I/O.
+ */
+/*
+ * A batch line as parsed by ParseCommandLine: aliases expanded and
+ * redirections taken out, with its %VAR% references left as they are
+ * written. It is kept for the line of the batch file it was read from,
+ * each time the line is run again only the references are looked up.
+ */
+/*
+ * A command line split for delayed expansion. Literal text and the
+ * names of !VAR! references are taken from the line as it was split,
+ * so running it again only looks up the variables.
+ */
+typedef struct tagDELAYEDSEGMENT
+{
+	INT    nStart;       /* offset in the line */
+	INT    nLength;
+	BOOL   bVariable;    /* name of a variable, without the '!' */
+} DELAYED_SEGMENT, *LPDELAYED_SEGMENT;
+
+typedef struct tagDELAYEDLINE
+{
+	INT    nVariables;   /* number of variable segments */
+	INT    nSegments;
+	DELAYED_SEGMENT Segments[1]; /* variable length */
+} DELAYED_LINE, *LPDELAYED_LINE;
+
+/*
+ * A parsed line split into literal text and the references
+ * ExpandVariables replaces.
+ */
+#define VARIABLE_TEXT        0
+#define VARIABLE_NAME        1   /* %NAME%, the segment is the name */
+#define VARIABLE_PARAM       2   /* %0..%9, the segment is the digit */
+#define VARIABLE_ALLPARAMS   3   /* %* */
+#define VARIABLE_ERRORLEVEL  4   /* %? */
+
+#define VARIABLE_FILENAME    0x0001  /* in the file name of a redirection */
+#define VARIABLE_TRAILING    0x0002  /* ends the last stage */
+
+#define EXPAND_OUT_OF_MEMORY (-1)
+#define EXPAND_REPARSE       (-2)
+
+typedef struct tagVARIABLESEGMENT
+{
+	INT    nStart;       /* offset in the line */
+	INT    nLength;
+	INT    nType;
+	INT    nFlags;
+} VARIABLE_SEGMENT, *LPVARIABLE_SEGMENT;
+
+typedef struct tagVARIABLELINE
+{
+	INT    nReferences;  /* number of segments which aren't text */
+	INT    nSegments;
+	VARIABLE_SEGMENT Segments[1]; /* variable length */
+} VARIABLE_LINE, *LPVARIABLE_LINE;
+
+typedef struct tagPARSEDSTAGE
+{
+	LPCOMMAND lpCommand; /* internal command, NULL for a program */
+	INT    nLength;      /* length of its name if the first word goes
+	                        on after it, as in "cd..", else 0 */
+} PARSED_STAGE, *LPPARSED_STAGE;
+
+typedef struct tagPARSEDLINE
+{
+	UINT   nAliasGeneration;
+	INT    nRaw;         /* length of lpRaw */
+	INT    nStages;      /* number of pipeline stages, 0 if the line
+	                        has to be parsed each time it is run */
+	INT    nRedirFlags;
+	INT    nParsed;      /* length of lpParsed, including all NULs */
+	LPTSTR lpRaw;        /* the line as read from the batch file */
+	LPTSTR lpParsed;     /* the stages, then the input, output and
+	                        error file names, each NUL terminated */
+	LPPARSED_STAGE lpStages; /* the command run by each stage */
+	LPVARIABLE_LINE lpVariables; /* the references in lpParsed, NULL
+	                        if there are none */
+	LPDELAYED_LINE lpDelayed; /* the stages split for delayed
+	                        expansion, NULL until it is first used */
+} PARSED_LINE, *LPPARSED_LINE;
+
+typedef struct tagBATCHLINE
+{
+	DWORD dwOffset;      /* offset of the first character in lpData */
+	DWORD dwLength;      /* length without the line terminator */
+	LPPARSED_LINE lpParsed; /* NULL until the line has been run */
+} BATCH_LINE, *LPBATCH_LINE;
+
+/*
+ * Index of the labels of a batch file, built on the first GOTO.
+ * Labels are hashed on their first 8 characters, which is all GOTO
+ * compares.
+ */
+#define LABEL_LENGTH     8
+#define LABEL_HASH_SIZE  64
+
+typedef struct tagBATCHLABEL
+{
+	TCHAR szLabel[LABEL_LENGTH + 1];
+	DWORD dwLine;        /* line containing the label */
+	INT   nNext;         /* next label in the same hash bucket, or -1 */
+} BATCH_LABEL, *LPBATCH_LABEL;
+
+typedef struct tagBATCHFILE
+{
+	LPSTR  lpData;       /* raw file contents */
+	DWORD  dwSize;       /* size of lpData in bytes */
+	FILETIME ftLastWrite; /* time stamp of the file when it was read */
+	LPBATCH_LINE lpLines;
+	DWORD  dwLines;      /* number of lines in lpLines */
+	BOOL   bLabels;      /* label index has been built */
+	LPBATCH_LABEL lpLabels;
+	DWORD  dwLabels;
+	INT    nLabelHash[LABEL_HASH_SIZE];
+	LPVOID lpView;       /* mapped compiled form holding all of the
+	                        above, NULL if read from the batch file */
+} BATCH_FILE, *LPBATCH_FILE;
+
+
+/*
+ * Parameters of a batch file, or the list of a FOR. The pointers index
+ * the parameter strings, which follow them in the same allocation.
+ */
+typedef struct tagBATCHPARAMS
+{
+	INT    nArgs;
+	LPTSTR lpArgs[1];    /* variable length */
+} BATCH_PARAMS, *LPBATCH_PARAMS;
+
+
 typedef struct tagBATCHCONTEXT
 {
 	struct tagBATCHCONTEXT *prev;
 	LPWIN32_FIND_DATA ffind;
 	HANDLE hBatchFile;
+	LPBATCH_FILE lpFile; /* image of the batch file, NULL for FOR contexts */
+	DWORD  dwLine;       /* index of the next line to read from lpFile */
 	LPTSTR forproto;
-	LPTSTR params;
-	INT    shiftlevel;
+	LPBATCH_PARAMS params;
+	INT    shiftlevel;   /* index of %0 in params, moved by SHIFT */
 	BOOL   bEcho;        /* Preserve echo flag across batch calls */
 	HANDLE hFind;        /* Preserve find handle when doing a for */
+	INT    nEnvScopes;   /* environment scopes open when the batch was
+	                        started, the rest are closed on its exit */
+	LPVOID lpProfile;    /* kept by the profiler, NULL if not profiled */
 	TCHAR forvar;
 } BATCH_CONTEXT, *LPBATCH_CONTEXT;
 
@@ -34,8 +174,32 @@ extern BOOL bEcho;       /* The echo flag */
 extern TCHAR textline[BATCH_BUFFSIZE]; /* Buffer for reading Batch file lines */
 
 
+LPBATCH_FILE LoadBatchFile (HANDLE);
+VOID   FreeBatchFile (LPBATCH_FILE);
+VOID   FreeParsedLine (LPPARSED_LINE);
+BOOL   GetBatchLine (LPBATCH_FILE, DWORD, LPTSTR, INT);
+BOOL   RefreshBatchFile (VOID);
+LPPARSED_LINE *GetParsedLineSlot (VOID);
+BOOL   BuildLabelIndex (LPBATCH_FILE);
+
+#ifdef FEATURE_BATCH_CACHE
+LPBATCH_FILE LoadCachedBatchFile (LPCTSTR, HANDLE);
+VOID   StoreCachedBatchFile (LPCTSTR, HANDLE, LPBATCH_FILE);
+#endif
+
+#ifdef FEATURE_REDIRECTION
+LPVARIABLE_LINE SplitVariables (LPCTSTR, INT, INT);
+INT    ExpandVariableLine (LPCTSTR, LPVARIABLE_LINE, LPTSTR *, LPINT);
+#endif
+
+#ifdef FEATURE_DELAYED_EXPANSION
+LPDELAYED_LINE SplitDelayedLine (LPCTSTR, INT, INT);
+LPTSTR ExpandDelayedLine (LPCTSTR, LPDELAYED_LINE);
+#endif
+
 LPTSTR FindArg (INT);
-LPTSTR BatchParams (LPTSTR, LPTSTR);
+LPBATCH_CONTEXT GetBatchFileContext (VOID);
+LPBATCH_PARAMS BatchParams (LPTSTR, LPTSTR);
 VOID   ExitBatch (LPTSTR);
 BOOL   Batch (LPTSTR, LPTSTR, LPTSTR);
 LPTSTR ReadBatchLine (LPBOOL);
@@ -0,0 +1,364 @@
+/*
+ *  BCACHE.C - compiled batch file cache.
+ *
+ *
+ *  History:
+ *
+ *    17-Oct-2026
+ *        Started.
+ *
+ *  If the environment variable CMD_BATCH_CACHE names a directory, the
+ *  image of every batch file that is started is written there: the line
+ *  table, the label index and the text of the file. When the batch file
+ *  is started again, the compiled form is mapped into memory instead of
+ *  splitting the file and indexing its labels. It's used only if the
+ *  batch file is still the same file (volume serial number and file
+ *  index) with the size and last write time it was compiled from, so a
+ *  stale or damaged cache file is ignored and replaced. The contents
+ *  aren't read again, that would cost more than the cache saves.
+ *
+ *  A cache file is laid out as
+ *
+ *    BATCH_CACHE_HEADER
+ *    BATCH_LINE  [dwLines]
+ *    BATCH_LABEL [dwLabels]
+ *    the batch file, NUL terminated
+ *
+ *  with each part starting on an 8 byte boundary. The view is mapped
+ *  copy on write, so the parsed form of the lines can still be kept in
+ *  the line table.
+ */
+
+#include "config.h"
+
+#ifdef FEATURE_BATCH_CACHE
+#include <windows.h>
+#include <tchar.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "cmd.h"
+#include "batch.h"
+
+
+#define BATCH_CACHE_MAGIC    0x31434243   /* "CBC1" */
+#define BATCH_CACHE_VERSION  3
+
+#define CACHE_ALIGN(n)  (((n) + 7) & ~7)
+
+/* FNV-1a */
+#define HASH_START        2166136261u
+#define HASH_STEP(h, c)   (((h) ^ (DWORD)(c)) * 16777619u)
+
+
+typedef struct tagBATCHCACHEHEADER
+{
+	DWORD    dwMagic;
+	DWORD    dwVersion;
+	DWORD    dwLineSize;      /* sizeof (BATCH_LINE) of the writer */
+	DWORD    dwLabelSize;     /* sizeof (BATCH_LABEL) of the writer */
+	DWORD    dwSize;          /* size of the batch file */
+	FILETIME ftLastWrite;     /* and its time stamp */
+	DWORD    dwVolumeSerial;  /* and the file it was read from */
+	DWORD    dwIndexHigh;
+	DWORD    dwIndexLow;
+	DWORD    dwLines;
+	DWORD    dwLabels;
+	INT      nLabelHash[LABEL_HASH_SIZE];
+	TCHAR    szFullName[MAX_PATH];
+} BATCH_CACHE_HEADER, *LPBATCH_CACHE_HEADER;
+
+
+/*
+ * Computes where the parts of a cache file start, returns its size.
+ */
+
+static DWORD GetCacheLayout (DWORD dwLines, DWORD dwLabels, DWORD dwSize,
+                             LPDWORD lpdwLines, LPDWORD lpdwLabels, LPDWORD lpdwData)
+{
+	*lpdwLines = CACHE_ALIGN (sizeof (BATCH_CACHE_HEADER));
+	*lpdwLabels = CACHE_ALIGN (*lpdwLines + dwLines * sizeof (BATCH_LINE));
+	*lpdwData = CACHE_ALIGN (*lpdwLabels + dwLabels * sizeof (BATCH_LABEL));
+
+	return *lpdwData + dwSize + 1;
+}
+
+
+/*
+ * Builds the name of the cache file of a batch file from a hash of its
+ * full name. Returns FALSE if there is no cache directory.
+ */
+
+static BOOL GetCacheFileName (LPCTSTR lpFullName, LPTSTR lpCacheName)
+{
+	LPCTSTR lpDir = GetEnvVar (_T("CMD_BATCH_CACHE"));
+	LPCTSTR p;
+	DWORD h = HASH_START;
+
+	if (lpDir == NULL || *lpDir == _T('\0') ||
+	    _tcslen (lpDir) + 14 >= MAX_PATH || _tcslen (lpFullName) >= MAX_PATH)
+		return FALSE;
+
+	/* names of files are compared without regard to case */
+	for (p = lpFullName; *p; p++)
+		h = HASH_STEP (h, _totupper (*p));
+
+	_stprintf (lpCacheName, _T("%s\\%08lX.cbf"), lpDir, h);
+
+	return TRUE;
+}
+
+
+/*
+ * Checks that a mapped cache file belongs to the batch file, is up to
+ * date and that all its offsets are in range.
+ */
+
+static BOOL CheckCacheFile (LPBYTE lpView, DWORD dwViewSize, LPCTSTR lpFullName,
+                            BY_HANDLE_FILE_INFORMATION *fi)
+{
+	LPBATCH_CACHE_HEADER lpHeader = (LPBATCH_CACHE_HEADER)lpView;
+	LPBATCH_LINE  lpLines;
+	LPBATCH_LABEL lpLabels;
+	DWORD dwLines, dwLabels, dwData;
+	DWORD n;
+
+	if (lpHeader->dwMagic != BATCH_CACHE_MAGIC ||
+	    lpHeader->dwVersion != BATCH_CACHE_VERSION ||
+	    lpHeader->dwLineSize != sizeof (BATCH_LINE) ||
+	    lpHeader->dwLabelSize != sizeof (BATCH_LABEL))
+		return FALSE;
+
+	if (fi->nFileSizeHigh != 0 || lpHeader->dwSize != fi->nFileSizeLow ||
+	    CompareFileTime (&lpHeader->ftLastWrite, &fi->ftLastWriteTime) != 0 ||
+	    lpHeader->dwVolumeSerial != fi->dwVolumeSerialNumber ||
+	    lpHeader->dwIndexHigh != fi->nFileIndexHigh ||
+	    lpHeader->dwIndexLow != fi->nFileIndexLow)
+		return FALSE;
+
+	for (n = 0; n < MAX_PATH && lpHeader->szFullName[n]; n++)
+		;
+	if (n == MAX_PATH || _tcsicmp (lpHeader->szFullName, lpFullName))
+		return FALSE;
+
+	/* no file has more lines than characters, this keeps the sizes
+	 * below from overflowing */
+	if (lpHeader->dwLines > lpHeader->dwSize + 1 ||
+	    lpHeader->dwLabels > lpHeader->dwLines)
+		return FALSE;
+
+	if (GetCacheLayout (lpHeader->dwLines, lpHeader->dwLabels, lpHeader->dwSize,
+	                    &dwLines, &dwLabels, &dwData) != dwViewSize)
+		return FALSE;
+
+	if (lpView[dwData + lpHeader->dwSize] != '\0')
+		return FALSE;
+
+	lpLines = (LPBATCH_LINE)(lpView + dwLines);
+	for (n = 0; n < lpHeader->dwLines; n++)
+	{
+		if (lpLines[n].dwOffset > lpHeader->dwSize ||
+		    lpLines[n].dwLength > lpHeader->dwSize - lpLines[n].dwOffset ||
+		    lpLines[n].lpParsed != NULL)
+			return FALSE;
+	}
+
+	/* BuildLabelIndex puts each label in front of its bucket, so the
+	 * chains run to lower indices and GOTO can't loop on them */
+	lpLabels = (LPBATCH_LABEL)(lpView + dwLabels);
+	for (n = 0; n < lpHeader->dwLabels; n++)
+	{
+		if (lpLabels[n].dwLine >= lpHeader->dwLines ||
+		    lpLabels[n].nNext < -1 || lpLabels[n].nNext >= (INT)n ||
+		    lpLabels[n].szLabel[LABEL_LENGTH] != _T('\0'))
+			return FALSE;
+	}
+
+	for (n = 0; n < LABEL_HASH_SIZE; n++)
+	{
+		if (lpHeader->nLabelHash[n] < -1 ||
+		    lpHeader->nLabelHash[n] >= (INT)lpHeader->dwLabels)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+/*
+ * Returns the image of a batch file from its compiled form, or NULL if
+ * there is no usable one.
+ */
+
+LPBATCH_FILE LoadCachedBatchFile (LPCTSTR lpFullName, HANDLE hBatchFile)
+{
+	BY_HANDLE_FILE_INFORMATION fi;
+	LPBATCH_CACHE_HEADER lpHeader;
+	LPBATCH_FILE lpFile;
+	TCHAR  szCacheName[MAX_PATH];
+	HANDLE hCache;
+	HANDLE hMapping;
+	LPBYTE lpView;
+	DWORD  dwViewSize;
+	DWORD  dwLines, dwLabels, dwData;
+
+	if (!GetCacheFileName (lpFullName, szCacheName) ||
+	    !GetFileInformationByHandle (hBatchFile, &fi))
+		return NULL;
+
+	/* the file may be replaced by another process while it is mapped */
+	hCache = CreateFile (szCacheName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+	                     NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hCache == INVALID_HANDLE_VALUE)
+		return NULL;
+
+	dwViewSize = GetFileSize (hCache, NULL);
+	if (dwViewSize == 0xFFFFFFFF || dwViewSize < sizeof (BATCH_CACHE_HEADER))
+	{
+		CloseHandle (hCache);
+		return NULL;
+	}
+
+	hMapping = CreateFileMapping (hCache, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	CloseHandle (hCache);
+	if (hMapping == NULL)
+		return NULL;
+
+	lpView = (LPBYTE)MapViewOfFile (hMapping, FILE_MAP_COPY, 0, 0, 0);
+	CloseHandle (hMapping);
+	if (lpView == NULL)
+		return NULL;
+
+	if (!CheckCacheFile (lpView, dwViewSize, lpFullName, &fi))
+	{
+#ifdef _DEBUG
+		DebugPrintf (_T("LoadCachedBatchFile: %s is stale\n"), szCacheName);
+#endif
+		UnmapViewOfFile (lpView);
+		return NULL;
+	}
+
+	lpFile = (LPBATCH_FILE)malloc (sizeof (BATCH_FILE));
+	if (lpFile == NULL)
+	{
+		UnmapViewOfFile (lpView);
+		return NULL;
+	}
+
+	lpHeader = (LPBATCH_CACHE_HEADER)lpView;
+	GetCacheLayout (lpHeader->dwLines, lpHeader->dwLabels, lpHeader->dwSize,
+	                &dwLines, &dwLabels, &dwData);
+
+	lpFile->lpData = (LPSTR)(lpView + dwData);
+	lpFile->dwSize = lpHeader->dwSize;
+	lpFile->ftLastWrite = lpHeader->ftLastWrite;
+	lpFile->lpLines = (LPBATCH_LINE)(lpView + dwLines);
+	lpFile->dwLines = lpHeader->dwLines;
+	lpFile->bLabels = TRUE;
+	lpFile->lpLabels = (LPBATCH_LABEL)(lpView + dwLabels);
+	lpFile->dwLabels = lpHeader->dwLabels;
+	memcpy (lpFile->nLabelHash, lpHeader->nLabelHash, sizeof (lpFile->nLabelHash));
+	lpFile->lpView = lpView;
+
+#ifdef _DEBUG
+	DebugPrintf (_T("LoadCachedBatchFile: %s mapped from %s\n"), lpFullName, szCacheName);
+#endif
+
+	return lpFile;
+}
+
+
+/*
+ * Writes the compiled form of a batch file image to the cache. The file
+ * is written under a temporary name and then renamed, so other shells
+ * never see it half written. Failures are ignored, the cache is only
+ * an optimization.
+ */
+
+VOID StoreCachedBatchFile (LPCTSTR lpFullName, HANDLE hBatchFile, LPBATCH_FILE lpFile)
+{
+	BY_HANDLE_FILE_INFORMATION fi;
+	LPBATCH_CACHE_HEADER lpHeader;
+	LPBATCH_LINE lpLines;
+	TCHAR  szCacheName[MAX_PATH];
+	TCHAR  szTempName[MAX_PATH + 16];
+	HANDLE hCache;
+	LPBYTE lpBuffer;
+	DWORD  dwCacheSize;
+	DWORD  dwLines, dwLabels, dwData;
+	DWORD  dwWritten;
+	DWORD  n;
+	BOOL   bWritten;
+
+	if (!GetCacheFileName (lpFullName, szCacheName) ||
+	    !GetFileInformationByHandle (hBatchFile, &fi))
+		return;
+
+	if (!lpFile->bLabels && !BuildLabelIndex (lpFile))
+		return;
+
+	dwCacheSize = GetCacheLayout (lpFile->dwLines, lpFile->dwLabels, lpFile->dwSize,
+	                              &dwLines, &dwLabels, &dwData);
+
+	lpBuffer = (LPBYTE)calloc (dwCacheSize, 1);
+	if (lpBuffer == NULL)
+		return;
+
+	lpHeader = (LPBATCH_CACHE_HEADER)lpBuffer;
+	lpHeader->dwMagic = BATCH_CACHE_MAGIC;
+	lpHeader->dwVersion = BATCH_CACHE_VERSION;
+	lpHeader->dwLineSize = sizeof (BATCH_LINE);
+	lpHeader->dwLabelSize = sizeof (BATCH_LABEL);
+	lpHeader->dwSize = lpFile->dwSize;
+	lpHeader->ftLastWrite = lpFile->ftLastWrite;
+	lpHeader->dwVolumeSerial = fi.dwVolumeSerialNumber;
+	lpHeader->dwIndexHigh = fi.nFileIndexHigh;
+	lpHeader->dwIndexLow = fi.nFileIndexLow;
+	lpHeader->dwLines = lpFile->dwLines;
+	lpHeader->dwLabels = lpFile->dwLabels;
+	memcpy (lpHeader->nLabelHash, lpFile->nLabelHash, sizeof (lpHeader->nLabelHash));
+	_tcscpy (lpHeader->szFullName, lpFullName);
+
+	/* the parsed lines are only valid in this process */
+	lpLines = (LPBATCH_LINE)(lpBuffer + dwLines);
+	for (n = 0; n < lpFile->dwLines; n++)
+	{
+		lpLines[n].dwOffset = lpFile->lpLines[n].dwOffset;
+		lpLines[n].dwLength = lpFile->lpLines[n].dwLength;
+		lpLines[n].lpParsed = NULL;
+	}
+
+	memcpy (lpBuffer + dwLabels, lpFile->lpLabels, lpFile->dwLabels * sizeof (BATCH_LABEL));
+	memcpy (lpBuffer + dwData, lpFile->lpData, lpFile->dwSize);
+
+	_stprintf (szTempName, _T("%s.%lu"), szCacheName, GetCurrentProcessId ());
+
+	hCache = CreateFile (szTempName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+	                     FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hCache == INVALID_HANDLE_VALUE)
+	{
+		free (lpBuffer);
+		return;
+	}
+
+	bWritten = WriteFile (hCache, lpBuffer, dwCacheSize, &dwWritten, NULL) &&
+	           dwWritten == dwCacheSize;
+	CloseHandle (hCache);
+	free (lpBuffer);
+
+	if (!bWritten ||
+	    !MoveFileEx (szTempName, szCacheName, MOVEFILE_REPLACE_EXISTING))
+	{
+		DeleteFile (szTempName);
+		return;
+	}
+
+#ifdef _DEBUG
+	DebugPrintf (_T("StoreCachedBatchFile: %s compiled to %s\n"), lpFullName, szCacheName);
+#endif
+}
+
+#endif /* FEATURE_BATCH_CACHE */
+
+/* EOF */
@@ -63,6 +63,11 @@ INT cmd_call (LPTSTR cmd, LPTSTR param)
 		return 0;
 	}
 
+#ifdef FEATURE_TRACE
+	if (bTrace)
+		TraceEvent (TRACE_CALL, 'i', param, 0);
+#endif
+
 	n = (LPBATCH_CONTEXT)malloc (sizeof (BATCH_CONTEXT));
 
 	if (n == NULL)
@@ -75,8 +80,12 @@ INT cmd_call (LPTSTR cmd, LPTSTR param)
 	bc = n;
 
 	bc->hBatchFile = INVALID_HANDLE_VALUE;
+	bc->lpFile = NULL;
+	bc->dwLine = 0;
 	bc->params = NULL;
 	bc->shiftlevel = 0;
+	bc->nEnvScopes = GetEnvScopeDepth ();
+	bc->lpProfile = NULL;
 	bc->forvar = 0;        /* HBP004 */
 	bc->forproto = NULL;   /* HBP004 */
 
@@ -52,12 +52,23 @@ GetCharacterTimeout (LPTCH ch, DWORD dwMilliseconds)
 
 	hInput = GetStdHandle (STD_INPUT_HANDLE);
 
-	//if the timeout experied return GC_TIMEOUT
-	if (WaitForSingleObject (hInput, dwMilliseconds) == WAIT_TIMEOUT)
-		return GC_TIMEOUT;
+	if (bHeadless)
+	{
+		//no console events, take the next character of the input
+		ConInKey (&lpBuffer);
+	}
+	else
+	{
+		//show the prompt before waiting
+		ConOutFlush ();
 
-	//otherwise get the event
-	ReadConsoleInput (hInput, &lpBuffer, 1, &dwRead);
+		//if the timeout experied return GC_TIMEOUT
+		if (WaitForSingleObject (hInput, dwMilliseconds) == WAIT_TIMEOUT)
+			return GC_TIMEOUT;
+
+		//otherwise get the event
+		ReadConsoleInput (hInput, &lpBuffer, 1, &dwRead);
+	}
 
 	//if the event is a key pressed
 	if ((lpBuffer.EventType == KEY_EVENT) &&
@@ -21,6 +21,9 @@
  *
  *    20-Jan-1998 (Eric Kohl <ekohl@abo.rhein-zeitung.de>)
  *        Redirection ready!
+ *
+ *    17-Oct-2026
+ *        Clears with VT escape sequences when the console supports them.
  */
 
 #include "config.h"
@@ -46,17 +49,30 @@ INT cmd_cls (LPTSTR cmd, LPTSTR param)
 		return 0;
 	}
 
-	GetConsoleScreenBufferInfo (hConsole, &csbi);
+	/* no screen to clear */
+	if (bHeadless)
+		return 0;
+
+	if (ConIsVirtualTerminal ())
+	{
+		/* the window and what was scrolled out of it, in the current
+		 * colors */
+		ConOutPrintf (_T("\x1b[H\x1b[2J\x1b[3J"));
+		bIgnoreEcho = TRUE;
+		return 0;
+	}
+
+	GetConsoleScreenBufferInfo (GetScreenHandle (), &csbi);
 
 	coPos.X = 0;
 	coPos.Y = 0;
-	FillConsoleOutputAttribute (hConsole, wColor,
+	FillConsoleOutputAttribute (GetScreenHandle (), wColor,
 								(csbi.dwSize.X)*(csbi.dwSize.Y),
 								coPos, &dwWritten);
-	FillConsoleOutputCharacter (hConsole, _T(' '),
+	FillConsoleOutputCharacter (GetScreenHandle (), _T(' '),
 								(csbi.dwSize.X)*(csbi.dwSize.Y),
 								coPos, &dwWritten);
-	SetConsoleCursorPosition (hConsole, coPos);
+	SetConsoleCursorPosition (GetScreenHandle (), coPos);
 
 	bIgnoreEcho = TRUE;
 
@@ -137,21 +137,23 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <winnt.h>
-#include <winternl.h>
-
-#ifndef NT_SUCCESS
-#define NT_SUCCESS(StatCode)  ((NTSTATUS)(StatCode) >= 0)
-#endif
 
 #include "cmd.h"
 #include "batch.h"
 
-typedef NTSTATUS (STDCALL *NtQueryInformationProcessProc)(HANDLE, PROCESSINFOCLASS,
-                                                          PVOID, ULONG, PULONG);
-typedef NTSTATUS (STDCALL *NtReadVirtualMemoryProc)(HANDLE, PVOID, PVOID, ULONG, PULONG);
+/* number of executables whose subsystem is remembered */
+#define IMAGE_CACHE_SIZE  16
+
+typedef struct tagIMAGEINFO
+{
+	TCHAR    szFullName[MAX_PATH];
+	FILETIME ftLastWrite;
+	BOOL     bConsole;
+} IMAGEINFO, *LPIMAGEINFO;
 
 BOOL bExit = FALSE;       /* indicates EXIT was typed */
 BOOL bCanExit = TRUE;     /* indicates if this shell is exitable */
+BOOL bHeadless = FALSE;   /* no console, see ConSetHeadless */
 BOOL bCtrlBreak = FALSE;  /* Ctrl-Break or Ctrl-C hit */
 BOOL bIgnoreEcho = FALSE; /* Ignore 'newline' before 'cls' */
 INT  nErrorLevel = 0;     /* Errorlevel of last launched external program */
@@ -160,11 +162,50 @@ DWORD dwChildProcessId = 0;
 OSVERSIONINFO osvi;
 HANDLE hIn;
 HANDLE hOut;
-HANDLE hConsole;
+static HANDLE hConsole = INVALID_HANDLE_VALUE;
+static BOOL bConsoleOpened = FALSE;
+
+#ifdef FEATURE_REDIRECTION
+/* size of the buffer of the anonymous pipes between pipeline stages */
+#define PIPE_BUFFER_SIZE  16384
+
+/* how a pipeline stage other than the last one is run */
+#define STAGE_SHELL     0   /* in the shell, output to a temporary file */
+#define STAGE_EXTERNAL  1   /* external program writing into a pipe */
+#define STAGE_THREAD    2   /* internal command on a worker thread */
+
+/* processes and worker threads of the current pipeline still running,
+ * with the command lines of the processes, NULL for the threads */
+static HANDLE hPipeStage[MAXIMUM_WAIT_OBJECTS];
+static LPTSTR lpPipeCommand[MAXIMUM_WAIT_OBJECTS];
+#ifdef FEATURE_TRACE
+static DWORD  dwPipeProcessId[MAXIMUM_WAIT_OBJECTS];
+#endif
+static INT    nPipeStages = 0;
+static BOOL   bPipeStage = FALSE; /* Execute must not wait for the child */
+
+/* internal command run on a worker thread, writing into a pipe */
+typedef struct tagPIPEWORKER
+{
+	LPCOMMAND cmdptr;
+	HANDLE    hOutput;
+	TCHAR     com[CMDLINE_LENGTH];
+	TCHAR     rest[1];   /* variable length */
+} PIPEWORKER, *LPPIPEWORKER;
+#endif
+
+#ifdef INCLUDE_CMD_JOBS
+static BOOL bBackground = FALSE;  /* run the command as a background job */
+#endif
+
+#ifdef FEATURE_DELAYED_EXPANSION
+/* nesting of ParseCommandLine, commands run by IF or CALL are expanded
+ * with the command line which runs them */
+static INT nParseDepth = 0;
+#endif
 
-static NtQueryInformationProcessProc NtQueryInformationProcessPtr;
-static NtReadVirtualMemoryProc       NtReadVirtualMemoryPtr;
-static BOOL NtDllChecked = FALSE;
+static IMAGEINFO ImageCache[IMAGE_CACHE_SIZE];
+static INT nNextImage = 0;
 
 #ifdef INCLUDE_CMD_COLOR
 WORD wColor;              /* current color */
@@ -182,62 +223,93 @@ static BOOL IsDelimiter (TCHAR c)
 }
 
 /*
- * Is a process a console process?
+ * Reads the subsystem from the PE optional header of an executable.
+ * Anything that isn't a GUI program (DOS and console programs, files
+ * that can't be read) is treated as a console program, which the shell
+ * waits for.
  */
-static BOOL IsConsoleProcess(HANDLE Process)
+
+static BOOL ReadImageSubsystem (LPCTSTR szFullName)
 {
-	NTSTATUS Status;
-	PROCESS_BASIC_INFORMATION Info;
-	PEB ProcessPeb;
-	ULONG BytesRead;
-	HMODULE NtDllModule;
-
-	/* Some people like to run ReactOS cmd.exe on Win98, it helps in the
-           build process. So don't link implicitly against ntdll.dll, load it
-           dynamically instead */
-	if (! NtDllChecked)
-	{
-		NtDllChecked = TRUE;
-		NtDllModule = LoadLibrary(_T("ntdll.dll"));
-		if (NULL == NtDllModule)
-		{
-			/* Probably non-WinNT system. Just wait for the commands
-                           to finish. */
-			NtQueryInformationProcessPtr = NULL;
-			NtReadVirtualMemoryPtr = NULL;
-			return TRUE;
-		}
-		NtQueryInformationProcessPtr = (NtQueryInformationProcessProc)
-                                               GetProcAddress(NtDllModule, "NtQueryInformationProcess");
-		NtReadVirtualMemoryPtr = (NtReadVirtualMemoryProc)
-		                         GetProcAddress(NtDllModule, "NtReadVirtualMemory");
-	}
+	IMAGE_DOS_HEADER DosHeader;
+	BYTE   NtHeader[sizeof (DWORD) + sizeof (IMAGE_FILE_HEADER) +
+	                FIELD_OFFSET (IMAGE_OPTIONAL_HEADER, Subsystem) + sizeof (WORD)];
+	WORD   Subsystem;
+	HANDLE hFile;
+	DWORD  dwRead;
+	BOOL   bConsole = TRUE;
+
+	hFile = CreateFile (szFullName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+	                    NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return TRUE;
 
-	if (NULL == NtQueryInformationProcessPtr || NULL == NtReadVirtualMemoryPtr)
+	/* the offset of Subsystem is the same for 32 and 64 bit images */
+	if (ReadFile (hFile, &DosHeader, sizeof (DosHeader), &dwRead, NULL) &&
+	    dwRead == sizeof (DosHeader) &&
+	    DosHeader.e_magic == IMAGE_DOS_SIGNATURE &&
+	    SetFilePointer (hFile, DosHeader.e_lfanew, NULL, FILE_BEGIN) != 0xFFFFFFFF &&
+	    ReadFile (hFile, NtHeader, sizeof (NtHeader), &dwRead, NULL) &&
+	    dwRead == sizeof (NtHeader) &&
+	    *(DWORD *)NtHeader == IMAGE_NT_SIGNATURE)
 	{
-		return TRUE;
+		memcpy (&Subsystem, NtHeader + sizeof (NtHeader) - sizeof (WORD), sizeof (WORD));
+		bConsole = (Subsystem != IMAGE_SUBSYSTEM_WINDOWS_GUI);
 	}
 
-	Status = NtQueryInformationProcessPtr(Process, ProcessBasicInformation,
-                                              &Info, sizeof(PROCESS_BASIC_INFORMATION), NULL);
-	if (! NT_SUCCESS(Status))
-	{
-#ifdef _DEBUG
-		DebugPrintf (_T("NtQueryInformationProcess failed with status %08x\n"), Status);
-#endif
+	CloseHandle (hFile);
+
+	return bConsole;
+}
+
+
+/*
+ * Is an executable a console program?
+ *
+ * The answer is remembered by path and last write time of the file, so
+ * starting the same program again only costs a time stamp lookup.
+ */
+
+static BOOL IsConsoleImage (LPCTSTR szFullName)
+{
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+	LPIMAGEINFO lpImage;
+	INT i;
+
+	if (!GetFileAttributesEx (szFullName, GetFileExInfoStandard, &fad))
 		return TRUE;
+
+	if (_tcslen (szFullName) >= MAX_PATH)
+		return ReadImageSubsystem (szFullName);
+
+	for (i = 0; i < IMAGE_CACHE_SIZE; i++)
+	{
+		lpImage = &ImageCache[i];
+		if (!_tcsicmp (lpImage->szFullName, szFullName))
+		{
+			if (CompareFileTime (&lpImage->ftLastWrite, &fad.ftLastWriteTime) == 0)
+				return lpImage->bConsole;
+			break;
+		}
 	}
-	Status = NtReadVirtualMemoryPtr(Process, Info.PebBaseAddress, &ProcessPeb,
-                                        sizeof(PEB), &BytesRead);
-	if (! NT_SUCCESS(Status) || sizeof(PEB) != BytesRead)
+
+	/* replace the entry of an outdated file or the oldest one */
+	if (i == IMAGE_CACHE_SIZE)
 	{
+		lpImage = &ImageCache[nNextImage];
+		nNextImage = (nNextImage + 1) % IMAGE_CACHE_SIZE;
+	}
+
+	_tcscpy (lpImage->szFullName, szFullName);
+	lpImage->ftLastWrite = fad.ftLastWriteTime;
+	lpImage->bConsole = ReadImageSubsystem (szFullName);
+
 #ifdef _DEBUG
-		DebugPrintf (_T("Couldn't read virt mem status %08x bytes read %lu\n"), Status, BytesRead);
+	DebugPrintf (_T("IsConsoleImage: %s is a %s program\n"), szFullName,
+	             lpImage->bConsole ? _T("console") : _T("GUI"));
 #endif
-		return TRUE;
-	}
 
-	return IMAGE_SUBSYSTEM_WINDOWS_CUI == ProcessPeb.ImageSubSystem;
+	return lpImage->bConsole;
 }
 
 
@@ -319,9 +391,29 @@ Execute (LPTSTR full, LPTSTR first, LPTSTR rest)
 		stui.dwFlags = STARTF_USESHOWWINDOW;
 		stui.wShowWindow = SW_SHOWDEFAULT;
 
-		// return console to standard mode
-		SetConsoleMode (GetStdHandle(STD_INPUT_HANDLE),
-		                ENABLE_LINE_INPUT | ENABLE_PROCESSED_INPUT | ENABLE_ECHO_INPUT );
+		/* the child writes to the same handles, after what was
+		 * printed before */
+		ConOutFlush ();
+		if (bHeadless)
+		{
+			/* and reads from the same input */
+			ConInRelease ();
+		}
+		else
+		{
+			// return console to standard mode
+			SetConsoleMode (GetStdHandle(STD_INPUT_HANDLE),
+			                ENABLE_LINE_INPUT | ENABLE_PROCESSED_INPUT | ENABLE_ECHO_INPUT );
+#ifdef FEATURE_VIRTUAL_TERMINAL
+			ConSuspendVirtualTerminal ();
+#endif
+		}
+
+#ifdef INCLUDE_CMD_JOBS
+		/* respect the JOBS /MAX limit before starting another job */
+		if (bBackground)
+			ThrottleJobs ();
+#endif
 
 		if (CreateProcess (szFullName,
 		                   full,
@@ -334,8 +426,37 @@ Execute (LPTSTR full, LPTSTR first, LPTSTR rest)
 		                   &stui,
 		                   &prci))
 		{
-			if (IsConsoleProcess(prci.hProcess))
+#ifdef FEATURE_REDIRECTION
+			if (bPipeStage)
 			{
+				/* The next pipeline stage reads our output, so let it
+				 * run. ParseCommandLine waits for it at the end. */
+#ifdef FEATURE_TRACE
+				if (bTrace)
+					TraceEvent (TRACE_PROCESS, 'b', full, prci.dwProcessId);
+				dwPipeProcessId[nPipeStages] = prci.dwProcessId;
+#endif
+				lpPipeCommand[nPipeStages] = _tcsdup (full);
+				hPipeStage[nPipeStages++] = prci.hProcess;
+				prci.hProcess = NULL;
+			}
+			else
+#endif
+#ifdef INCLUDE_CMD_JOBS
+			if (bBackground)
+			{
+				/* the job table waits for it */
+				AddJob (prci.hProcess, prci.dwProcessId, full);
+				prci.hProcess = NULL;
+			}
+			else
+#endif
+			if (IsConsoleImage (szFullName))
+			{
+#ifdef FEATURE_TRACE
+				if (bTrace)
+					TraceEvent (TRACE_PROCESS, 'B', first, prci.dwProcessId);
+#endif
 				/* FIXME: Protect this with critical section */
 				bChildProcessRunning = TRUE;
 				dwChildProcessId = prci.dwProcessId;
@@ -347,9 +468,34 @@ Execute (LPTSTR full, LPTSTR first, LPTSTR rest)
 
 				GetExitCodeProcess (prci.hProcess, &dwExitCode);
 				nErrorLevel = (INT)dwExitCode;
+#ifdef FEATURE_TELEMETRY
+				RecordProcessTelemetry (prci.hProcess, full, dwExitCode, TRUE);
+#endif
+#ifdef FEATURE_PROFILE
+				if (bProfile)
+					ProfileChildProcess (prci.hProcess);
+#endif
+#ifdef FEATURE_TRACE
+				if (bTrace)
+					TraceEvent (TRACE_PROCESS, 'E', first, dwExitCode);
+#endif
+			}
+			else
+			{
+#ifdef FEATURE_TRACE
+				/* a GUI program is left running */
+				if (bTrace)
+					TraceEvent (TRACE_PROCESS, 'i', full, prci.dwProcessId);
+#endif
+#ifdef FEATURE_TELEMETRY
+				/* it is recorded once it has finished */
+				WatchProcessTelemetry (prci.hProcess, full);
+				prci.hProcess = NULL;
+#endif
 			}
 			CloseHandle (prci.hThread);
-			CloseHandle (prci.hProcess);
+			if (prci.hProcess != NULL)
+				CloseHandle (prci.hProcess);
 		}
 		else
 		{
@@ -357,8 +503,14 @@ Execute (LPTSTR full, LPTSTR first, LPTSTR rest)
 			              _T("Error executing CreateProcess()!!\n"));
 		}
 		// restore console mode
-		SetConsoleMode( GetStdHandle( STD_INPUT_HANDLE ),
-				ENABLE_PROCESSED_INPUT );
+		if (!bHeadless)
+		{
+			SetConsoleMode( GetStdHandle( STD_INPUT_HANDLE ),
+					ENABLE_PROCESSED_INPUT );
+#ifdef FEATURE_VIRTUAL_TERMINAL
+			ConResumeVirtualTerminal ();
+#endif
+		}
 	}
 
 #ifndef __REACTOS__
@@ -367,20 +519,343 @@ Execute (LPTSTR full, LPTSTR first, LPTSTR rest)
 }
 
 
+/*
+ * Copies the first word of a command line in lower case to com and
+ * returns a pointer to the rest of the line (after the white space
+ * following the first word).
+ *
+ * line - the command line, initial white space already skipped
+ * com  - receives the first word, CMDLINE_LENGTH characters
+ */
+
+static LPTSTR
+GetFirstWord (LPTSTR line, LPTSTR com)
+{
+	LPTSTR cp = com;
+	LPTSTR rest = line;
+
+	if (*rest == _T('"'))
+	{
+		/* treat quoted words specially */
+
+		rest++;
+
+		while(*rest != _T('\0') && *rest != _T('"') &&
+		      cp < com + CMDLINE_LENGTH - 1)
+			*cp++ = _totlower (*rest++);
+		if (*rest == _T('"'))
+			rest++;
+	}
+	else
+	{
+		while (!IsDelimiter (*rest) && cp < com + CMDLINE_LENGTH - 1)
+			*cp++ = _totlower (*rest++);
+	}
+
+	/* Terminate first word */
+	*cp = _T('\0');
+
+	/* Skip over whitespace to rest of line */
+	while (_istspace (*rest))
+		rest++;
+
+	return rest;
+}
+
+
+#ifdef FEATURE_REDIRECTION
+/*
+ * Looks up the internal command of a pipeline stage. Returns NULL for
+ * external programs. On return *prest points to the parameters.
+ */
+
+static LPCOMMAND
+FindStageCommand (LPTSTR line, LPTSTR com, LPTSTR *prest)
+{
+	LPCOMMAND cmdptr;
+	INT cl;
+
+	while (_istspace (*line))
+		line++;
+
+	*prest = GetFirstWord (line, com);
+
+	cmdptr = FindCommand (com, &cl);
+	if (cmdptr != NULL && cl)
+	{
+		com[cl] = _T('\0');
+		*prest = line + cl;
+	}
+
+	return cmdptr;
+}
+
+
+/*
+ * Returns TRUE for the parameters of ECHO ON and ECHO OFF, which change
+ * the state of the shell instead of writing output.
+ */
+
+static BOOL
+IsEchoSwitch (LPCTSTR param)
+{
+	INT len = _tcslen (param);
+
+	while (len > 0 && _istspace (param[len - 1]))
+		len--;
+
+	return ((len == 2 && !_tcsnicmp (param, D_ON, 2)) ||
+	        (len == 3 && !_tcsnicmp (param, D_OFF, 3)));
+}
+
+
+/*
+ * Decides how a pipeline stage is run:
+ *
+ * STAGE_EXTERNAL - external programs run as a process of their own.
+ * STAGE_THREAD   - internal commands which only write output run on a
+ *                  worker thread, unless another stage of the pipeline
+ *                  uses the same command, as the commands keep state
+ *                  in static variables.
+ * STAGE_SHELL    - everything else (other internal commands, batch
+ *                  files, drive changes) runs inside the shell.
+ *
+ * pipeline - the first of the nStages NUL separated stages
+ */
+
+static INT
+GetStageType (LPTSTR line, LPTSTR pipeline, INT nStages)
+{
+	TCHAR com[CMDLINE_LENGTH];
+	TCHAR szFullName[MAX_PATH];
+	LPCOMMAND cmdptr;
+	LPCOMMAND other;
+	LPTSTR rest;
+	LPTSTR ext;
+	LPTSTR s;
+
+	cmdptr = FindStageCommand (line, com, &rest);
+
+	if (*com == _T('\0') || _tcslen (com) > MAX_PATH)
+		return STAGE_SHELL;
+
+	if (cmdptr != NULL)
+	{
+		if (!(cmdptr->flags & CMD_THREADSAFE))
+			return STAGE_SHELL;
+
+		if (cmdptr->func == CommandEcho && IsEchoSwitch (rest))
+			return STAGE_SHELL;
+
+		for (s = pipeline; nStages-- > 0; s += _tcslen (s) + 1)
+		{
+			if (s == line)
+				continue;
+
+			other = FindStageCommand (s, com, &rest);
+			if (other != NULL && other->func == cmdptr->func)
+				return STAGE_SHELL;
+		}
+
+		return ConInitThreadOutput () ? STAGE_THREAD : STAGE_SHELL;
+	}
+
+	if ((_istalpha (com[0])) && (!_tcscmp (com + 1, _T(":"))))
+		return STAGE_SHELL;
+
+	if (!SearchForExecutable (com, szFullName))
+		return STAGE_SHELL;
+
+	ext = _tcsrchr (szFullName, _T('.'));
+	if (ext != NULL &&
+	    (!_tcsicmp (ext, _T(".bat")) || !_tcsicmp (ext, _T(".cmd"))))
+		return STAGE_SHELL;
+
+	return STAGE_EXTERNAL;
+}
+
+
+static DWORD WINAPI
+PipeWorkerThread (LPVOID lpParameter)
+{
+	LPPIPEWORKER lpWorker = (LPPIPEWORKER)lpParameter;
+
+	ConSetThreadOutput (lpWorker->hOutput);
+
+	lpWorker->cmdptr->func (lpWorker->com, lpWorker->rest);
+
+	/* closing the write end tells the next stage that all is done */
+	ConSetThreadOutput (NULL);
+	CloseHandle (lpWorker->hOutput);
+	free (lpWorker);
+
+	return 0;
+}
+
+
+/*
+ * Starts an internal command on a worker thread which writes into
+ * hOutput. The thread owns hOutput from now on, even on failure.
+ */
+
+static BOOL
+StartPipeWorker (LPTSTR line, HANDLE hOutput)
+{
+	LPPIPEWORKER lpWorker;
+	LPTSTR rest;
+	HANDLE hThread;
+	DWORD dwThreadId;
+
+	lpWorker = (LPPIPEWORKER)malloc (sizeof (PIPEWORKER) + _tcslen (line) * sizeof (TCHAR));
+	if (lpWorker == NULL)
+	{
+		CloseHandle (hOutput);
+		error_out_of_memory ();
+		return FALSE;
+	}
+
+	/* the thread keeps its own copy, the command line buffer may go */
+	lpWorker->cmdptr = FindStageCommand (line, lpWorker->com, &rest);
+	lpWorker->hOutput = hOutput;
+	_tcscpy (lpWorker->rest, rest);
+
+	hThread = CreateThread (NULL, 0, PipeWorkerThread, lpWorker, 0, &dwThreadId);
+	if (hThread == NULL)
+	{
+		ErrorMessage (GetLastError (), _T("Error executing CreateThread()!!\n"));
+		CloseHandle (hOutput);
+		free (lpWorker);
+		return FALSE;
+	}
+
+#ifdef _DEBUG
+	DebugPrintf (_T("[THREAD: %s %s]\n"), lpWorker->com, rest);
+#endif
+
+	lpPipeCommand[nPipeStages] = NULL;
+	hPipeStage[nPipeStages++] = hThread;
+
+	return TRUE;
+}
+
+
+/*
+ * Replaces a handle by an inheritable duplicate of it.
+ */
+
+static HANDLE
+MakeInheritable (HANDLE hHandle)
+{
+	HANDLE hDup;
+
+	if (!DuplicateHandle (GetCurrentProcess (), hHandle,
+	                      GetCurrentProcess (), &hDup, 0, TRUE,
+	                      DUPLICATE_SAME_ACCESS | DUPLICATE_CLOSE_SOURCE))
+		return INVALID_HANDLE_VALUE;
+
+	return hDup;
+}
+
+
+/*
+ * Waits for the external programs and worker threads of a pipeline
+ * that were started without waiting for them.
+ */
+
+static VOID
+WaitForPipeline (VOID)
+{
+	INT i;
+
+	if (nPipeStages == 0)
+		return;
+
+	WaitForMultipleObjects (nPipeStages, hPipeStage, TRUE, INFINITE);
+
+	for (i = 0; i < nPipeStages; i++)
+	{
+		if (lpPipeCommand[i] != NULL)
+		{
+#ifdef FEATURE_TELEMETRY
+			DWORD dwExitCode;
+
+			if (GetExitCodeProcess (hPipeStage[i], &dwExitCode))
+				RecordProcessTelemetry (hPipeStage[i], lpPipeCommand[i], dwExitCode, TRUE);
+#endif
+#ifdef FEATURE_PROFILE
+			if (bProfile)
+				ProfileChildProcess (hPipeStage[i]);
+#endif
+#ifdef FEATURE_TRACE
+			if (bTrace)
+				TraceEvent (TRACE_PROCESS, 'e', lpPipeCommand[i], dwPipeProcessId[i]);
+#endif
+			free (lpPipeCommand[i]);
+		}
+		CloseHandle (hPipeStage[i]);
+	}
+	nPipeStages = 0;
+}
+#endif /* FEATURE_REDIRECTION */
+
+
+#ifdef INCLUDE_CMD_JOBS
+/*
+ * Checks for a trailing '&', which runs an external program in the
+ * background, and removes it from the command line. Internal commands
+ * and batch files run inside the shell, for them the '&' is left in
+ * the line as one of the parameters.
+ */
+
+static BOOL
+StripBackground (LPTSTR line, LPPARSED_STAGE lpStage)
+{
+	TCHAR com[CMDLINE_LENGTH];
+	TCHAR szFullName[MAX_PATH];
+	LPCOMMAND cmdptr;
+	LPTSTR p = line + _tcslen (line);
+	LPTSTR ext;
+	INT cl;
+
+	while (p > line && _istspace (*(p - 1)))
+		p--;
+
+	if (p == line || *(p - 1) != _T('&'))
+		return FALSE;
+
+	for (ext = line; _istspace (*ext); ext++)
+		;
+	GetFirstWord (ext, com);
+
+	cmdptr = lpStage ? lpStage->lpCommand : FindCommand (com, &cl);
+	if (cmdptr != NULL || !SearchForExecutable (com, szFullName))
+		return FALSE;
+
+	ext = _tcsrchr (szFullName, _T('.'));
+	if (ext != NULL &&
+	    (!_tcsicmp (ext, _T(".bat")) || !_tcsicmp (ext, _T(".cmd"))))
+		return FALSE;
+
+	*(p - 1) = _T('\0');
+	return TRUE;
+}
+#endif /* INCLUDE_CMD_JOBS */
+
+
 /*
  * look through the internal commands and determine whether or not this
  * command is one of them.  If it is, call the command.  If not, call
  * execute to run it as an external program.
  *
  * line - the command line of the program to run
+ * lpStage - the command found when the line was parsed, or NULL
  *
  */
 
 static VOID
-DoCommand (LPTSTR line)
+DoCommand (LPTSTR line, LPPARSED_STAGE lpStage)
 {
 	TCHAR com[CMDLINE_LENGTH];  /* the first word in the command */
-	LPTSTR cp = com;
 	LPTSTR cstart;
 	LPTSTR rest;   /* pointer to the rest of the command line */
 	INT cl;
@@ -393,88 +868,538 @@ DoCommand (LPTSTR line)
 	/* Skip over initial white space */
 	while (_istspace (*line))
 		line++;
-	rest = line;
 
-	cstart = rest;
+	cstart = line;
 
 	/* Anything to do ? */
-	if (*rest)
+	if (*line)
 	{
-		if (*rest == _T('"'))
+		rest = GetFirstWord (line, com);
+
+		/* commands are limited to MAX_PATH */
+		if(_tcslen(com) > MAX_PATH)
 		{
-			/* treat quoted words specially */
+		  error_bad_command();
+		  ConOutFlush ();
+		  return;
+		}
 
-			rest++;
+#ifdef FEATURE_TRACE
+		if (bTrace)
+			TraceEvent (TRACE_COMMAND, 'B', com, 0);
+#endif
 
-			while(*rest != _T('\0') && *rest != _T('"'))
-				*cp++ = _totlower (*rest++);
-			if (*rest == _T('"'))
-				rest++;
+		/* Scan internal command table */
+		if (lpStage != NULL)
+		{
+			cmdptr = lpStage->lpCommand;
+			cl = lpStage->nLength;
 		}
 		else
+			cmdptr = FindCommand (com, &cl);
+
+#ifdef FEATURE_TRACE
+		if (bTrace && cmdptr != NULL)
+			TraceEvent (TRACE_INTERNAL, 'i', cmdptr->name, 0);
+#endif
+
+		/* If not found execute ext cmd */
+		if (cmdptr == NULL)
 		{
-			while (!IsDelimiter (*rest))
-				*cp++ = _totlower (*rest++);
+			Execute (line, com, rest);
 		}
+		else if (cl)
+		{
+			/* Terminate first word properly */
+			com[cl] = _T('\0');
 
+			/* Call with new rest */
+			cmdptr->func (com, cstart + cl);
+		}
+		else
+		{
+			cmdptr->func (com, rest);
+		}
 
-		/* Terminate first word */
-		*cp = _T('\0');
-		
-		/* commands are limited to MAX_PATH */
-		if(_tcslen(com) > MAX_PATH)
+#ifdef FEATURE_TRACE
+		if (bTrace)
+			TraceEvent (TRACE_COMMAND, 'E', com, 0);
+#endif
+	}
+
+	/* the output may be redirected to a handle closed after this */
+	ConOutFlush ();
+}
+
+
+#ifdef FEATURE_REDIRECTION
+/*
+ * Checks if a parsed batch line was made from the text line.
+ */
+
+static BOOL
+IsParsedLine (LPPARSED_LINE lpLine, LPCTSTR line)
+{
+	if (lpLine == NULL)
+		return FALSE;
+
+#ifdef FEATURE_ALIASES
+	if (lpLine->nAliasGeneration != GetAliasGeneration ())
+		return FALSE;
+#endif
+
+	return (lpLine->nRaw == (INT)_tcslen (line) &&
+	        !memcmp (lpLine->lpRaw, line, lpLine->nRaw * sizeof (TCHAR)));
+}
+
+
+/*
+ * Checks that the values of the %VAR% references of a line can't change
+ * how it is parsed in any way the value itself doesn't show: the names
+ * hold nothing GetRedirection acts on, and no reference is followed by
+ * a '>', which a value ending in "2" or "&" would turn into another
+ * redirection.
+ */
+
+static BOOL
+HasPlainReferences (LPCTSTR line, INT nLength)
+{
+	LPVARIABLE_LINE lpSplit;
+	LPVARIABLE_SEGMENT lpSeg;
+	LPCTSTR p;
+	BOOL bPlain = TRUE;
+	INT i;
+
+	if (_tcschr (line, _T('%')) == NULL)
+		return TRUE;
+
+	lpSplit = SplitVariables (line, nLength, 1);
+	if (lpSplit == NULL)
+		return FALSE;
+
+	for (i = 0, lpSeg = lpSplit->Segments; bPlain && i < lpSplit->nSegments; i++, lpSeg++)
+	{
+		if (lpSeg->nType == VARIABLE_TEXT)
+			continue;
+
+		p = line + lpSeg->nStart + lpSeg->nLength;
+		if (lpSeg->nType == VARIABLE_NAME)
 		{
-		  error_bad_command();
-		  return;
+			if (_tcscspn (line + lpSeg->nStart, _T("<>|&\"' \t")) < (size_t)lpSeg->nLength)
+				bPlain = FALSE;
+			p++;
 		}
+		if (*p == _T('>'))
+			bPlain = FALSE;
+	}
 
-		/* Skip over whitespace to rest of line */
-		while (_istspace (*rest))
-			rest++;
+	free (lpSplit);
 
-		/* Scan internal command table */
-		for (cmdptr = cmds;; cmdptr++)
+	return bPlain;
+}
+
+
+#ifdef FEATURE_ALIASES
+static INT
+CountPercent (LPCTSTR line)
+{
+	INT n = 0;
+
+	while ((line = _tcschr (line, _T('%'))) != NULL)
+	{
+		n++;
+		line++;
+	}
+
+	return n;
+}
+#endif
+
+
+/*
+ * Parses a batch line, whose control characters are spaces already and
+ * which has no trailing white space, with its %VAR% references as they
+ * are written. Returns the number of stages, or 0 if the line can only
+ * be parsed after expansion: a reference in the first word of a stage
+ * or in the part of the line ExpandAlias lowercases, or an alias which
+ * puts a '%' into the line.
+ */
+
+static INT
+ParseRawLine (LPTSTR s, INT nLength, INT nSize, LPTSTR in, LPTSTR out, LPTSTR err,
+              LPINT lpnRedirFlags)
+{
+	TCHAR com[CMDLINE_LENGTH];
+	LPTSTR t;
+	INT num;
+	INT n;
+
+	for (t = s; _istspace (*t); t++)
+		;
+	for (; *t && !_istspace (*t) && *t != _T('='); t++)
+	{
+		if (*t == _T('%'))
+			return 0;
+	}
+
+	if (!HasPlainReferences (s, nLength))
+		return 0;
+
+#ifdef FEATURE_ALIASES
+	n = CountPercent (s);
+	ExpandAlias (s, nSize - 2);
+	if (CountPercent (s) != n)
+		return 0;
+#endif
+
+	if (*s == _T('\0'))
+		return 0;
+
+	num = GetRedirection (s, in, out, err, lpnRedirFlags);
+
+	for (t = in; _istspace (*t); t++)
+		;
+	_tcscpy (in, t);
+
+	for (t = out; _istspace (*t); t++)
+		;
+	_tcscpy (out, t);
+
+	for (t = err; _istspace (*t); t++)
+		;
+	_tcscpy (err, t);
+
+	for (n = 0, t = s; n < num; n++, t += _tcslen (t) + 1)
+	{
+		LPTSTR p;
+
+		for (p = t; _istspace (*p); p++)
+			;
+		GetFirstWord (p, com);
+		if (_tcspbrk (com, _T("%!")) != NULL)
+			return 0;
+	}
+
+	return num;
+}
+
+
+/*
+ * Parses a line of the batch file image to be kept with it. A line which
+ * has to be parsed each time it is run gets a PARSED_LINE without any
+ * stages, so it isn't tried again. Returns NULL if out of memory.
+ */
+
+static LPPARSED_LINE
+BuildParsedLine (LPCTSTR line)
+{
+	TCHAR com[CMDLINE_LENGTH];
+	LPPARSED_LINE lpLine;
+	LPTSTR lpBuffer;
+	LPTSTR s, in, out, err;
+	LPTSTR p;
+	INT nRaw = _tcslen (line);
+	INT nSize = nRaw + CMDLINE_LENGTH;
+	INT nRedirFlags = 0;
+	INT nParsed = 0;
+	INT num;
+	INT n;
+
+	lpBuffer = (LPTSTR)malloc (4 * nSize * sizeof (TCHAR));
+	if (lpBuffer == NULL)
+		return NULL;
+	s = lpBuffer;
+	in = s + nSize;
+	out = in + nSize;
+	err = out + nSize;
+	*in = *out = *err = _T('\0');
+
+	/* the text of the line as ExpandVariables leaves it */
+	for (n = 0; n < nRaw; n++)
+		s[n] = _istcntrl (line[n]) ? _T(' ') : line[n];
+	while (n > 0 && _istspace (s[n - 1]))
+		n--;
+	s[n] = _T('\0');
+
+	num = ParseRawLine (s, n, nSize, in, out, err, &nRedirFlags);
+	if (num > 0)
+	{
+		for (p = s, n = 0; n < num; n++)
+			p += _tcslen (p) + 1;
+		nParsed = (p - s) + _tcslen (in) + _tcslen (out) + _tcslen (err) + 3;
+	}
+
+	lpLine = (LPPARSED_LINE)malloc (sizeof (PARSED_LINE) + num * sizeof (PARSED_STAGE) +
+	                                (nRaw + 1 + nParsed) * sizeof (TCHAR));
+	if (lpLine == NULL)
+	{
+		free (lpBuffer);
+		return NULL;
+	}
+
+#ifdef FEATURE_ALIASES
+	lpLine->nAliasGeneration = GetAliasGeneration ();
+#else
+	lpLine->nAliasGeneration = 0;
+#endif
+	lpLine->nRaw = nRaw;
+	lpLine->nStages = num;
+	lpLine->nRedirFlags = nRedirFlags;
+	lpLine->nParsed = nParsed;
+	lpLine->lpStages = (LPPARSED_STAGE)(lpLine + 1);
+	lpLine->lpRaw = (LPTSTR)(lpLine->lpStages + num);
+	lpLine->lpParsed = lpLine->lpRaw + nRaw + 1;
+	lpLine->lpVariables = NULL;
+	lpLine->lpDelayed = NULL;
+
+	_tcscpy (lpLine->lpRaw, line);
+	if (num == 0)
+	{
+		free (lpBuffer);
+		return lpLine;
+	}
+
+	/* the first words don't change, so neither do the commands */
+	for (p = s, n = 0; n < num; n++, p += _tcslen (p) + 1)
+	{
+		LPTSTR t;
+
+		for (t = p; _istspace (*t); t++)
+			;
+		GetFirstWord (t, com);
+		lpLine->lpStages[n].lpCommand = FindCommand (com, &lpLine->lpStages[n].nLength);
+	}
+
+	n = p - s;
+	memcpy (lpLine->lpParsed, s, n * sizeof (TCHAR));
+	_tcscpy (lpLine->lpParsed + n, in);
+	n += _tcslen (in) + 1;
+	_tcscpy (lpLine->lpParsed + n, out);
+	n += _tcslen (out) + 1;
+	_tcscpy (lpLine->lpParsed + n, err);
+
+	free (lpBuffer);
+
+	for (n = 0; n < nParsed; n++)
+	{
+		if (lpLine->lpParsed[n] == _T('%'))
+			break;
+	}
+	if (n < nParsed)
+	{
+		lpLine->lpVariables = SplitVariables (lpLine->lpParsed, nParsed, num);
+		if (lpLine->lpVariables == NULL)
 		{
-			/* If end of table execute ext cmd */
-			if (cmdptr->name == NULL)
-			{
-				Execute (line, com, rest);
-				break;
-			}
+			free (lpLine);
+			return NULL;
+		}
+		if (lpLine->lpVariables->nReferences == 0)
+		{
+			free (lpLine->lpVariables);
+			lpLine->lpVariables = NULL;
+		}
+	}
 
-			if (!_tcscmp (com, cmdptr->name))
-			{
-				cmdptr->func (com, rest);
-				break;
-			}
+	return lpLine;
+}
 
-			/* The following code handles the case of commands like CD which
-			 * are recognised even when the command name and parameter are
-			 * not space separated.
-			 *
-			 * e.g dir..
-			 * cd\freda
-			 */
 
-			/* Get length of command name */
-			cl = _tcslen (cmdptr->name);
+/*
+ * Copies a parsed batch line, with the values of its variables in cmd,
+ * into the buffers of RunCommandLine and returns the number of pipeline
+ * stages.
+ */
+
+static INT
+RestoreParsedLine (LPPARSED_LINE lpLine, LPCTSTR cmd, LPTSTR cmdline,
+                   LPTSTR in, LPTSTR out, LPTSTR err, LPINT lpnRedirFlags)
+{
+	LPCTSTR p = cmd;
+	INT n;
 
-			if ((cmdptr->flags & CMD_SPECIAL) &&
-			    (!_tcsncmp (cmdptr->name, com, cl)) &&
-			    (_tcschr (_T("\\.-"), *(com + cl))))
-			{
-				/* OK its one of the specials...*/
+	for (n = 0; n < lpLine->nStages; n++)
+		p += _tcslen (p) + 1;
+	memcpy (cmdline, cmd, (p - cmd) * sizeof (TCHAR));
+
+	_tcscpy (in, p);
+	p += _tcslen (p) + 1;
+	_tcscpy (out, p);
+	p += _tcslen (p) + 1;
+	_tcscpy (err, p);
+
+	*lpnRedirFlags = lpLine->nRedirFlags;
+
+	return lpLine->nStages;
+}
+#endif /* FEATURE_REDIRECTION */
+
+
+#ifdef FEATURE_DELAYED_EXPANSION
+/*
+ * Skips the condition of an IF the way cmd_if does and returns the
+ * command it runs.
+ */
+
+static LPTSTR
+SkipIfCondition (LPTSTR param)
+{
+	LPTSTR pp;
+
+	if (!_tcsnicmp (param, _T("not"), 3) && _istspace (*(param + 3)))
+	{
+		param += 3;
+		while (_istspace (*param))
+			param++;
+	}
+
+	if ((!_tcsnicmp (param, _T("exist"), 5) && _istspace (*(param + 5))) ||
+	    (!_tcsnicmp (param, _T("defined"), 7) && _istspace (*(param + 7))))
+	{
+		/* the keyword, then the file or variable name */
+		pp = param;
+		while (*pp && !_istspace (*pp))
+			pp++;
+		while (_istspace (*pp))
+			pp++;
+		while (*pp && !_istspace (*pp))
+			pp++;
+	}
+	else if (!_tcsnicmp (param, _T("errorlevel"), 10) && _istspace (*(param + 10)))
+	{
+		pp = param + 10;
+		while (_istspace (*pp))
+			pp++;
+		while (_istdigit (*pp))
+			pp++;
+	}
+	else if ((pp = _tcsstr (param, _T("=="))) != NULL)
+	{
+		pp += 2;
+		while (_istspace (*pp))
+			pp++;
+		while (*pp && !_istspace (*pp))
+			pp++;
+	}
+	else
+		return NULL;
+
+	return pp;
+}
+
+
+/*
+ * Looks for a FOR in the first stage at line, as it is or run by IF or
+ * CALL, and returns the command after its DO. That command is expanded
+ * again on each iteration. Returns NULL if the line runs no FOR.
+ */
+
+static LPTSTR
+FindForBody (LPTSTR line)
+{
+	TCHAR com[CMDLINE_LENGTH];
+	LPCOMMAND cmdptr;
+	LPTSTR rest;
+	LPTSTR pp;
+	INT cl;
+
+	for (;;)
+	{
+		while (_istspace (*line))
+			line++;
+
+		rest = GetFirstWord (line, com);
+		cmdptr = FindCommand (com, &cl);
+		if (cmdptr == NULL)
+			return NULL;
+		if (cl)
+			rest = line + cl;
+
+		if (cmdptr->func == cmd_call)
+		{
+			line = rest;
+		}
+		else if (cmdptr->func == cmd_if)
+		{
+			while (_istspace (*rest))
+				rest++;
+			line = SkipIfCondition (rest);
+			if (line == NULL)
+				return NULL;
+		}
+		else if (cmdptr->func == cmd_for)
+		{
+			/* the set ends at the last ')', as in cmd_for */
+			if ((pp = _tcsrchr (rest, _T(')'))) == NULL)
+				return NULL;
+
+			pp++;
+			while (_istspace (*pp))
+				pp++;
+
+			if (_tcsnicmp (pp, _T("do"), 2) != 0 || !_istspace (*(pp + 2)))
+				return NULL;
+
+			return pp + 2;
+		}
+		else
+			return NULL;
+	}
+}
+
+
+/*
+ * Resolves the !VAR! references of the nStages stages at line. A batch
+ * line is split only once, the split form is kept with its parsed form
+ * lpLine. The command after the DO of a FOR is left alone, it is
+ * expanded again on each iteration.
+ *
+ * Returns line if there is nothing to expand, else a buffer to be freed
+ * by the caller, or NULL if out of memory.
+ */
+
+static LPTSTR
+ExpandDelayedStages (LPTSTR line, INT nStages, LPPARSED_LINE lpLine)
+{
+	LPDELAYED_LINE lpSplit;
+	LPTSTR lpExpanded;
+	LPTSTR lpBody;
+	LPTSTR p;
+	BOOL bFound = FALSE;
+
+	for (p = line; nStages-- > 0; p++)
+	{
+		for (; *p; p++)
+		{
+			if (*p == _T('!'))
+				bFound = TRUE;
+		}
+	}
+
+	if (!bFound)
+		return line;
+
+	lpSplit = lpLine ? lpLine->lpDelayed : NULL;
+	if (lpSplit == NULL)
+	{
+		lpBody = FindForBody (line);
+		lpSplit = SplitDelayedLine (line, p - line,
+		                            lpBody ? lpBody - line : p - line);
+		if (lpSplit == NULL)
+			return NULL;
+		if (lpLine != NULL)
+			lpLine->lpDelayed = lpSplit;
+	}
+
+	lpExpanded = line;
+	if (lpSplit->nVariables > 0)
+		lpExpanded = ExpandDelayedLine (line, lpSplit);
 
-				/* Terminate first word properly */
-				com[cl] = _T('\0');
+	if (lpLine == NULL)
+		free (lpSplit);
 
-				/* Call with new rest */
-				cmdptr->func (com, cstart + cl);
-				break;
-			}
-		}
-	}
+	return lpExpanded;
 }
+#endif /* FEATURE_DELAYED_EXPANSION */
 
 
 /*
@@ -482,19 +1407,24 @@ DoCommand (LPTSTR line)
  * full input/output redirection and piping are supported
  */
 
-VOID ParseCommandLine (LPTSTR cmd)
+static VOID
+RunCommandLine (LPTSTR cmd, LPTSTR cmdline, INT nSize, LPPARSED_LINE lpLine,
+                LPPARSED_STAGE lpStages, LPTSTR *lplpDelayed)
 {
-	TCHAR cmdline[CMDLINE_LENGTH];
 	LPTSTR s;
 #ifdef FEATURE_REDIRECTION
-	TCHAR in[CMDLINE_LENGTH] = _T("");
-	TCHAR out[CMDLINE_LENGTH] = _T("");
-	TCHAR err[CMDLINE_LENGTH] = _T("");
+	LPTSTR pipeline;
+	LPTSTR in = cmdline + nSize;
+	LPTSTR out = in + nSize;
+	LPTSTR err = out + nSize;
 	TCHAR szTempPath[MAX_PATH] = _T(".\\");
 	TCHAR szFileName[2][MAX_PATH] = {_T(""), _T("")};
 	HANDLE hFile[2] = {INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE};
 	LPTSTR t = NULL;
 	INT  num = 0;
+	INT  nStages;
+	INT  nStage = 0;
+	INT  nType;
 	INT  nRedirFlags = 0;
 	INT  Length;
 	UINT Attributes;
@@ -504,54 +1434,113 @@ VOID ParseCommandLine (LPTSTR cmd)
 	HANDLE hOldConErr;
 #endif /* FEATURE_REDIRECTION */
 
-	_tcscpy (cmdline, cmd);
 	s = &cmdline[0];
 
 #ifdef _DEBUG
-	DebugPrintf (_T("ParseCommandLine: (\'%s\')\n"), s);
+	DebugPrintf (_T("ParseCommandLine: (\'%s\')\n"), cmd);
 #endif /* DEBUG */
 
+#ifndef FEATURE_REDIRECTION
+	_tcscpy (cmdline, cmd);
+
 #ifdef FEATURE_ALIASES
 	/* expand all aliases */
-	ExpandAlias (s, CMDLINE_LENGTH);
+	ExpandAlias (s, nSize - 2);
 #endif /* FEATURE_ALIAS */
 
-#ifdef FEATURE_REDIRECTION
-	/* find the temp path to store temporary files */
-	Length = GetTempPath (MAX_PATH, szTempPath);
-	if (Length > 0 && Length < MAX_PATH)
+#ifdef FEATURE_DELAYED_EXPANSION
+	if (nParseDepth == 1 && GetDelayedExpansion ())
 	{
-		Attributes = GetFileAttributes(szTempPath);
-		if (Attributes == 0xffffffff ||
-		    !(Attributes & FILE_ATTRIBUTE_DIRECTORY))
+		s = ExpandDelayedStages (s, 1, NULL);
+		if (s == NULL)
 		{
-			Length = 0;
+			error_out_of_memory ();
+			return;
 		}
+		if (s != cmdline)
+			*lplpDelayed = s;
 	}
-	if (Length == 0 || Length >= MAX_PATH)
+#endif
+#else
+	if (lpLine != NULL)
 	{
-		_tcscpy(szTempPath, _T(".\\"));
+		/* a batch line that was parsed before, cmd holds its stages and
+		 * file names with the values of the variables put in */
+		num = RestoreParsedLine (lpLine, cmd, cmdline, in, out, err, &nRedirFlags);
 	}
-	if (szTempPath[_tcslen (szTempPath) - 1] != _T('\\'))
-		_tcscat (szTempPath, _T("\\"));
+	else
+	{
+		_tcscpy (cmdline, cmd);
+		*in = *out = *err = _T('\0');
+
+#ifdef FEATURE_ALIASES
+		/* expand all aliases */
+		ExpandAlias (s, nSize - 2);
+#endif /* FEATURE_ALIAS */
 
-	/* get the redirections from the command line */
-	num = GetRedirection (s, in, out, err, &nRedirFlags);
+		/* get the redirections from the command line */
+		num = GetRedirection (s, in, out, err, &nRedirFlags);
 
-	/* more efficient, but do we really need to do this? */
-	for (t = in; _istspace (*t); t++)
-		;
-	_tcscpy (in, t);
+		/* more efficient, but do we really need to do this? */
+		for (t = in; _istspace (*t); t++)
+			;
+		_tcscpy (in, t);
 
-	for (t = out; _istspace (*t); t++)
-		;
-	_tcscpy (out, t);
+		for (t = out; _istspace (*t); t++)
+			;
+		_tcscpy (out, t);
 
-	for (t = err; _istspace (*t); t++)
-		;
-	_tcscpy (err, t);
+		for (t = err; _istspace (*t); t++)
+			;
+		_tcscpy (err, t);
+	}
+	nStages = num;
+
+#ifdef FEATURE_DELAYED_EXPANSION
+	/* the stages are expanded now, the redirections were taken from
+	 * the line as it is. Their split form can only be kept if the
+	 * stages are the same each time the line is run. */
+	if (nParseDepth == 1 && GetDelayedExpansion ())
+	{
+		if (lpLine != NULL && lpLine->lpVariables != NULL)
+			lpLine = NULL;
+		s = ExpandDelayedStages (s, num, lpLine);
+		if (s == NULL)
+		{
+			error_out_of_memory ();
+			return;
+		}
+		if (s != cmdline)
+			*lplpDelayed = s;
+	}
+#endif
+	pipeline = s;
+
+	if (num > 1)
+	{
+		/* find the temp path to store temporary files */
+		Length = GetTempPath (MAX_PATH, szTempPath);
+		if (Length > 0 && Length < MAX_PATH)
+		{
+			Attributes = GetFileAttributes(szTempPath);
+			if (Attributes == 0xffffffff ||
+			    !(Attributes & FILE_ATTRIBUTE_DIRECTORY))
+			{
+				Length = 0;
+			}
+		}
+		if (Length == 0 || Length >= MAX_PATH)
+		{
+			_tcscpy(szTempPath, _T(".\\"));
+		}
+		if (szTempPath[_tcslen (szTempPath) - 1] != _T('\\'))
+			_tcscat (szTempPath, _T("\\"));
+	}
 
 	/* Set up the initial conditions ... */
+	/* what was printed so far goes to the old handles */
+	ConOutFlush ();
+
 	/* preserve STDIN, STDOUT and STDERR handles */
 	hOldConIn  = GetStdHandle (STD_INPUT_HANDLE);
 	hOldConOut = GetStdHandle (STD_OUTPUT_HANDLE);
@@ -568,14 +1557,19 @@ VOID ParseCommandLine (LPTSTR cmd)
 		if (hFile == INVALID_HANDLE_VALUE)
 		{
 			ConErrPrintf (_T("Can't redirect input from file %s\n"), in);
-			return;
+			goto cleanup;
 		}
 
 		if (!SetStdHandle (STD_INPUT_HANDLE, hFile))
 		{
+			CloseHandle (hFile);
 			ConErrPrintf (_T("Can't redirect input from file %s\n"), in);
-			return;
+			goto cleanup;
 		}
+#ifdef FEATURE_TRACE
+		if (bTrace)
+			TraceEvent (TRACE_REDIR_OPEN, 'i', in, 0);
+#endif
 #ifdef _DEBUG
 		DebugPrintf (_T("Input redirected from: %s\n"), in);
 #endif
@@ -588,22 +1582,74 @@ VOID ParseCommandLine (LPTSTR cmd)
 	while (num-- > 1)
 	{
 		SECURITY_ATTRIBUTES sa = {sizeof(SECURITY_ATTRIBUTES), NULL, TRUE};
+		HANDLE hRead, hWrite;
+
+		nType = STAGE_SHELL;
+		if (nPipeStages < MAXIMUM_WAIT_OBJECTS)
+			nType = GetStageType (s, pipeline, nStages);
+
+		if (nType != STAGE_SHELL)
+		{
+			/*
+			 * External programs and internal commands on worker
+			 * threads are connected to the next stage by an anonymous
+			 * pipe and keep running while the next stages are started.
+			 * The pipe is created without inheritable handles, an end
+			 * is made inheritable only when the external program that
+			 * uses it is started, so no other child holds it open.
+			 */
+			if (!CreatePipe (&hRead, &hWrite, NULL, PIPE_BUFFER_SIZE))
+			{
+				ConErrPrintf (_T("Error creating pipe\n"));
+				goto cleanup;
+			}
+			*szFileName[1] = _T('\0');
+
+			if (nType == STAGE_THREAD)
+			{
+				/* the worker thread owns the write end */
+				hFile[1] = INVALID_HANDLE_VALUE;
+				StartPipeWorker (s, hWrite);
+			}
+			else
+			{
+				hFile[1] = MakeInheritable (hWrite);
+				if (hFile[1] == INVALID_HANDLE_VALUE)
+				{
+					CloseHandle (hRead);
+					ConErrPrintf (_T("Error creating pipe\n"));
+					goto cleanup;
+				}
+
+				SetStdHandle (STD_OUTPUT_HANDLE, hFile[1]);
+
+				bPipeStage = TRUE;
+				DoCommand (s, lpStages ? &lpStages[nStage] : NULL);
+				bPipeStage = FALSE;
+			}
+		}
+		else
+		{
+			/* Internal commands and batch files run inside the shell,
+			 * their output is collected in a temporary file */
+			hRead = INVALID_HANDLE_VALUE;
+
+			/* Create unique temporary file name */
+			GetTempFileName (szTempPath, _T("CMD"), 0, szFileName[1]);
+
+			/* Set current stdout to temporary file */
+			hFile[1] = CreateFile (szFileName[1], GENERIC_WRITE, 0, &sa,
+					       TRUNCATE_EXISTING, FILE_ATTRIBUTE_TEMPORARY, NULL);
 
-		/* Create unique temporary file name */
-		GetTempFileName (szTempPath, _T("CMD"), 0, szFileName[1]);
-      
-		/* Set current stdout to temporary file */
-		hFile[1] = CreateFile (szFileName[1], GENERIC_WRITE, 0, &sa,
-				       TRUNCATE_EXISTING, FILE_ATTRIBUTE_TEMPORARY, NULL);
-                   
-      if (hFile[1] == INVALID_HANDLE_VALUE){
-         ConErrPrintf (_T("Error creating temporary file for pipe data\n"));
-         return;
-      }
-                   
-		SetStdHandle (STD_OUTPUT_HANDLE, hFile[1]);
-
-		DoCommand (s);
+			if (hFile[1] == INVALID_HANDLE_VALUE){
+				ConErrPrintf (_T("Error creating temporary file for pipe data\n"));
+				goto cleanup;
+			}
+
+			SetStdHandle (STD_OUTPUT_HANDLE, hFile[1]);
+
+			DoCommand (s, lpStages ? &lpStages[nStage] : NULL);
+		}
 
 		/* close stdout file */
 		SetStdHandle (STD_OUTPUT_HANDLE, hOldConOut);
@@ -620,20 +1666,30 @@ VOID ParseCommandLine (LPTSTR cmd)
 			/* delete old stdin file, if it is a real file */
 			CloseHandle (hFile[0]);
 			hFile[0] = INVALID_HANDLE_VALUE;
-			DeleteFile (szFileName[0]);
+			if (*szFileName[0])
+				DeleteFile (szFileName[0]);
 			*szFileName[0] = _T('\0');
 		}
 
-		/* copy stdout file name to stdin file name */
-		_tcscpy (szFileName[0], szFileName[1]);
-		*szFileName[1] = _T('\0');
+		if (hRead != INVALID_HANDLE_VALUE)
+		{
+			/* the next stage reads from the pipe */
+			hFile[0] = MakeInheritable (hRead);
+		}
+		else
+		{
+			/* copy stdout file name to stdin file name */
+			_tcscpy (szFileName[0], szFileName[1]);
+			*szFileName[1] = _T('\0');
 
-		/* open new stdin file */
-		hFile[0] = CreateFile (szFileName[0], GENERIC_READ, 0, &sa,
-		                       OPEN_EXISTING, FILE_ATTRIBUTE_TEMPORARY, NULL);
+			/* open new stdin file */
+			hFile[0] = CreateFile (szFileName[0], GENERIC_READ, 0, &sa,
+			                       OPEN_EXISTING, FILE_ATTRIBUTE_TEMPORARY, NULL);
+		}
 		SetStdHandle (STD_INPUT_HANDLE, hFile[0]);
 
 		s = s + _tcslen (s) + 1;
+		nStage++;
 	}
 
 	/* Now set up the end conditions... */
@@ -650,14 +1706,19 @@ VOID ParseCommandLine (LPTSTR cmd)
 		if (hFile == INVALID_HANDLE_VALUE)
 		{
 			ConErrPrintf (_T("Can't redirect to file %s\n"), out);
-			return;
+			goto cleanup;
 		}
 
 		if (!SetStdHandle (STD_OUTPUT_HANDLE, hFile))
 		{
+			CloseHandle (hFile);
 			ConErrPrintf (_T("Can't redirect to file %s\n"), out);
-			return;
+			goto cleanup;
 		}
+#ifdef FEATURE_TRACE
+		if (bTrace)
+			TraceEvent (TRACE_REDIR_OPEN, 'i', out, 1);
+#endif
 
 		if (nRedirFlags & OUTPUT_APPEND)
 		{
@@ -709,14 +1770,19 @@ VOID ParseCommandLine (LPTSTR cmd)
 			if (hFile == INVALID_HANDLE_VALUE)
 			{
 				ConErrPrintf (_T("Can't redirect to file %s\n"), err);
-				return;
+				goto cleanup;
 			}
 		}
 		if (!SetStdHandle (STD_ERROR_HANDLE, hFile))
 		{
+			CloseHandle (hFile);
 			ConErrPrintf (_T("Can't redirect to file %s\n"), err);
-			return;
+			goto cleanup;
 		}
+#ifdef FEATURE_TRACE
+		if (bTrace)
+			TraceEvent (TRACE_REDIR_OPEN, 'i', err, 2);
+#endif
 
 		if (nRedirFlags & ERROR_APPEND)
 		{
@@ -740,10 +1806,25 @@ VOID ParseCommandLine (LPTSTR cmd)
 	}
 #endif
 
+#ifdef FEATURE_REDIRECTION
+	if (lpStages != NULL)
+		lpStages += nStage;
+#endif
+
+#ifdef INCLUDE_CMD_JOBS
+	/* process final command, a program in the background if it ends in '&' */
+	bBackground = StripBackground (s, lpStages);
+	DoCommand (s, lpStages);
+	bBackground = FALSE;
+#else
 	/* process final command */
-	DoCommand (s);
+	DoCommand (s, lpStages);
+#endif
 
 #ifdef FEATURE_REDIRECTION
+	/* the error paths above end here as well, after the stages that
+	 * were started and with the std handles restored */
+cleanup:
 	/* close old stdin file */
 #if 0  /* buggy implementation */
 	SetStdHandle (STD_INPUT_HANDLE, hOldConIn);
@@ -787,13 +1868,15 @@ VOID ParseCommandLine (LPTSTR cmd)
 		}
 		else
 		{
-			if (GetFileType (hIn) == FILE_TYPE_DISK)
+			if (GetFileType (hIn) == FILE_TYPE_DISK ||
+			    GetFileType (hIn) == FILE_TYPE_PIPE)
 			{
 				if (hFile[0] == hIn)
 				{
 					CloseHandle (hFile[0]);
 					hFile[0] = INVALID_HANDLE_VALUE;
-					DeleteFile (szFileName[0]);
+					if (*szFileName[0])
+						DeleteFile (szFileName[0]);
 					*szFileName[0] = _T('\0');
 				}
 				else
@@ -806,6 +1889,11 @@ VOID ParseCommandLine (LPTSTR cmd)
 		}
 	}
 
+	/* Our end of the last pipe is closed now, so the earlier stages
+	 * can't block on a full pipe if the last one stopped reading. */
+	ConOutFlush ();
+	WaitForPipeline ();
+
 
 	/* Restore original STDOUT */
 	if (hOldConOut != INVALID_HANDLE_VALUE)
@@ -826,103 +1914,282 @@ VOID ParseCommandLine (LPTSTR cmd)
 			CloseHandle (hErr);
 		hOldConErr = INVALID_HANDLE_VALUE;
 	}
+
+#ifdef FEATURE_TRACE
+	if (bTrace)
+	{
+		if (in[0])
+			TraceEvent (TRACE_REDIR_CLOSE, 'i', in, 0);
+		if (out[0])
+			TraceEvent (TRACE_REDIR_CLOSE, 'i', out, 1);
+		if (err[0])
+			TraceEvent (TRACE_REDIR_CLOSE, 'i', err, 2);
+	}
+#endif
 #endif /* FEATURE_REDIRECTION */
 }
 
 
+/*
+ * The command line may be of any length after variable expansion, so
+ * the buffers of the parser are sized for it. There is room left for
+ * alias expansion.
+ *
+ * A batch line parsed before is passed as lpLine, cmd then holds the
+ * nLength characters of its stages and file names. The commands of the
+ * stages are copied, the line may be freed by the commands it runs.
+ */
+
+static VOID
+ParseLine (LPTSTR cmd, INT nLength, LPPARSED_LINE lpLine)
+{
+	LPPARSED_STAGE lpStages = NULL;
+	LPVOID lpMemory;
+	LPTSTR lpBuffer;
+	LPTSTR lpDelayed = NULL;
+	INT nSize = nLength + CMDLINE_LENGTH;
+	INT nStages = lpLine ? lpLine->nStages : 0;
+#ifdef FEATURE_PROFILE
+	LPVOID lpProfile = NULL;
+#endif
+
+#ifdef FEATURE_REDIRECTION
+	/* stages, then command line plus input, output and error file names */
+	lpMemory = malloc (nStages * sizeof (PARSED_STAGE) + 4 * nSize * sizeof (TCHAR));
+#else
+	lpMemory = malloc (nSize * sizeof (TCHAR));
+#endif
+	if (lpMemory == NULL)
+	{
+		error_out_of_memory ();
+		return;
+	}
+
+	lpBuffer = (LPTSTR)((LPPARSED_STAGE)lpMemory + nStages);
+	if (lpLine != NULL)
+	{
+		lpStages = (LPPARSED_STAGE)lpMemory;
+		memcpy (lpStages, lpLine->lpStages, nStages * sizeof (PARSED_STAGE));
+	}
+
+#ifdef FEATURE_PROFILE
+	/* only the batch line itself, not the commands run by it */
+	if (bProfile)
+		lpProfile = ProfileBegin ();
+#endif
+
+#ifdef FEATURE_TRACE
+	if (bTrace)
+		TraceEvent (TRACE_PARSE, 'B', cmd, 0);
+#endif
+
+#ifdef FEATURE_DELAYED_EXPANSION
+	nParseDepth++;
+	RunCommandLine (cmd, lpBuffer, nSize, lpLine, lpStages, &lpDelayed);
+	nParseDepth--;
+#else
+	RunCommandLine (cmd, lpBuffer, nSize, lpLine, lpStages, &lpDelayed);
+#endif
+
+#ifdef FEATURE_TRACE
+	if (bTrace)
+		TraceEvent (TRACE_PARSE, 'E', cmd, 0);
+#endif
+
+#ifdef FEATURE_PROFILE
+	if (lpProfile != NULL)
+		ProfileEnd (lpProfile);
+#endif
+
+	if (lpDelayed != NULL)
+		free (lpDelayed);
+	free (lpMemory);
+}
+
+
+VOID ParseCommandLine (LPTSTR cmd)
+{
+	ParseLine (cmd, _tcslen (cmd), NULL);
+}
+
+
+/*
+ * Returns the console screen buffer. It is opened on first use, so a
+ * command run with /C that never touches the screen doesn't pay for it.
+ * The colors in use at that time become the current and default colors.
+ */
+
+HANDLE GetScreenHandle (VOID)
+{
+	CONSOLE_SCREEN_BUFFER_INFO Info;
+
+	/* the screen is about to be used directly, show what was printed */
+	ConOutFlush ();
+
+	if (bConsoleOpened || bHeadless)
+		return hConsole;
+
+	bConsoleOpened = TRUE;
+
+	hConsole = CreateFile(_T("CONOUT$"), GENERIC_READ|GENERIC_WRITE,
+	                      FILE_SHARE_READ|FILE_SHARE_WRITE, NULL,
+	                      OPEN_EXISTING, 0, NULL);
+	if (GetConsoleScreenBufferInfo (hConsole, &Info))
+	{
+		wColor = Info.wAttributes;
+		wDefColor = wColor;
+	}
+	else
+	{
+		ConErrPrintf (_T("GetConsoleScreenBufferInfo: Error: %ld\n"), GetLastError());
+	}
+
+	return hConsole;
+}
+
+
+#ifdef FEATURE_REDIRECTION
+/*
+ * Runs a line of the batch file image from the form it was parsed into
+ * when it was first run, so only its variables are looked up. The
+ * expanded stages are written to *lplpBuffer. Returns FALSE if the line
+ * has to be expanded and parsed as a whole.
+ */
+
+static BOOL
+RunParsedLine (LPCTSTR ip, BOOL bEchoThisLine, LPTSTR *lplpBuffer, LPINT lpnSize)
+{
+	LPPARSED_LINE *lplpSlot = GetParsedLineSlot ();
+	LPPARSED_LINE lpLine;
+	LPTSTR lpEcho = NULL;
+	LPTSTR cp;
+	INT nEcho = 0;
+	INT nLength;
+
+	if (lplpSlot == NULL)
+		return FALSE;
+
+	lpLine = *lplpSlot;
+	if (!IsParsedLine (lpLine, ip))
+	{
+		lpLine = BuildParsedLine (ip);
+		if (lpLine == NULL)
+			return FALSE;
+		if (*lplpSlot != NULL)
+			FreeParsedLine (*lplpSlot);
+		*lplpSlot = lpLine;
+	}
+
+	if (lpLine->nStages == 0)
+		return FALSE;
+
+	if (lpLine->lpVariables != NULL)
+	{
+		nLength = ExpandVariableLine (lpLine->lpParsed, lpLine->lpVariables,
+		                              lplpBuffer, lpnSize);
+		if (nLength == EXPAND_REPARSE)
+			return FALSE;
+		if (nLength == EXPAND_OUT_OF_MEMORY)
+		{
+			error_out_of_memory ();
+			return TRUE;
+		}
+	}
+	else
+	{
+		/* the commands may free the line, so it is run from a copy */
+		nLength = lpLine->nParsed;
+		if (*lpnSize < nLength)
+		{
+			cp = (LPTSTR)realloc (*lplpBuffer, nLength * sizeof (TCHAR));
+			if (cp == NULL)
+			{
+				error_out_of_memory ();
+				return TRUE;
+			}
+			*lplpBuffer = cp;
+			*lpnSize = nLength;
+		}
+		memcpy (*lplpBuffer, lpLine->lpParsed, nLength * sizeof (TCHAR));
+	}
+
+	/* Echo batch file line, it is only expanded as a whole for that */
+	if (bEchoThisLine)
+	{
+		if (!ExpandVariables (ip, &lpEcho, &nEcho, FALSE))
+		{
+			error_out_of_memory ();
+			return TRUE;
+		}
+
+		cp = lpEcho + _tcslen (lpEcho);
+		while ((--cp >= lpEcho) && _istspace (*cp));
+		*(cp + 1) = _T('\0');
+
+		PrintPrompt ();
+		ConOutPuts (lpEcho);
+		free (lpEcho);
+	}
+
+	ParseLine (*lplpBuffer, nLength, lpLine);
+	if (bEcho && !bIgnoreEcho)
+		ConOutChar ('\n');
+	bIgnoreEcho = FALSE;
+
+	return TRUE;
+}
+#endif /* FEATURE_REDIRECTION */
+
+
 /*
  * do the prompt/input/process loop
  *
  */
 
-static INT 
+INT
 ProcessInput (BOOL bFlag)
 {
-	TCHAR commandline[CMDLINE_LENGTH];
+	LPTSTR commandline = NULL;
+	INT nSize = 0;
 	TCHAR readline[CMDLINE_LENGTH];
-	LPTSTR tp = NULL;
 	LPTSTR ip;
 	LPTSTR cp;
 	BOOL bEchoThisLine;
 
 	do
 	{
+#ifdef FEATURE_TELEMETRY
+		/* programs which were left running and have finished */
+		ReapProcessTelemetry ();
+#endif
+
 		/* if no batch input then... */
 		if (!(ip = ReadBatchLine (&bEchoThisLine)))
 		{
 			if (bFlag)
-				return 0;
+				break;
 
 			ReadCommand (readline, CMDLINE_LENGTH);
 			ip = readline;
 			bEchoThisLine = FALSE;
 		}
 
-		cp = commandline;
-		while (*ip)
-		{
-			if (*ip == _T('%'))
-			{
-				switch (*++ip)
-				{
-					case _T('%'):
-						*cp++ = *ip++;
-						break;
-
-					case _T('0'):
-					case _T('1'):
-					case _T('2'):
-					case _T('3'):
-					case _T('4'):
-					case _T('5'):
-					case _T('6'):
-					case _T('7'):
-					case _T('8'):
-					case _T('9'):
-						if ((tp = FindArg (*ip - _T('0'))))
-						{
-							cp = _stpcpy (cp, tp);
-							ip++;
-						}
-						else
-							*cp++ = _T('%');
-						break;
-
-					case _T('?'):
-						cp += _stprintf (cp, _T("%u"), nErrorLevel);
-						ip++;
-						break;
-
-					default:
-						tp = _tcschr(ip, _T('%'));
-						if ((tp != NULL) &&
-						    (tp <= _tcschr(ip, _T(' ')) - 1))
-						{
-							TCHAR evar[512];
-							*tp = _T('\0');
-
-							/* FIXME: This is just a quick hack!! */
-							/* Do a proper memory allocation!! */
-							if (GetEnvironmentVariable (ip, evar, 512))
-								cp = _stpcpy (cp, evar);
-
-							ip = tp + 1;
-						}
-						else
-						{
-							*cp++ = _T('%');
-						}
-						break;
-				}
-				continue;
-			}
+#ifdef FEATURE_REDIRECTION
+		/* lines of the batch file image are parsed only once */
+		if (ip != readline &&
+		    RunParsedLine (ip, bEchoThisLine, &commandline, &nSize))
+			continue;
+#endif
 
-			if (_istcntrl (*ip))
-				*ip = _T(' ');
-			*cp++ = *ip++;
+		/* the buffer is kept from line to line and grown as needed,
+		 * on a typed line an undefined %NAME% stays as it is */
+		if (!ExpandVariables (ip, &commandline, &nSize, ip == readline))
+		{
+			error_out_of_memory ();
+			continue;
 		}
 
-		*cp = _T('\0');
+		cp = commandline + _tcslen (commandline);
 
 		/* strip trailing spaces */
 		while ((--cp >= commandline) && _istspace (*cp));
@@ -947,6 +2214,9 @@ ProcessInput (BOOL bFlag)
 	}
 	while (!bCanExit || !bExit);
 
+	free (commandline);
+	ConOutFlush ();
+
 	return 0;
 }
 
@@ -1033,6 +2303,7 @@ Initialize (int argc, TCHAR* argv[])
 {
 	TCHAR commandline[CMDLINE_LENGTH];
 	TCHAR ModuleName[_MAX_PATH + 1];
+	INT nExitCode;
 	INT i;
 	//INT len;
 	//TCHAR *ptr, *cmdLine;
@@ -1049,31 +2320,72 @@ Initialize (int argc, TCHAR* argv[])
 	DebugPrintf (_T("]\n"));
 #endif
 
-	/* get version information */
-	osvi.dwOSVersionInfoSize = sizeof(OSVERSIONINFO);
-	GetVersionEx (&osvi);
-
-	InitLocale ();
+	/* output of this thread is buffered from now on */
+	ConInitOutput ();
 
 	/* get default input and output console handles */
 	hOut = GetStdHandle (STD_OUTPUT_HANDLE);
 	hIn  = GetStdHandle (STD_INPUT_HANDLE);
 
+	/* go headless if asked to or if there is no console to talk to */
+	for (i = 1; i < argc; i++)
+	{
+		if (!_tcsicmp (argv[i], _T("/c")) || !_tcsicmp (argv[i], _T("/k")) ||
+		    !_tcsnicmp (argv[i], _T("/connect"), 8))
+			break;
+		if (!_tcsicmp (argv[i], _T("/h")))
+			bHeadless = TRUE;
+	}
+	if (bHeadless ||
+	    (!ConIsConsole (STD_INPUT_HANDLE) && !ConIsConsole (STD_OUTPUT_HANDLE)))
+		ConSetHeadless ();
 
 	if (argc >= 2 && !_tcsncmp (argv[1], _T("/?"), 2))
 	{
 		ConOutPuts (_T("Starts a new instance of the ReactOS command line interpreter.\n"
 		               "\n"
-		               "CMD [/[C|K] command][/P][/Q][/T:bf]\n"
+		               "CMD [/H][/[C|K] command][/P][/Q][/T:bf][/V:ON|OFF]\n"
 		               "\n"
 		               "  /C command  Runs the specified command and terminates.\n"
 		               "  /K command  Runs the specified command and remains.\n"
+		               "  /H          Runs without using the console, as is done when\n"
+		               "              neither input nor output is a console.\n"
+#ifdef FEATURE_SERVER
+		               "  /SERVER[:name]\n"
+		               "              Serves commands sent with /CONNECT until killed.\n"
+		               "  /CONNECT[:name] command\n"
+		               "              Runs the command in the server, or here as with /C\n"
+		               "              if there is no server.\n"
+#endif
 		               "  /P          CMD becomes permanent and runs autoexec.bat\n"
 		               "              (cannot be terminated).\n"
-		               "  /T:bf       Sets the background/foreground color (see COLOR command)."));
+#ifdef FEATURE_TRACE
+		               "  /TRACE:file Records events of this and nested shells in the file.\n"
+		               "  /TRACEJSON:file [output]\n"
+		               "              Converts a trace file for the Chrome trace viewer.\n"
+#endif
+#ifdef FEATURE_PROFILE
+		               "  /PROFILE[:file]\n"
+		               "              Writes the time spent on each batch file line to the\n"
+		               "              file (cmdprof.txt) and to a .csv file on exit.\n"
+#endif
+		               "  /T:bf       Sets the background/foreground color (see COLOR command)."
+#ifdef FEATURE_DELAYED_EXPANSION
+		               "\n"
+		               "  /V:ON       Enables delayed expansion of !variable!, see SETLOCAL."
+#endif
+		               ));
+		ConOutFlush ();
 		ExitProcess (0);
 	}
-	SetConsoleMode (hIn, ENABLE_PROCESSED_INPUT);
+	if (!bHeadless)
+		SetConsoleMode (hIn, ENABLE_PROCESSED_INPUT);
+
+#ifdef FEATURE_TRACE
+	/* a nested shell adds to the trace of its parent */
+	if (GetEnvVar (_T("CMD_TRACE")) != NULL)
+		TraceStart (GetEnvVar (_T("CMD_TRACE")), TRUE);
+#endif
 
 #ifdef INCLUDE_CMD_CHDIR
 	InitLastPath ();
@@ -1118,7 +2430,14 @@ Initialize (int argc, TCHAR* argv[])
 					}
 
 					ParseCommandLine(commandline);
-					ExitProcess (ProcessInput (TRUE));
+					nExitCode = ProcessInput (TRUE);
+#ifdef FEATURE_PROFILE
+					ProfileStop ();
+#endif
+#ifdef FEATURE_TRACE
+					TraceStop ();
+#endif
+					ExitProcess (nExitCode);
 				}
 				else
 				{
@@ -1141,10 +2460,92 @@ Initialize (int argc, TCHAR* argv[])
 					ParseCommandLine(commandline);
 				}
 			}
+#ifdef FEATURE_SERVER
+			else if (!_tcsnicmp (argv[i], _T("/server"), 7))
+			{
+				nExitCode = RunServer (argv[i][7] == _T(':') ? &argv[i][8] : NULL);
+				ConOutFlush ();
+				ExitProcess (nExitCode);
+			}
+			else if (!_tcsnicmp (argv[i], _T("/connect"), 8))
+			{
+				/* This runs a program in the server and exits */
+				LPCTSTR lpName = (argv[i][8] == _T(':')) ? &argv[i][9] : NULL;
+
+				*commandline = _T('\0');
+				while (++i < argc)
+				{
+					if (*commandline)
+						_tcscat (commandline, _T(" "));
+					_tcscat (commandline, argv[i]);
+				}
+
+				if (RunClient (lpName, commandline, &nExitCode))
+				{
+					ConOutFlush ();
+					ExitProcess (nExitCode);
+				}
+
+				/* no server, do it ourselves */
+				ParseCommandLine (commandline);
+				nExitCode = ProcessInput (TRUE);
+#ifdef FEATURE_PROFILE
+				ProfileStop ();
+#endif
+#ifdef FEATURE_TRACE
+				TraceStop ();
+#endif
+				ExitProcess (nExitCode);
+			}
+#endif
+#ifdef FEATURE_TRACE
+			else if (!_tcsnicmp (argv[i], _T("/tracejson:"), 11))
+			{
+				/* This converts a trace file and exits */
+				TCHAR szJsonFile[MAX_PATH];
+				LPTSTR p;
+
+				if (i + 1 < argc)
+				{
+					_tcsncpy (szJsonFile, argv[i + 1], MAX_PATH);
+				}
+				else
+				{
+					_tcsncpy (szJsonFile, &argv[i][11], MAX_PATH - 5);
+					szJsonFile[MAX_PATH - 6] = _T('\0');
+					p = _tcsrchr (szJsonFile, _T('.'));
+					if (p == NULL || _tcschr (p, _T('\\')) != NULL)
+						p = szJsonFile + _tcslen (szJsonFile);
+					_tcscpy (p, _T(".json"));
+				}
+				szJsonFile[MAX_PATH - 1] = _T('\0');
+
+				nExitCode = ConvertTrace (&argv[i][11], szJsonFile) ? 0 : 1;
+				ConOutFlush ();
+				ExitProcess (nExitCode);
+			}
+			else if (!_tcsnicmp (argv[i], _T("/trace:"), 7))
+			{
+				TraceStart (&argv[i][7], FALSE);
+			}
+#endif
+#ifdef FEATURE_PROFILE
+			else if (!_tcsnicmp (argv[i], _T("/profile"), 8))
+			{
+				ProfileStart (argv[i][8] == _T(':') ? &argv[i][9] : NULL);
+			}
+#endif
+#ifdef FEATURE_DELAYED_EXPANSION
+			else if (!_tcsnicmp (argv[i], _T("/v:"), 3))
+			{
+				SetDelayedExpansion (!_tcsicmp (&argv[i][3], _T("on")));
+			}
+#endif
 #ifdef INCLUDE_CMD_COLOR
 			else if (!_tcsnicmp (argv[i], _T("/t:"), 3))
 			{
 				/* process /t (color) argument */
+				GetScreenHandle ();
 				wDefColor = (WORD)_tcstoul (&argv[i][3], NULL, 16);
 				wColor = wDefColor;
 				SetScreenColor (wColor, TRUE);
@@ -1153,6 +2554,12 @@ Initialize (int argc, TCHAR* argv[])
 		}
 	}
 
+#ifdef FEATURE_VIRTUAL_TERMINAL
+	/* from here on the shell is interactive, or runs until Cleanup */
+	if (!bHeadless)
+		ConEnableVirtualTerminal ();
+#endif
+
 	/* run cmdstart.bat */
 	if (IsValidFileName (_T("cmdstart.bat")))
 	{
@@ -1195,7 +2602,7 @@ Initialize (int argc, TCHAR* argv[])
 	if (0 != GetModuleFileName (NULL, ModuleName, _MAX_PATH + 1))
 	{
 		ModuleName[_MAX_PATH] = _T('\0');
-		SetEnvironmentVariable (_T("COMSPEC"), ModuleName);
+		SetEnvVar (_T("COMSPEC"), ModuleName);
 	}
 
 	/* add ctrl break handler */
@@ -1253,10 +2660,23 @@ static VOID Cleanup (int argc, TCHAR *argv[])
 #endif
 
 
+#ifdef FEATURE_PROFILE
+	ProfileStop ();
+#endif
+
+#ifdef FEATURE_TRACE
+	TraceStop ();
+#endif
+
 	/* remove ctrl break handler */
 	RemoveBreakHandler ();
-	SetConsoleMode( GetStdHandle( STD_INPUT_HANDLE ),
-			ENABLE_LINE_INPUT | ENABLE_PROCESSED_INPUT | ENABLE_ECHO_INPUT );
+	if (!bHeadless)
+		SetConsoleMode( GetStdHandle( STD_INPUT_HANDLE ),
+				ENABLE_LINE_INPUT | ENABLE_PROCESSED_INPUT | ENABLE_ECHO_INPUT );
+#ifdef FEATURE_VIRTUAL_TERMINAL
+	ConDisableVirtualTerminal ();
+#endif
+	ConOutFlush ();
 }
 
 #ifdef __REACTOS__
@@ -1315,7 +2735,6 @@ int main(void)
 int main (int argc, char *argv[])
 #endif
 {
-  CONSOLE_SCREEN_BUFFER_INFO Info;
   INT nExitCode;
 #ifdef _UNICODE
   PWCHAR * argv;
@@ -1329,17 +2748,6 @@ int main (int argc, char *argv[])
 
   SetFileApisToOEM();
 
-  hConsole = CreateFile(_T("CONOUT$"), GENERIC_READ|GENERIC_WRITE, 
-                        FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, 
-			OPEN_EXISTING, 0, NULL);
-  if (GetConsoleScreenBufferInfo(hConsole, &Info) == FALSE)
-    {
-      ConErrPrintf (_T("GetConsoleScreenBufferInfo: Error: %ld\n"), GetLastError());
-      return(1);
-    }
-  wColor = Info.wAttributes;
-  wDefColor = wColor;
-
   /* check switches on command-line */
   Initialize(argc, argv);
 
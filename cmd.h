@@ -76,12 +76,12 @@
 /* global variables */
 extern HANDLE hOut;
 extern HANDLE hIn;
-extern HANDLE hConsole;
 extern WORD   wColor;
 extern WORD   wDefColor;
 extern BOOL   bCtrlBreak;
 extern BOOL   bIgnoreEcho;
 extern BOOL   bExit;
+extern BOOL   bHeadless;
 extern INT    nErrorLevel;
 extern SHORT  maxx;
 extern SHORT  maxy;
@@ -93,6 +93,7 @@ extern OSVERSIONINFO osvi;
 VOID InitializeAlias (VOID);
 VOID DestroyAlias (VOID);
 VOID ExpandAlias (LPTSTR, INT);
+UINT GetAliasGeneration (VOID);
 INT CommandAlias (LPTSTR, LPTSTR);
 
 
@@ -121,7 +122,9 @@ INT cmd_cls (LPTSTR, LPTSTR);
 
 
 /* Prototypes for CMD.C */
+HANDLE GetScreenHandle (VOID);
 VOID ParseCommandLine (LPTSTR);
+INT  ProcessInput (BOOL);
 VOID AddBreakHandler (VOID);
 VOID RemoveBreakHandler (VOID);
 
@@ -134,6 +137,7 @@ VOID ReadCommand (LPTSTR, INT);
 #define CMD_SPECIAL     1
 #define CMD_BATCHONLY   2
 #define CMD_HIDE        4
+#define CMD_THREADSAFE  8	/* may run as a pipeline stage on a worker thread */
 
 typedef struct tagCOMMAND
 {
@@ -144,6 +148,8 @@ typedef struct tagCOMMAND
 
 extern COMMAND cmds[];		/* The internal command table */
 
+LPCOMMAND FindCommand (LPTSTR, LPINT);
+
 VOID PrintCommandList (VOID);
 
 
@@ -162,9 +168,27 @@ VOID ConInDisable (VOID);
 VOID ConInEnable (VOID);
 VOID ConInFlush (VOID);
 VOID ConInKey (PINPUT_RECORD);
+INT  ConInKeyRun (LPTSTR, INT);
 VOID ConInString (LPTSTR, DWORD);
+BOOL ConInLine (LPTSTR, DWORD);
+VOID ConInRelease (VOID);
+
+BOOL ConIsConsole (DWORD);
+VOID ConInitOutput (VOID);
+VOID ConSetHeadless (VOID);
+BOOL ConEnableVirtualTerminal (VOID);
+VOID ConDisableVirtualTerminal (VOID);
+VOID ConSuspendVirtualTerminal (VOID);
+VOID ConResumeVirtualTerminal (VOID);
+BOOL ConIsVirtualTerminal (VOID);
+VOID ConOutFlush (VOID);
+
+BOOL   ConInitThreadOutput (VOID);
+VOID   ConSetThreadOutput (HANDLE);
+HANDLE ConGetStdHandle (DWORD);
 
 VOID ConOutChar (TCHAR);
+VOID ConOutString (LPCTSTR, DWORD);
 VOID ConOutPuts (LPTSTR);
 VOID ConOutPrintf (LPTSTR, ...);
 VOID ConErrChar (TCHAR);
@@ -175,6 +199,7 @@ SHORT GetCursorX  (VOID);
 SHORT GetCursorY  (VOID);
 VOID  GetCursorXY (PSHORT, PSHORT);
 VOID  SetCursorXY (SHORT, SHORT);
+VOID  WriteScreenXY (SHORT, SHORT, LPCTSTR, DWORD);
 
 VOID GetScreenSize (PSHORT, PSHORT);
 VOID SetCursorType (BOOL, BOOL);
@@ -216,6 +241,19 @@ INT  CommandEchoerr (LPTSTR, LPTSTR);
 INT  CommandEchoserr (LPTSTR, LPTSTR);
 
 
+/* Prototypes for ENV.C */
+LPCTSTR GetEnvVar (LPCTSTR);
+BOOL    SetEnvVar (LPCTSTR, LPCTSTR);
+BOOL    ExpandVariables (LPCTSTR, LPTSTR *, LPINT, BOOL);
+VOID    SetEnvironmentBlock (LPCTSTR);
+BOOL    EnterEnvScope (VOID);
+BOOL    LeaveEnvScope (VOID);
+VOID    LeaveEnvScopes (INT);
+INT     GetEnvScopeDepth (VOID);
+BOOL    GetDelayedExpansion (VOID);
+VOID    SetDelayedExpansion (BOOL);
+
+
 /* Prototypes for ERROR.C */
 VOID ErrorMessage (DWORD, LPTSTR, ...);
 
@@ -278,6 +316,14 @@ INT  CommandRem (LPTSTR, LPTSTR);
 INT  CommandShowCommands (LPTSTR, LPTSTR);
 
 
+/* Prototypes for JOBS.C */
+VOID AddJob (HANDLE, DWORD, LPCTSTR);
+VOID ThrottleJobs (VOID);
+VOID ReleaseJobs (VOID);
+INT  cmd_jobs (LPTSTR, LPTSTR);
+INT  cmd_wait (LPTSTR, LPTSTR);
+
+
 /* Prototypes for LABEL.C */
 INT cmd_label (LPTSTR, LPTSTR);
 
@@ -293,6 +339,7 @@ extern TCHAR cDecimalSeparator;
 extern INT   nNumberGroups;
 
 VOID InitLocale (VOID);
+VOID LoadLocale (VOID);
 VOID PrintDate (VOID);
 VOID PrintTime (VOID);
 
@@ -310,7 +357,6 @@ LPTSTR _stpcpy (LPTSTR, LPTSTR);
 BOOL   IsValidPathName (LPCTSTR);
 BOOL   IsValidFileName (LPCTSTR);
 BOOL   IsValidDirectory (LPCTSTR);
-BOOL   FileGetString (HANDLE, LPTSTR, INT);
 #ifndef __REACTOS__
 HWND   GetConsoleWindow(VOID);
 #endif
@@ -337,6 +383,18 @@ INT CommandMsgbox (LPTSTR, LPTSTR);
 INT cmd_path (LPTSTR, LPTSTR);
 
 
+/* Prototypes for PROFILE.C */
+extern BOOL bProfile;
+VOID   ProfileStart (LPCTSTR);
+VOID   ProfileStop (VOID);
+VOID   ProfileBatch (LPCTSTR);
+VOID   ProfileBatchExit (LPVOID);
+VOID   ProfileLine (BOOL);
+LPVOID ProfileBegin (VOID);
+VOID   ProfileEnd (LPVOID);
+VOID   ProfileChildProcess (HANDLE);
+
+
 /* Prototypes from PROMPT.C */
 VOID PrintPrompt (VOID);
 INT  cmd_prompt (LPTSTR, LPTSTR);
@@ -359,10 +417,20 @@ INT cmd_rename (LPTSTR, LPTSTR);
 INT CommandScreen (LPTSTR, LPTSTR);
 
 
+/* Prototypes for SERVER.C */
+INT  RunServer (LPCTSTR);
+BOOL RunClient (LPCTSTR, LPCTSTR, LPINT);
+
+
 /* Prototypes for SET.C */
 INT cmd_set (LPTSTR, LPTSTR);
 
 
+/* Prototypes for SETLOCAL.C */
+INT cmd_setlocal (LPTSTR, LPTSTR);
+INT cmd_endlocal (LPTSTR, LPTSTR);
+
+
 /* Prototypes for START.C */
 INT cmd_start (LPTSTR, LPTSTR);
 
@@ -371,6 +439,13 @@ INT cmd_start (LPTSTR, LPTSTR);
 BOOL StringToColor (LPWORD, LPTSTR *);
 
 
+/* Prototypes for TELEMETRY.C */
+VOID RecordProcessTelemetry (HANDLE, LPCTSTR, DWORD, BOOL);
+VOID ReapProcessTelemetry (VOID);
+VOID WatchProcessTelemetry (HANDLE, LPCTSTR);
+BOOL GetTelemetryVariable (LPCTSTR, LPTSTR, INT);
+
+
 /* Prototypes for TIME.C */
 INT cmd_time (LPTSTR, LPTSTR);
 
@@ -383,6 +458,26 @@ INT CommandTimer (LPTSTR cmd, LPTSTR param);
 INT cmd_title (LPTSTR, LPTSTR);
 
 
+/* Prototypes for TRACE.C */
+#define TRACE_PARSE         0   /* ParseCommandLine, 'B' and 'E' */
+#define TRACE_COMMAND       1   /* DoCommand, 'B' and 'E' */
+#define TRACE_INTERNAL      2   /* internal command dispatched, 'i' */
+#define TRACE_PROCESS       3   /* child process waited for, 'B' and 'E', */
+                                /* a pipeline stage or job, 'b' and 'e', */
+                                /* a GUI program left running, 'i' */
+#define TRACE_REDIR_OPEN    4   /* 'i', the argument is the std handle */
+#define TRACE_REDIR_CLOSE   5   /* (0 input, 1 output, 2 error) */
+#define TRACE_BATCH         6   /* batch file, 'b' and 'e' */
+#define TRACE_GOTO          7   /* 'i' */
+#define TRACE_CALL          8   /* 'i' */
+
+extern BOOL bTrace;
+VOID TraceStart (LPCTSTR, BOOL);
+VOID TraceStop (VOID);
+VOID TraceEvent (INT, CHAR, LPCTSTR, DWORD);
+BOOL ConvertTrace (LPCTSTR, LPCTSTR);
+
+
 /* Prototypes for TYPE.C */
 INT cmd_type (LPTSTR, LPTSTR);
 
@@ -95,6 +95,15 @@
  *
  *    30-Apr-2004 (Filip Navara <xnavara@volny.cz>)
  *        Fixed problems when the screen was scrolled away.
+ *
+ *    17-Oct-2026
+ *        Printable keys that arrived together, as from a paste, are
+ *        inserted and echoed at once.
+ *
+ *    17-Oct-2026
+ *        The line editor keeps track of the cursor and of what the screen
+ *        shows, and writes only the characters changed by each key.
+ *        ClearCommandLine is gone.
  */
 
 #include "config.h"
@@ -116,35 +125,114 @@ SHORT maxy;
 static BOOL bInsert = TRUE;
 
 
+/*
+ * What the screen shows of the line being edited. The cursor and the
+ * screen contents are tracked here instead of being asked from the
+ * console, and each edit writes only the characters that changed.
+ */
+static TCHAR szShown[CMDLINE_LENGTH];
+static INT   nShown;		/* characters of the line on the screen */
+static INT   nCursor;		/* character the cursor is at */
+static SHORT orgx;			/* where the line starts */
+static SHORT orgy;
+
+
+/* the prompt was printed, the line starts at the cursor */
+static VOID
+LineStart (VOID)
+{
+	GetCursorXY (&orgx, &orgy);
+	nShown = 0;
+	nCursor = 0;
+}
+
+
+/* puts the cursor on character pos of the line */
 static VOID
-ClearCommandLine (LPTSTR str, INT maxlen, SHORT orgx, SHORT orgy)
+LineCursor (INT pos)
 {
-	INT count;
+	if (pos == nCursor)
+		return;
+
+	SetCursorXY ((SHORT)((orgx + pos) % maxx),
+	             (SHORT)(orgy + (orgx + pos) / maxx));
+	nCursor = pos;
+}
 
-	SetCursorXY (orgx, orgy);
-	for (count = 0; count < (INT)_tcslen (str); count++)
-		ConOutChar (_T(' '));
-	_tcsnset (str, _T('\0'), maxlen);
-	SetCursorXY (orgx, orgy);
+
+/* makes the screen show the first len characters of str */
+static VOID
+LineShow (LPCTSTR str, INT len)
+{
+	INT common = (len < nShown) ? len : nShown;
+	INT end = (len > nShown) ? len : nShown;
+	INT first;
+	INT last;
+	INT i;
+	INT nScroll;
+
+	for (first = 0; first < common; first++)
+		if (str[first] != szShown[first])
+			break;
+
+	if (first == end)
+		return;
+
+	/* past the shown part the screen is not known, it's all written */
+	last = end - 1;
+	if (len == nShown)
+		while (str[last] == szShown[last])
+			last--;
+
+	for (i = first; i <= last; i++)
+		szShown[i] = (i < len) ? str[i] : _T(' ');
+	nShown = len;
+
+	nScroll = orgy + (orgx + len) / maxx - (maxy - 1);
+	if (nScroll > 0)
+	{
+		/* the line doesn't fit below, let the console scroll */
+		LineCursor (first);
+		ConOutString (&szShown[first], last - first + 1);
+		orgy -= nScroll;
+		nCursor = last + 1;
+	}
+	else
+	{
+		WriteScreenXY ((SHORT)((orgx + first) % maxx),
+		               (SHORT)(orgy + (orgx + first) / maxx),
+		               &szShown[first], last - first + 1);
+	}
 }
 
 
 /* read in a command line */
 VOID ReadCommand (LPTSTR str, INT maxlen)
 {
-	SHORT orgx;			/* origin x/y */
-	SHORT orgy;
-	SHORT curx;			/*current x/y cursor position*/
-	SHORT cury;
-	SHORT tempscreen;
 	INT   count;		/*used in some for loops*/
 	INT   current = 0;	/*the position of the cursor in the string (str)*/
 	INT   charcount = 0;/*chars in the string (str)*/
+	INT   nRun;			/*chars inserted at once*/
+	INT   nRoom;
+	TCHAR run[CMDLINE_LENGTH];
 	INPUT_RECORD ir;
 	WORD   wLastKey = 0;
 	TCHAR  ch;
 	BOOL bContinue=FALSE;/*is TRUE the second case will not be executed*/
 
+	if (bHeadless)
+	{
+		/* no line editing, the end of the input ends the shell */
+		if (bEcho)
+			PrintPrompt();
+		if (!ConInLine (str, maxlen))
+			bExit = TRUE;
+		return;
+	}
+
+	if (maxlen > CMDLINE_LENGTH)
+		maxlen = CMDLINE_LENGTH;
+
 	/* get screen size */
 	GetScreenSize (&maxx, &maxy);
 
@@ -152,8 +240,7 @@ VOID ReadCommand (LPTSTR str, INT maxlen)
 	if (bEcho)
 		PrintPrompt();
 
-	GetCursorXY (&orgx, &orgy);
-	GetCursorXY (&curx, &cury);
+	LineStart ();
 
 	memset (str, 0, maxlen * sizeof (TCHAR));
 
@@ -182,10 +269,8 @@ VOID ReadCommand (LPTSTR str, INT maxlen)
 						if (str[0])
 							History(0,str);
 
-						ClearCommandLine (str, maxlen, orgx, orgy);
+						str[0] = _T('\0');
 						current = charcount = 0;
-						curx = orgx;
-						cury = orgy;
 						bContinue=TRUE;
 						break;
 					}
@@ -195,11 +280,8 @@ VOID ReadCommand (LPTSTR str, INT maxlen)
 					if (ir.Event.KeyEvent.dwControlKeyState &
 						(LEFT_CTRL_PRESSED|RIGHT_CTRL_PRESSED))
 					{
-						ClearCommandLine (str, maxlen, orgx, orgy);
 						History_del_current_entry(str);					
 						current = charcount = _tcslen (str);
-						ConOutPrintf (_T("%s"), str);
-						GetCursorXY (&curx, &cury);
 						bContinue=TRUE;
 						break;
 					}
@@ -223,43 +305,8 @@ VOID ReadCommand (LPTSTR str, INT maxlen)
 				/* <BACKSPACE> - delete character to left of cursor */
 				if (current > 0 && charcount > 0)
 				{
-					if (current == charcount)
-					{
-						/* if at end of line */
-						str[current - 1] = _T('\0');
-						if (GetCursorX () != 0)
-						{
-							ConOutPrintf (_T("\b \b"));
-							curx--;
-						}
-						else
-						{
-							SetCursorXY ((SHORT)(maxx - 1), (SHORT)(GetCursorY () - 1));
-							ConOutChar (_T(' '));
-							SetCursorXY ((SHORT)(maxx - 1), (SHORT)(GetCursorY () - 1));
-							cury--;
-							curx = maxx - 1;
-						}
-					}
-					else
-					{
-						for (count = current - 1; count < charcount; count++)
-							str[count] = str[count + 1];
-						if (GetCursorX () != 0)
-						{
-							SetCursorXY ((SHORT)(GetCursorX () - 1), GetCursorY ());
-							curx--;
-						}
-						else
-						{
-							SetCursorXY ((SHORT)(maxx - 1), (SHORT)(GetCursorY () - 1));
-							cury--;
-							curx = maxx - 1;
-						}
-						GetCursorXY (&curx, &cury);
-						ConOutPrintf (_T("%s "), &str[current - 1]);
-						SetCursorXY (curx, cury);
-					}
+					memmove (&str[current - 1], &str[current],
+					         (charcount - current + 1) * sizeof (TCHAR));
 					charcount--;
 					current--;
 				}
@@ -278,32 +325,17 @@ VOID ReadCommand (LPTSTR str, INT maxlen)
 					for (count = current; count < charcount; count++)
 						str[count] = str[count + 1];
 					charcount--;
-					GetCursorXY (&curx, &cury);
-					ConOutPrintf (_T("%s "), &str[current]);
-					SetCursorXY (curx, cury);
 				}
 				break;
 
 			case VK_HOME:
 				/* goto beginning of string */
-				if (current != 0)
-				{
-					SetCursorXY (orgx, orgy);
-					curx = orgx;
-					cury = orgy;
-					current = 0;
-				}
+				current = 0;
 				break;
 
 			case VK_END:
 				/* goto end of string */
-				if (current != charcount)
-				{
-					SetCursorXY (orgx, orgy);
-					ConOutPrintf (_T("%s"), str);
-					GetCursorXY (&curx, &cury);
-					current = charcount;
-				}
+				current = charcount;
 				break;
 
 			case VK_TAB:
@@ -316,7 +348,6 @@ VOID ReadCommand (LPTSTR str, INT maxlen)
 					if (wLastKey != VK_TAB)
 					{
 						/* if first TAB, complete filename*/
-						tempscreen = charcount;
 						CompleteFilename (str, charcount);
 						charcount = _tcslen (str);
 						current = charcount;
@@ -324,43 +355,16 @@ VOID ReadCommand (LPTSTR str, INT maxlen)
 						if (current > 0 &&
 						    str[current-1] == _T('"'))
 							current--;
-
-						SetCursorXY (orgx, orgy);
-						ConOutPrintf (_T("%s"), str);
-
-						if (tempscreen > charcount)
-						{
-							GetCursorXY (&curx, &cury);
-							for (count = tempscreen - charcount; count--; )
-								ConOutChar (_T(' '));
-							SetCursorXY (curx, cury);
-						}
-						else
-						{
-							if (((charcount + orgx) / maxx) + orgy > maxy - 1)
-								orgy += maxy - ((charcount + orgx) / maxx + orgy + 1);
-					        }
-
-						/* set cursor position */
-						SetCursorXY ((orgx + current) % maxx,
-							     orgy + (orgx + current) / maxx);
-						GetCursorXY (&curx, &cury);
 					}
 					else
 					{
 						/*if second TAB, list matches*/
+						LineCursor (charcount);
 						if (ShowCompletionMatches (str, charcount))
 						{
 							PrintPrompt ();
-							GetCursorXY (&orgx, &orgy);
-							ConOutPrintf (_T("%s"), str);
-
-							/* set cursor position */
-							SetCursorXY ((orgx + current) % maxx,
-								     orgy + (orgx + current) / maxx);
-							GetCursorXY (&curx, &cury);
+							LineStart ();
 						}
-						
 					}
 				}
 				else
@@ -395,14 +399,13 @@ VOID ReadCommand (LPTSTR str, INT maxlen)
 					History (0, str);
 #endif
 				ConInDummy ();
+				LineCursor (charcount);
 				ConOutChar (_T('\n'));
 				break;
 
 			case VK_ESCAPE:
 				/* clear str  Make this callable! */
-				ClearCommandLine (str, maxlen, orgx, orgy);
-				curx = orgx;
-				cury = orgy;
+				str[0] = _T('\0');
 				current = charcount = 0;
 				break;
 
@@ -413,26 +416,16 @@ VOID ReadCommand (LPTSTR str, INT maxlen)
 			case VK_UP:
 #ifdef FEATURE_HISTORY
 				/* get previous command from buffer */
-				ClearCommandLine (str, maxlen, orgx, orgy);
 				History (-1, str);
 				current = charcount = _tcslen (str);
-				if (((charcount + orgx) / maxx) + orgy > maxy - 1)
-					orgy += maxy - ((charcount + orgx) / maxx + orgy + 1);
-				ConOutPrintf (_T("%s"), str);
-				GetCursorXY (&curx, &cury);
 #endif
 				break;
 
 			case VK_DOWN:
 #ifdef FEATURE_HISTORY
 				/* get next command from buffer */
-				ClearCommandLine (str, maxlen, orgx, orgy);
 				History (1, str);
 				current = charcount = _tcslen (str);
-				if (((charcount + orgx) / maxx) + orgy > maxy - 1)
-					orgy += maxy - ((charcount + orgx) / maxx + orgy + 1);
-				ConOutPrintf (_T("%s"), str);
-				GetCursorXY (&curx, &cury);
 #endif
 				break;
 
@@ -441,17 +434,6 @@ VOID ReadCommand (LPTSTR str, INT maxlen)
 				if (current > 0)
 				{
 					current--;
-					if (GetCursorX () == 0)
-					{
-						SetCursorXY ((SHORT)(maxx - 1), (SHORT)(GetCursorY () - 1));
-						curx = maxx - 1;
-						cury--;
-					}
-					else
-					{
-						SetCursorXY ((SHORT)(GetCursorX () - 1), GetCursorY ());
-						curx--;
-					}
 				}
 				else
 				{
@@ -466,20 +448,7 @@ VOID ReadCommand (LPTSTR str, INT maxlen)
 			case VK_RIGHT:
 				/* move cursor right */
 				if (current != charcount)
-				{
 					current++;
-					if (GetCursorX () == maxx - 1)
-					{
-						SetCursorXY (0, (SHORT)(GetCursorY () + 1));
-						curx = 0;
-						cury++;
-					}
-					else
-					{
-						SetCursorXY ((SHORT)(GetCursorX () + 1), GetCursorY ());
-						curx++;
-					}
-				}
 				break;
 
 			default:
@@ -491,42 +460,29 @@ VOID ReadCommand (LPTSTR str, INT maxlen)
 				if ((UCHAR)ch >= 32 && (charcount != (maxlen - 2)))
 #endif /* _UNICODE */
 				{
-					/* insert character into string... */
+					/* take the rest of a paste along */
+					nRoom = maxlen - 2 - (bInsert ? charcount : current);
+					run[0] = ch;
+					nRun = 1 + ConInKeyRun (&run[1], nRoom - 1);
+
+					/* insert characters into string... */
 					if (bInsert && current != charcount)
 					{
-					        /* If this character insertion will cause screen scrolling,
-					         * adjust the saved origin of the command prompt. */
-					        tempscreen = _tcslen(str + current) + curx;
-						if ((tempscreen % maxx) == (maxx - 1) &&
-						    (tempscreen / maxx) + cury == (maxy - 1))
-						{
-							orgy--;
-							cury--;
-						}
-
-						for (count = charcount; count > current; count--)
-							str[count] = str[count - 1];
-						str[current++] = ch;
-						if (curx == maxx - 1)
-							curx = 0, cury++;
-						else
-							curx++;
-						ConOutPrintf (_T("%s"), &str[current - 1]);
-						SetCursorXY (curx, cury);
-						charcount++;
+						memmove (&str[current + nRun], &str[current],
+						         (charcount - current + 1) * sizeof (TCHAR));
+						memcpy (&str[current], run, nRun * sizeof (TCHAR));
+						charcount += nRun;
+						current += nRun;
 					}
 					else
 					{
-						if (current == charcount)
-							charcount++;
-						str[current++] = ch;
-						if (GetCursorX () == maxx - 1 && GetCursorY () == maxy - 1)
-							orgy--, cury--;
-						if (GetCursorX () == maxx - 1)
-							curx = 0, cury++;
-						else
-							curx++;
-						ConOutChar (ch);
+						memcpy (&str[current], run, nRun * sizeof (TCHAR));
+						current += nRun;
+						if (current > charcount)
+						{
+							charcount = current;
+							str[charcount] = _T('\0');
+						}
 					}
 				}
 #if 0
@@ -542,6 +498,14 @@ VOID ReadCommand (LPTSTR str, INT maxlen)
 				break;
 
 		}
+
+		/* bring the screen up to date */
+		if (ir.Event.KeyEvent.wVirtualKeyCode != VK_RETURN)
+		{
+			LineShow (str, charcount);
+			LineCursor (current);
+		}
+
 		wLastKey = ir.Event.KeyEvent.wVirtualKeyCode;
 	}
 	while (ir.Event.KeyEvent.wVirtualKeyCode != VK_RETURN);
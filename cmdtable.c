@@ -24,6 +24,11 @@
 
 #include "cmd.h"
 
+
+/* size of the hash table of command names, a power of two which is
+ * well above the number of commands */
+#define CMD_HASH_SIZE  256
+
 /* a list of all the internal commands, associating their command names */
 /* to the functions to process them                                     */
 
@@ -96,13 +101,17 @@ COMMAND cmds[] =
 	{_T("dirs"), 0, CommandDirs},
 #endif
 
-	{_T("echo"), 0, CommandEcho},
-	{_T("echo."), CMD_HIDE, CommandEcho},
-	{_T("echos"), 0, CommandEchos},
+	{_T("echo"), CMD_THREADSAFE, CommandEcho},
+	{_T("echo."), CMD_HIDE | CMD_THREADSAFE, CommandEcho},
+	{_T("echos"), CMD_THREADSAFE, CommandEchos},
 	{_T("echoerr"), 0, CommandEchoerr},
 	{_T("echoerr."), CMD_HIDE, CommandEchoerr},
 	{_T("echoserr"), 0, CommandEchoserr},
 
+#ifdef INCLUDE_CMD_SETLOCAL
+	{_T("endlocal"), 0, cmd_endlocal},
+#endif
+
 #ifdef INCLUDE_CMD_DEL
 	{_T("erase"), 0, CommandDelete},
 #endif
@@ -123,6 +132,10 @@ COMMAND cmds[] =
 
 	{_T("if"), 0, cmd_if},
 
+#ifdef INCLUDE_CMD_JOBS
+	{_T("jobs"), 0, cmd_jobs},
+#endif
+
 #ifdef INCLUDE_CMD_LABEL
 	{_T("label"), 0, cmd_label},
 #endif
@@ -189,6 +202,10 @@ COMMAND cmds[] =
 	{_T("set"), 0, cmd_set},
 #endif
 
+#ifdef INCLUDE_CMD_SETLOCAL
+	{_T("setlocal"), 0, cmd_setlocal},
+#endif
+
 	{_T("shift"), CMD_BATCHONLY, cmd_shift},
 
 #ifdef INCLUDE_CMD_START
@@ -208,11 +225,11 @@ COMMAND cmds[] =
 #endif
 
 #ifdef INCLUDE_CMD_TYPE
-	{_T("type"), 0, cmd_type},
+	{_T("type"), CMD_THREADSAFE, cmd_type},
 #endif
 
 #ifdef INCLUDE_CMD_VER
-	{_T("ver"), 0, cmd_ver},
+	{_T("ver"), CMD_THREADSAFE, cmd_ver},
 #endif
 
 #ifdef INCLUDE_CMD_VERIFY
@@ -220,7 +237,11 @@ COMMAND cmds[] =
 #endif
 
 #ifdef INCLUDE_CMD_VOL
-	{_T("vol"), 0, cmd_vol},
+	{_T("vol"), CMD_THREADSAFE, cmd_vol},
+#endif
+
+#ifdef INCLUDE_CMD_JOBS
+	{_T("wait"), 0, cmd_wait},
 #endif
 
 #ifdef INCLUDE_CMD_WINDOW
@@ -231,6 +252,114 @@ COMMAND cmds[] =
 };
 
 
+/* open addressing hash tables over cmds[], built on the first lookup */
+static LPCOMMAND lpCommandHash[CMD_HASH_SIZE];
+static LPCOMMAND lpSpecialHash[CMD_HASH_SIZE];
+static BOOL bCommandHash = FALSE;
+
+
+static UINT HashCommandName (LPCTSTR name, INT len)
+{
+	UINT h = 0;
+
+	while (len-- > 0)
+		h = h * 31 + (UINT)*name++;
+
+	return h & (CMD_HASH_SIZE - 1);
+}
+
+
+static VOID InsertCommand (LPCOMMAND *lpHash, LPCOMMAND cmdptr)
+{
+	UINT h = HashCommandName (cmdptr->name, _tcslen (cmdptr->name));
+
+	while (lpHash[h] != NULL)
+	{
+		/* the first of duplicate names wins, as in a linear search */
+		if (!_tcscmp (lpHash[h]->name, cmdptr->name))
+			return;
+		h = (h + 1) & (CMD_HASH_SIZE - 1);
+	}
+
+	lpHash[h] = cmdptr;
+}
+
+
+static LPCOMMAND LookupCommand (LPCOMMAND *lpHash, LPCTSTR name, INT len)
+{
+	UINT h = HashCommandName (name, len);
+
+	while (lpHash[h] != NULL)
+	{
+		if (!_tcsncmp (lpHash[h]->name, name, len) &&
+		    lpHash[h]->name[len] == _T('\0'))
+			return lpHash[h];
+		h = (h + 1) & (CMD_HASH_SIZE - 1);
+	}
+
+	return NULL;
+}
+
+
+static VOID BuildCommandHash (VOID)
+{
+	LPCOMMAND cmdptr;
+
+	for (cmdptr = cmds; cmdptr->name != NULL; cmdptr++)
+	{
+		InsertCommand (lpCommandHash, cmdptr);
+
+		/* the commands like CD which may be followed by their
+		 * parameter without a space get a table of their own */
+		if (cmdptr->flags & CMD_SPECIAL)
+			InsertCommand (lpSpecialHash, cmdptr);
+	}
+
+	bCommandHash = TRUE;
+}
+
+
+/*
+ * Looks up the first word of a command line in the internal command
+ * table. Returns NULL if it is not an internal command.
+ *
+ * com must be in lower case. *pcl is set to the length of the command
+ * name if the word is one of the commands like CD which are recognised
+ * even when the command name and parameter are not space separated,
+ * otherwise to 0.
+ *
+ * e.g dir..
+ * cd\freda
+ */
+
+LPCOMMAND FindCommand (LPTSTR com, LPINT pcl)
+{
+	LPCOMMAND cmdptr;
+	INT cl;
+
+	if (!bCommandHash)
+		BuildCommandHash ();
+
+	*pcl = 0;
+
+	cmdptr = LookupCommand (lpCommandHash, com, _tcslen (com));
+	if (cmdptr != NULL)
+		return cmdptr;
+
+	/* the command names don't contain any of the separators, so only
+	 * the part in front of the first one can be a special command */
+	cl = _tcscspn (com, _T("\\.-"));
+	if (com[cl] == _T('\0'))
+		return NULL;
+
+	cmdptr = LookupCommand (lpSpecialHash, com, cl);
+	if (cmdptr != NULL)
+		*pcl = cl;
+
+	return cmdptr;
+}
+
+
 VOID PrintCommandList (VOID)
 {
 	LPCOMMAND cmdptr;
@@ -16,6 +16,10 @@
  *
  *    14-Oct-1999 (Paolo Pantaleo <paolopan@freemail.it>)
  *        4nt's syntax implemented
+ *
+ *    17-Oct-2026
+ *        The text color is set with a VT escape sequence when the
+ *        console supports them.
  */
 
 #include "config.h"
@@ -62,12 +66,26 @@ static VOID ColorHelp (VOID)
 }
 
 
+/*
+ * Converts the RGB bits of a console color to a VT color number, which
+ * has red and blue the other way round.
+ */
+
+static INT VirtualTerminalColor (WORD wRGB)
+{
+	return ((wRGB & 1) << 2) | (wRGB & 2) | ((wRGB & 4) >> 2);
+}
+
+
 VOID SetScreenColor (WORD wColor, BOOL bFill)
 {
 	DWORD dwWritten;
 	CONSOLE_SCREEN_BUFFER_INFO csbi;
 	COORD coPos;
 
+	if (bHeadless)
+		return;
+
 	if ((wColor & 0xF) == (wColor &0xF0) >> 4)
 	{
 	  ConErrPuts (_T("Same colors error! (Background and foreground can't be the same color)")); 
@@ -76,17 +94,27 @@ VOID SetScreenColor (WORD wColor, BOOL bFill)
     {
 	    if (bFill == TRUE)
     	{
-    	     GetConsoleScreenBufferInfo (hConsole, &csbi);
+    	     GetConsoleScreenBufferInfo (GetScreenHandle (), &csbi);
 
     	     coPos.X = 0;
     	     coPos.Y = 0;
-    	     FillConsoleOutputAttribute (hConsole,
+    	     FillConsoleOutputAttribute (GetScreenHandle (),
 		                            (WORD)(wColor & 0x00FF),
 		                            (csbi.dwSize.X)*(csbi.dwSize.Y),
 		                            coPos,
 		                            &dwWritten);
         }
-        SetConsoleTextAttribute (hConsole, (WORD)(wColor & 0x00FF));
+        if (ConIsVirtualTerminal ())
+        {
+            /* goes out along with the text */
+            ConOutPrintf (_T("\x1b[%d;%dm"),
+                          ((wColor & 0x08) ? 90 : 30) + VirtualTerminalColor (wColor & 7),
+                          ((wColor & 0x80) ? 100 : 40) + VirtualTerminalColor ((wColor >> 4) & 7));
+        }
+        else
+        {
+            SetConsoleTextAttribute (GetScreenHandle (), (WORD)(wColor & 0x00FF));
+        }
     }
 }
 
@@ -49,6 +49,35 @@
 #define FEATURE_REDIRECTION
 
 
+/* Define to keep the resource usage of external commands (CMD_LAST_*) */
+#define FEATURE_TELEMETRY
+
+
+/* Define to enable the command server (/SERVER and /CONNECT) */
+#define FEATURE_SERVER
+
+
+/* Define to keep compiled batch files in %CMD_BATCH_CACHE% */
+#define FEATURE_BATCH_CACHE
+
+
+/* Define to enable delayed expansion of !VAR! (/V:ON and SETLOCAL) */
+#define FEATURE_DELAYED_EXPANSION
+
+
+/* Define to enable the batch file profiler (/PROFILE) */
+#define FEATURE_PROFILE
+
+
+/* Define to enable the event trace (/TRACE and /TRACEJSON) */
+#define FEATURE_TRACE
+
+
+/* Define to control the screen with VT escape sequences when the
+ * console supports them */
+#define FEATURE_VIRTUAL_TERMINAL
+
+
 /* Define one of these to select the used locale. */
 /*  (date and time formats etc.) used in DATE, TIME, */
 /*  DIR, PROMPT etc. */
@@ -75,6 +104,7 @@
 #define INCLUDE_CMD_DELAY
 #define INCLUDE_CMD_DIR
 #define INCLUDE_CMD_FREE
+#define INCLUDE_CMD_JOBS
 #define INCLUDE_CMD_LABEL
 #define INCLUDE_CMD_MEMORY
 #define INCLUDE_CMD_MKDIR
@@ -88,6 +118,7 @@
 #define INCLUDE_CMD_RENAME
 #define INCLUDE_CMD_SCREEN
 #define INCLUDE_CMD_SET
+#define INCLUDE_CMD_SETLOCAL
 #define INCLUDE_CMD_START
 #define INCLUDE_CMD_TIME
 #define INCLUDE_CMD_TIMER
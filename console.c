@@ -7,6 +7,30 @@
  *
  *    20-Jan-1999 (Eric Kohl <ekohl@abo.rhein-zeitung.de>)
  *        started
+ *
+ *    17-Oct-2026
+ *        Added headless mode: buffered output and a line reader for
+ *        standard input, no console calls.
+ *
+ *    17-Oct-2026
+ *        Output of the main thread is always buffered, and flushed
+ *        before input is read, the screen is used directly, a child
+ *        is started, handles are switched and on exit.
+ *
+ *    17-Oct-2026
+ *        Unicode output is written to the console with WriteConsoleW and
+ *        converted for files and pipes without allocating on each call.
+ *
+ *    17-Oct-2026
+ *        Console input events are looked at in batches. ConInKeyRun takes
+ *        the printable keys already there, so a paste is inserted at once.
+ *
+ *    17-Oct-2026
+ *        Added WriteScreenXY for the line editor.
+ *
+ *    17-Oct-2026
+ *        Cursor moves and screen writes are sent as VT escape sequences
+ *        with the other output when the console supports them.
  */
 
 #include "config.h"
@@ -16,11 +40,443 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stdlib.h>
 
 #include "cmd.h"
 
 
 #define OUTPUT_BUFFER_SIZE  4096
+#define OUTPUT_CHUNK_SIZE   4096
+#define INPUT_BUFFER_SIZE   4096
+#define INPUT_RECORD_COUNT  256
+
+#ifndef ENABLE_VIRTUAL_TERMINAL_PROCESSING
+#define ENABLE_VIRTUAL_TERMINAL_PROCESSING 0x0004
+#endif
+
+
+/* TLS slot holding the standard output of a worker thread */
+static DWORD dwOutputTls = TLS_OUT_OF_INDEXES;
+
+/* The output of the main thread is collected here and written out by
+ * ConOutFlush, when the buffer is full or goes to another handle.
+ * Worker threads write directly. */
+static TCHAR  OutBuffer[OUTPUT_BUFFER_SIZE];
+static DWORD  dwOutBuffered = 0;
+static HANDLE hOutBuffered = INVALID_HANDLE_VALUE;
+static BOOL   bOutConsole = FALSE;
+static DWORD  dwMainThreadId = 0;
+
+#ifdef _UNICODE
+/* the output of the main thread converted for files and pipes, grown
+ * as needed and kept */
+static PCHAR  pScratch = NULL;
+static DWORD  dwScratchSize = 0;
+#endif
+
+/* headless input read ahead from standard input */
+static CHAR   InBuffer[INPUT_BUFFER_SIZE];
+static DWORD  dwInPos = 0;
+static DWORD  dwInLength = 0;
+static HANDLE hInBuffered = INVALID_HANDLE_VALUE;
+
+#ifdef FEATURE_VIRTUAL_TERMINAL
+/* With VT output the screen is controlled by escape sequences written
+ * to this handle, as long as it is the standard output. Coordinates are
+ * then relative to the window instead of the screen buffer. */
+static HANDLE hVirtualTerminal = INVALID_HANDLE_VALUE;
+static DWORD  dwOldOutputMode;
+#endif
+
+/* console input events looked at with PeekConsoleInput, usually a
+ * whole paste at once, of which the first dwInRecord are used */
+static INPUT_RECORD InRecords[INPUT_RECORD_COUNT];
+static DWORD  dwInRecord = 0;
+static DWORD  dwInRecords = 0;
+
+
+/*
+ * Returns TRUE if the standard handle is a console.
+ */
+
+static BOOL IsConsoleHandle (HANDLE hHandle)
+{
+	DWORD dwMode;
+
+	return GetConsoleMode (hHandle, &dwMode);
+}
+
+
+BOOL ConIsConsole (DWORD nStdHandle)
+{
+	return IsConsoleHandle (GetStdHandle (nStdHandle));
+}
+
+
+/*
+ * Starts buffering the output of the calling thread. Must be called by
+ * the main thread before anything is written.
+ */
+
+VOID ConInitOutput (VOID)
+{
+	dwMainThreadId = GetCurrentThreadId ();
+}
+
+
+#ifdef FEATURE_VIRTUAL_TERMINAL
+/*
+ * Turns on VT processing of the console output. Returns FALSE if the
+ * console doesn't support it.
+ */
+
+BOOL ConEnableVirtualTerminal (VOID)
+{
+	HANDLE hOutput = GetStdHandle (STD_OUTPUT_HANDLE);
+
+	if (bHeadless || !GetConsoleMode (hOutput, &dwOldOutputMode))
+		return FALSE;
+
+	if (!(dwOldOutputMode & ENABLE_VIRTUAL_TERMINAL_PROCESSING) &&
+	    !SetConsoleMode (hOutput, dwOldOutputMode | ENABLE_VIRTUAL_TERMINAL_PROCESSING))
+		return FALSE;
+
+	hVirtualTerminal = hOutput;
+	return TRUE;
+}
+
+
+/*
+ * Gives the console output its old mode back.
+ */
+
+VOID ConDisableVirtualTerminal (VOID)
+{
+	if (hVirtualTerminal == INVALID_HANDLE_VALUE)
+		return;
+
+	ConOutFlush ();
+	SetConsoleMode (hVirtualTerminal, dwOldOutputMode);
+	hVirtualTerminal = INVALID_HANDLE_VALUE;
+}
+
+
+/*
+ * Gives the console output its old mode back while a program runs on
+ * it, programs don't expect VT processing to be on.
+ */
+
+VOID ConSuspendVirtualTerminal (VOID)
+{
+	if (hVirtualTerminal == INVALID_HANDLE_VALUE)
+		return;
+
+	ConOutFlush ();
+	SetConsoleMode (hVirtualTerminal, dwOldOutputMode);
+}
+
+
+/*
+ * Turns VT processing on again once the program has run.
+ */
+
+VOID ConResumeVirtualTerminal (VOID)
+{
+	if (hVirtualTerminal == INVALID_HANDLE_VALUE)
+		return;
+
+	SetConsoleMode (hVirtualTerminal,
+	                dwOldOutputMode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+}
+#endif
+
+
+/*
+ * Returns TRUE if the screen is to be controlled with VT escape
+ * sequences written to the standard output.
+ */
+
+BOOL ConIsVirtualTerminal (VOID)
+{
+#ifdef FEATURE_VIRTUAL_TERMINAL
+	return (hVirtualTerminal != INVALID_HANDLE_VALUE &&
+	        ConGetStdHandle (STD_OUTPUT_HANDLE) == hVirtualTerminal);
+#else
+	return FALSE;
+#endif
+}
+
+
+/*
+ * Switches to headless mode.
+ */
+
+VOID ConSetHeadless (VOID)
+{
+	bHeadless = TRUE;
+}
+
+
+/*
+ * Writes out the buffered output of the main thread.
+ */
+
+#ifdef _UNICODE
+/*
+ * Converts to the ANSI code page in pieces on the stack, for worker
+ * threads which can't share the scratch buffer. Surrogate pairs are
+ * kept together.
+ */
+
+static VOID WriteChunked (HANDLE hOutput, LPCWSTR lpText, DWORD dwLength)
+{
+	CHAR  Chunk[OUTPUT_CHUNK_SIZE];
+	DWORD dwChars;
+	DWORD dwWritten;
+	INT   nBytes;
+
+	while (dwLength > 0)
+	{
+		dwChars = (dwLength < OUTPUT_CHUNK_SIZE / 3) ? dwLength : OUTPUT_CHUNK_SIZE / 3;
+		if (dwChars < dwLength && (lpText[dwChars - 1] & 0xFC00) == 0xD800)
+			dwChars--;
+
+		nBytes = WideCharToMultiByte (CP_ACP, 0, lpText, dwChars,
+		                              Chunk, OUTPUT_CHUNK_SIZE, NULL, NULL);
+		WriteFile (hOutput, Chunk, nBytes, &dwWritten, NULL);
+
+		lpText += dwChars;
+		dwLength -= dwChars;
+	}
+}
+#endif
+
+
+/*
+ * Writes text to a handle. The console takes UTF-16 as it is, files
+ * and pipes get the ANSI code page.
+ */
+
+static VOID WriteText (HANDLE hOutput, BOOL bConsole, LPCTSTR lpText, DWORD dwLength)
+{
+	DWORD dwWritten;
+#ifdef _UNICODE
+	DWORD dwSize;
+	PCHAR pNew;
+	INT   nBytes;
+
+	if (bConsole)
+	{
+		WriteConsoleW (hOutput, lpText, dwLength, &dwWritten, NULL);
+		return;
+	}
+
+	if (GetCurrentThreadId () != dwMainThreadId)
+	{
+		WriteChunked (hOutput, lpText, dwLength);
+		return;
+	}
+
+	/* no code page takes more than 3 bytes for a UTF-16 unit */
+	dwSize = dwLength * 3;
+	if (dwSize > dwScratchSize)
+	{
+		pNew = (PCHAR)realloc (pScratch, dwSize);
+		if (pNew == NULL)
+		{
+			WriteChunked (hOutput, lpText, dwLength);
+			return;
+		}
+		pScratch = pNew;
+		dwScratchSize = dwSize;
+	}
+
+	nBytes = WideCharToMultiByte (CP_ACP, 0, lpText, dwLength,
+	                              pScratch, dwScratchSize, NULL, NULL);
+	WriteFile (hOutput, pScratch, nBytes, &dwWritten, NULL);
+#else
+	WriteFile (hOutput, lpText, dwLength, &dwWritten, NULL);
+#endif
+}
+
+
+VOID ConOutFlush (VOID)
+{
+	if (dwOutBuffered == 0 || GetCurrentThreadId () != dwMainThreadId)
+		return;
+
+	WriteText (hOutBuffered, bOutConsole, OutBuffer, dwOutBuffered);
+	dwOutBuffered = 0;
+
+	/* the handle may be closed and its value used again */
+	hOutBuffered = INVALID_HANDLE_VALUE;
+}
+
+
+static VOID ConWrite (DWORD nStdHandle, LPCTSTR lpText, DWORD dwLength)
+{
+	HANDLE hOutput = ConGetStdHandle (nStdHandle);
+
+	if (GetCurrentThreadId () != dwMainThreadId)
+	{
+		WriteText (hOutput, IsConsoleHandle (hOutput), lpText, dwLength);
+		return;
+	}
+
+	/* stdout and stderr may go to the same place, keep them in order */
+	if (hOutput != hOutBuffered || dwOutBuffered + dwLength > OUTPUT_BUFFER_SIZE)
+		ConOutFlush ();
+
+	if (hOutput != hOutBuffered)
+	{
+		hOutBuffered = hOutput;
+		bOutConsole = IsConsoleHandle (hOutput);
+	}
+
+	if (dwLength >= OUTPUT_BUFFER_SIZE)
+	{
+		WriteText (hOutput, bOutConsole, lpText, dwLength);
+		return;
+	}
+
+	memcpy (OutBuffer + dwOutBuffered, lpText, dwLength * sizeof (TCHAR));
+	dwOutBuffered += dwLength;
+}
+
+
+/*
+ * Gets the next character of the standard input in headless mode.
+ * Returns FALSE at the end of the input.
+ */
+
+static BOOL ConInByte (PCHAR pc)
+{
+	HANDLE hInput = GetStdHandle (STD_INPUT_HANDLE);
+
+	if (hInput != hInBuffered)
+	{
+		/* input was redirected, what was read ahead belongs elsewhere */
+		hInBuffered = hInput;
+		dwInPos = dwInLength = 0;
+	}
+
+	if (dwInPos == dwInLength)
+	{
+		dwInPos = 0;
+		if (!ReadFile (hInput, InBuffer, INPUT_BUFFER_SIZE, &dwInLength, NULL))
+			dwInLength = 0;
+		if (dwInLength == 0)
+			return FALSE;
+	}
+
+	*pc = InBuffer[dwInPos++];
+	return TRUE;
+}
+
+
+/*
+ * Reads a line of the standard input in headless mode, without the line
+ * end. Longer lines are cut. Returns FALSE at the end of the input.
+ */
+
+BOOL ConInLine (LPTSTR lpInput, DWORD dwLength)
+{
+	PCHAR pBuf;
+	DWORD len = 0;
+	BOOL  bRead = FALSE;
+	CHAR  c;
+
+#ifdef _UNICODE
+	pBuf = (PCHAR)malloc (dwLength);
+	if (pBuf == NULL)
+		return FALSE;
+#else
+	pBuf = lpInput;
+#endif
+
+	ConOutFlush ();
+
+	while (ConInByte (&c))
+	{
+		bRead = TRUE;
+		if (c == '\n')
+			break;
+		if (c != '\r' && len < dwLength - 1)
+			pBuf[len++] = c;
+	}
+	pBuf[len] = '\0';
+
+#ifdef _UNICODE
+	MultiByteToWideChar (CP_ACP, 0, pBuf, len + 1, lpInput, dwLength);
+	free (pBuf);
+#endif
+
+	return bRead;
+}
+
+
+/*
+ * Gives the input read ahead back before a child process is started,
+ * so it can read the rest of the input. Only possible for files.
+ */
+
+VOID ConInRelease (VOID)
+{
+	if (dwInPos < dwInLength &&
+	    hInBuffered == GetStdHandle (STD_INPUT_HANDLE) &&
+	    GetFileType (hInBuffered) == FILE_TYPE_DISK)
+	{
+		SetFilePointer (hInBuffered, -(LONG)(dwInLength - dwInPos), NULL, FILE_CURRENT);
+	}
+
+	dwInPos = dwInLength = 0;
+}
+
+
+/*
+ * Allocates the TLS slot used by ConSetThreadOutput. Must be called by
+ * the main thread before the first worker thread is started.
+ */
+
+BOOL ConInitThreadOutput (VOID)
+{
+	if (dwOutputTls == TLS_OUT_OF_INDEXES)
+		dwOutputTls = TlsAlloc ();
+
+	return (dwOutputTls != TLS_OUT_OF_INDEXES);
+}
+
+
+/*
+ * Redirects the standard output of the calling thread only. Internal
+ * commands running as pipeline stages on worker threads write into
+ * their own pipe, while the process standard output is left alone.
+ */
+
+VOID ConSetThreadOutput (HANDLE hOutput)
+{
+	if (dwOutputTls != TLS_OUT_OF_INDEXES)
+		TlsSetValue (dwOutputTls, (LPVOID)hOutput);
+}
+
+
+/*
+ * GetStdHandle, taking the output of the calling thread into account.
+ */
+
+HANDLE ConGetStdHandle (DWORD nStdHandle)
+{
+	HANDLE hOutput;
+
+	if (nStdHandle == STD_OUTPUT_HANDLE && dwOutputTls != TLS_OUT_OF_INDEXES)
+	{
+		hOutput = (HANDLE)TlsGetValue (dwOutputTls);
+		if (hOutput != NULL)
+			return hOutput;
+	}
+
+	return GetStdHandle (nStdHandle);
+}
 
 
 VOID ConInDisable (VOID)
@@ -28,6 +484,9 @@ VOID ConInDisable (VOID)
 	HANDLE hInput = GetStdHandle (STD_INPUT_HANDLE);
 	DWORD dwMode;
 
+	if (bHeadless)
+		return;
+
 	GetConsoleMode (hInput, &dwMode);
 	dwMode &= ~ENABLE_PROCESSED_INPUT;
 	SetConsoleMode (hInput, dwMode);
@@ -39,17 +498,87 @@ VOID ConInEnable (VOID)
 	HANDLE hInput = GetStdHandle (STD_INPUT_HANDLE);
 	DWORD dwMode;
 
+	if (bHeadless)
+		return;
+
 	GetConsoleMode (hInput, &dwMode);
 	dwMode |= ENABLE_PROCESSED_INPUT;
 	SetConsoleMode (hInput, dwMode);
 }
 
 
+/*
+ * Looks at the console input events waiting, up to INPUT_RECORD_COUNT,
+ * without taking them. With bWait waits for at least one. Returns the
+ * number of events.
+ */
+
+static DWORD ConInPeek (BOOL bWait)
+{
+	HANDLE hInput = GetStdHandle (STD_INPUT_HANDLE);
+
+#ifdef _DEBUG
+	if (hInput == INVALID_HANDLE_VALUE)
+		DebugPrintf (_T("Invalid input handle!!!\n"));
+#endif /* _DEBUG */
+
+	dwInRecord = 0;
+	do
+	{
+		if (bWait)
+			WaitForSingleObject (hInput, INFINITE);
+#ifdef __REACTOS__
+		/* ReadConsoleInputW isn't implwmented within ROS. */
+		if (!PeekConsoleInputA (hInput, InRecords, INPUT_RECORD_COUNT, &dwInRecords))
+			dwInRecords = 0;
+#else
+		if (!PeekConsoleInput (hInput, InRecords, INPUT_RECORD_COUNT, &dwInRecords))
+			dwInRecords = 0;
+#endif
+	}
+	while (bWait && dwInRecords == 0);
+
+	return dwInRecords;
+}
+
+
+/*
+ * Takes the events looked at and used from the console. The others stay
+ * there for whoever reads the console next, a child process for example.
+ */
+
+static VOID ConInRemove (VOID)
+{
+	HANDLE hInput = GetStdHandle (STD_INPUT_HANDLE);
+	DWORD  dwRead;
+
+	if (dwInRecord > 0)
+	{
+#ifdef __REACTOS__
+		ReadConsoleInputA (hInput, InRecords, dwInRecord, &dwRead);
+#else
+		ReadConsoleInput (hInput, InRecords, dwInRecord, &dwRead);
+#endif
+	}
+
+	dwInRecord = dwInRecords = 0;
+}
+
+
 VOID ConInDummy (VOID)
 {
 	HANDLE hInput = GetStdHandle (STD_INPUT_HANDLE);
 	INPUT_RECORD dummy;
 	DWORD  dwRead;
+	CHAR   c;
+
+	ConOutFlush ();
+
+	if (bHeadless)
+	{
+		ConInByte (&c);
+		return;
+	}
 
 #ifdef _DEBUG
 	if (hInput == INVALID_HANDLE_VALUE)
@@ -65,33 +594,101 @@ VOID ConInDummy (VOID)
 
 VOID ConInFlush (VOID)
 {
-	FlushConsoleInputBuffer (GetStdHandle (STD_INPUT_HANDLE));
+	if (!bHeadless)
+		FlushConsoleInputBuffer (GetStdHandle (STD_INPUT_HANDLE));
 }
 
 
 VOID ConInKey (PINPUT_RECORD lpBuffer)
 {
-	HANDLE hInput = GetStdHandle (STD_INPUT_HANDLE);
-	DWORD  dwRead;
+	CHAR   c;
 
-#ifdef _DEBUG
-	if (hInput == INVALID_HANDLE_VALUE)
-		DebugPrintf (_T("Invalid input handle!!!\n"));
-#endif /* _DEBUG */
+	ConOutFlush ();
 
+	if (bHeadless)
+	{
+		/* make up a key press from the next character, the end of
+		 * the input is taken as Enter */
+		if (!ConInByte (&c))
+			c = '\r';
+		memset (lpBuffer, 0, sizeof (INPUT_RECORD));
+		lpBuffer->EventType = KEY_EVENT;
+		lpBuffer->Event.KeyEvent.bKeyDown = TRUE;
+		lpBuffer->Event.KeyEvent.wRepeatCount = 1;
+		lpBuffer->Event.KeyEvent.wVirtualKeyCode =
+			(c == '\r' || c == '\n') ? VK_RETURN : (WORD)_totupper ((BYTE)c);
+		lpBuffer->Event.KeyEvent.uChar.AsciiChar = c;
+		return;
+	}
+
+	/* look at a batch of events, but only take them up to the key */
 	do
 	{
-#ifdef __REACTOS__
-		/* ReadConsoleInputW isn't implwmented within ROS. */
-		ReadConsoleInputA (hInput, lpBuffer, 1, &dwRead);
+		ConInPeek (TRUE);
+		while (dwInRecord < dwInRecords)
+		{
+			*lpBuffer = InRecords[dwInRecord++];
+			if ((lpBuffer->EventType == KEY_EVENT) &&
+				(lpBuffer->Event.KeyEvent.bKeyDown == TRUE))
+			{
+				ConInRemove ();
+				return;
+			}
+		}
+		ConInRemove ();
+	}
+	while (TRUE);
+}
+
+
+/*
+ * Takes up to nMax printable characters typed after the last key read
+ * by ConInKey, as far as they have arrived, and stops at the first other
+ * key, which is left in the console. Returns the number of characters.
+ * Used to insert pasted text at once instead of key by key.
+ */
+
+INT ConInKeyRun (LPTSTR lpBuffer, INT nMax)
+{
+	PINPUT_RECORD lpRecord;
+	BOOL  bStop = FALSE;
+	TCHAR ch;
+	INT   n = 0;
+
+	if (bHeadless)
+		return 0;
+
+	while (!bStop && n < nMax && ConInPeek (FALSE) > 0)
+	{
+		while (n < nMax && dwInRecord < dwInRecords)
+		{
+			lpRecord = &InRecords[dwInRecord];
+			if (lpRecord->EventType == KEY_EVENT &&
+			    lpRecord->Event.KeyEvent.bKeyDown &&
+			    lpRecord->Event.KeyEvent.wVirtualKeyCode != VK_SHIFT)
+			{
+#ifdef _UNICODE
+				ch = lpRecord->Event.KeyEvent.uChar.UnicodeChar;
+				bStop = (ch < 32 || ch > 255);
 #else
-		ReadConsoleInput (hInput, lpBuffer, 1, &dwRead);
+				ch = lpRecord->Event.KeyEvent.uChar.AsciiChar;
+				bStop = ((UCHAR)ch < 32);
 #endif
-		if ((lpBuffer->EventType == KEY_EVENT) &&
-			(lpBuffer->Event.KeyEvent.bKeyDown == TRUE))
-			break;
+				if (bStop)
+					break;
+
+				lpBuffer[n++] = ch;
+			}
+			dwInRecord++;
+		}
+
+		/* a batch used up completely may be followed by more */
+		if (dwInRecord < dwInRecords)
+			bStop = TRUE;
+		ConInRemove ();
 	}
-	while (TRUE);
+
+	return n;
 }
 
 
@@ -106,6 +703,15 @@ VOID ConInString (LPTSTR lpInput, DWORD dwLength)
 	DWORD  i;
 	PCHAR pBuf;
 
+	ConOutFlush ();
+
+	if (bHeadless)
+	{
+		ZeroMemory (lpInput, dwLength * sizeof(TCHAR));
+		ConInLine (lpInput, dwLength);
+		return;
+	}
+
 #ifdef _UNICODE
 	pBuf = (PCHAR)malloc(dwLength);
 #else
@@ -141,23 +747,7 @@ VOID ConInString (LPTSTR lpInput, DWORD dwLength)
 
 static VOID ConChar(TCHAR c, DWORD nStdHandle)
 {
-	DWORD dwWritten;
-	CHAR cc;
-#ifdef _UNICODE
-	CHAR as[2];
-	WCHAR ws[2];
-	ws[0] = c;
-	ws[1] = 0;
-	WideCharToMultiByte(CP_ACP, 0, ws, 2, as, 2, NULL, NULL);
-	cc = as[0];
-#else
-	cc = c;
-#endif
-	WriteFile (GetStdHandle (nStdHandle),
-	           &cc,
-	           1,
-	           &dwWritten,
-	           NULL);
+	ConWrite (nStdHandle, &c, 1);
 }
 
 VOID ConOutChar (TCHAR c)
@@ -165,32 +755,15 @@ VOID ConOutChar (TCHAR c)
 	ConChar(c, STD_OUTPUT_HANDLE);
 }
 
-VOID ConPuts(LPTSTR szText, DWORD nStdHandle)
+VOID ConOutString (LPCTSTR lpText, DWORD dwLength)
 {
-	DWORD dwWritten;
-	PCHAR pBuf;
-	INT len;
+	ConWrite (STD_OUTPUT_HANDLE, lpText, dwLength);
+}
 
-	len = _tcslen(szText);
-#ifdef _UNICODE
-	pBuf = malloc(len + 1);
-	len = WideCharToMultiByte(CP_ACP, 0, szText, len + 1, pBuf, len + 1, NULL, NULL) - 1;
-#else
-	pBuf = szText;
-#endif
-	WriteFile (GetStdHandle (nStdHandle),
-	           pBuf,
-	           len,
-	           &dwWritten,
-	           NULL);
-	WriteFile (GetStdHandle (nStdHandle),
-	           "\n",
-	           1,
-	           &dwWritten,
-	           NULL);
-#ifdef UNICODE
-	free(pBuf);
-#endif
+VOID ConPuts(LPTSTR szText, DWORD nStdHandle)
+{
+	ConWrite (nStdHandle, szText, _tcslen(szText));
+	ConWrite (nStdHandle, _T("\n"), 1);
 }
 
 VOID ConOutPuts (LPTSTR szText)
@@ -202,25 +775,11 @@ VOID ConOutPuts (LPTSTR szText)
 VOID ConPrintf(LPTSTR szFormat, va_list arg_ptr, DWORD nStdHandle)
 {
 	INT len;
-	PCHAR pBuf;
 	TCHAR szOut[OUTPUT_BUFFER_SIZE];
-	DWORD dwWritten;
 
 	len = _vstprintf (szOut, szFormat, arg_ptr);
-#ifdef _UNICODE
-	pBuf = malloc(len + 1);
-	len = WideCharToMultiByte(CP_ACP, 0, szOut, len + 1, pBuf, len + 1, NULL, NULL) - 1;
-#else
-	pBuf = szOut;
-#endif
-	WriteFile (GetStdHandle (nStdHandle),
-	           pBuf,
-	           len,
-	           &dwWritten,
-	           NULL);
-#ifdef UNICODE
-	free(pBuf);
-#endif
+	if (len > 0)
+		ConWrite (nStdHandle, szOut, len);
 }
 
 
@@ -276,20 +835,71 @@ VOID SetCursorXY (SHORT x, SHORT y)
 {
 	COORD coPos;
 
+	if (bHeadless)
+		return;
+
+	if (ConIsVirtualTerminal ())
+	{
+		ConOutPrintf (_T("\x1b[%d;%dH"), y + 1, x + 1);
+		return;
+	}
+
+	ConOutFlush ();
+
 	coPos.X = x;
 	coPos.Y = y;
 	SetConsoleCursorPosition (GetStdHandle (STD_OUTPUT_HANDLE), coPos);
 }
 
 
+/*
+ * Writes characters at a place on the screen, without moving the cursor.
+ * Lines are wrapped but the screen is not scrolled.
+ */
+
+VOID WriteScreenXY (SHORT x, SHORT y, LPCTSTR lpText, DWORD dwLength)
+{
+	COORD coPos;
+	DWORD dwWritten;
+
+	if (bHeadless)
+		return;
+
+	if (ConIsVirtualTerminal ())
+	{
+		/* save the cursor, write there and go back */
+		ConOutPrintf (_T("\x1b" "7\x1b[%d;%dH"), y + 1, x + 1);
+		ConOutString (lpText, dwLength);
+		ConOutString (_T("\x1b" "8"), 2);
+		return;
+	}
+
+	ConOutFlush ();
+
+	coPos.X = x;
+	coPos.Y = y;
+	WriteConsoleOutputCharacter (GetStdHandle (STD_OUTPUT_HANDLE),
+	                             lpText, dwLength, coPos, &dwWritten);
+}
+
+
 VOID GetCursorXY (PSHORT x, PSHORT y)
 {
 	CONSOLE_SCREEN_BUFFER_INFO csbi;
 
-	GetConsoleScreenBufferInfo (hConsole, &csbi);
+	if (bHeadless)
+	{
+		*x = 0;
+		*y = 0;
+		return;
+	}
+
+	GetConsoleScreenBufferInfo (GetScreenHandle (), &csbi);
 
 	*x = csbi.dwCursorPosition.X;
 	*y = csbi.dwCursorPosition.Y;
+	if (ConIsVirtualTerminal ())
+		*y -= csbi.srWindow.Top;
 }
 
 
@@ -297,7 +907,10 @@ SHORT GetCursorX (VOID)
 {
 	CONSOLE_SCREEN_BUFFER_INFO csbi;
 
-	GetConsoleScreenBufferInfo (hConsole, &csbi);
+	if (bHeadless)
+		return 0;
+
+	GetConsoleScreenBufferInfo (GetScreenHandle (), &csbi);
 
 	return csbi.dwCursorPosition.X;
 }
@@ -307,7 +920,13 @@ SHORT GetCursorY (VOID)
 {
 	CONSOLE_SCREEN_BUFFER_INFO csbi;
 
-	GetConsoleScreenBufferInfo (hConsole, &csbi);
+	if (bHeadless)
+		return 0;
+
+	GetConsoleScreenBufferInfo (GetScreenHandle (), &csbi);
+
+	if (ConIsVirtualTerminal ())
+		return csbi.dwCursorPosition.Y - csbi.srWindow.Top;
 
 	return csbi.dwCursorPosition.Y;
 }
@@ -317,7 +936,18 @@ VOID GetScreenSize (PSHORT maxx, PSHORT maxy)
 {
 	CONSOLE_SCREEN_BUFFER_INFO csbi;
 
-	GetConsoleScreenBufferInfo (hConsole, &csbi);
+	if (bHeadless)
+	{
+		/* what output formatting expects of a standard screen */
+		csbi.dwSize.X = 80;
+		csbi.dwSize.Y = 25;
+	}
+	else
+	{
+		GetConsoleScreenBufferInfo (GetScreenHandle (), &csbi);
+		if (ConIsVirtualTerminal ())
+			csbi.dwSize.Y = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+	}
 
 	if (maxx)
 		*maxx = csbi.dwSize.X;
@@ -330,6 +960,19 @@ VOID SetCursorType (BOOL bInsert, BOOL bVisible)
 {
 	CONSOLE_CURSOR_INFO cci;
 
+	if (bHeadless)
+		return;
+
+	if (ConIsVirtualTerminal ())
+	{
+		/* underline in insert mode, else a block */
+		ConOutPrintf (_T("\x1b[%d q\x1b[?25%c"), bInsert ? 3 : 1,
+		              bVisible ? _T('h') : _T('l'));
+		return;
+	}
+
+	ConOutFlush ();
+
 	cci.dwSize = bInsert ? 10 : 99;
 	cci.bVisible = bVisible;
 
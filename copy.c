@@ -580,7 +580,7 @@ SetupCopy (LPFILES sources, TCHAR **p, BOOL bMultiple,
 			_tmakepath (real_source, drive_s, dir_s, find.cFileName, NULL);
 
 #ifdef _DEBUG
-			DebugPrintf(_T("copying %S -> %S (%Sappending%S)\n"),
+			DebugPrintf(_T("copying %s -> %s (%sappending%s)\n"),
 						 real_source, real_dest,
 						 *append ? _T("") : _T("not "),
 						 sources->dwFlag & ASCII ? _T(", ASCII") : _T(", BINARY"));
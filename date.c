@@ -191,6 +191,8 @@ INT cmd_date (LPTSTR cmd, LPTSTR param)
 	BOOL   bPrompt = TRUE;
 	INT    nDateString = -1;
 
+	LoadLocale ();
+
 	if (!_tcsncmp (param, _T("/?"), 2))
 	{
 		ConOutPuts (_T("Displays or sets the date.\n\n"
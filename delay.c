@@ -50,6 +50,7 @@ INT CommandDelay (LPTSTR cmd, LPTSTR param)
 	}
 
 	val = _ttoi(param);
+	ConOutFlush ();
 	Sleep(val*mul);
 
 	return 0;
@@ -522,9 +522,13 @@ IncLine (LPINT pLine, DWORD dwFlags)
 	BOOL error;
 	CONSOLE_SCREEN_BUFFER_INFO lpConsoleScreenBufferInfo;
 	LONG WindowHeight;
-	error = GetConsoleScreenBufferInfo(hConsole, &lpConsoleScreenBufferInfo);
-	
-	WindowHeight= lpConsoleScreenBufferInfo.srWindow.Bottom - lpConsoleScreenBufferInfo.srWindow.Top;
+	WindowHeight = 0;
+	if (!bHeadless)
+	{
+		error = GetConsoleScreenBufferInfo(GetScreenHandle (), &lpConsoleScreenBufferInfo);
+
+		WindowHeight= lpConsoleScreenBufferInfo.srWindow.Bottom - lpConsoleScreenBufferInfo.srWindow.Top;
+	}
 
 	if (!WindowHeight)  //That prevents bad behave if WindowHeight couln't calc
 	{
@@ -1257,6 +1261,8 @@ INT CommandDir (LPTSTR first, LPTSTR rest)
 	INT    nLine = 0;
 
 
+	LoadLocale ();
+
 	recurse_dir_cnt = 0L;
 	recurse_file_cnt = 0L;
 	recurse_bytes.QuadPart = 0;
@@ -0,0 +1,1077 @@
+/*
+ *  ENV.C - environment variables and their expansion.
+ *
+ *
+ *  History:
+ *
+ *    17-Oct-2026
+ *        Started.
+ *
+ *  The shell keeps its own copy of the environment in a hash table, so
+ *  looking up a variable doesn't need a call into the system. All changes
+ *  made by the shell go through SetEnvVar, which updates both the process
+ *  environment (inherited by child processes) and the table.
+ *
+ *  SETLOCAL opens a scope, which only costs a small record. The first
+ *  change of a variable inside a scope saves its previous value in the
+ *  undo log of the scope, and ENDLOCAL puts back the saved values. So
+ *  scopes never copy the environment, however deeply they are nested.
+ */
+
+#include "config.h"
+
+#include <windows.h>
+#include <tchar.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "cmd.h"
+#include "batch.h"
+
+
+/* number of hash chains, a power of two */
+#define ENV_HASH_SIZE  256
+
+/* initial size of the expansion buffer */
+#define EXPAND_BUFFER_SIZE  CMDLINE_LENGTH
+
+
+typedef struct tagENVVAR
+{
+	struct tagENVVAR *next;
+	LPTSTR lpValue;      /* NULL if the variable was removed while its
+	                        old value is saved by a scope */
+	UINT   nScope;       /* scope holding the saved value, 0 if none */
+	TCHAR  szName[1];    /* variable length */
+} ENVVAR, *LPENVVAR;
+
+/* value of a variable as it was before the first change in a scope */
+typedef struct tagENVUNDO
+{
+	struct tagENVUNDO *next;
+	LPTSTR lpValue;      /* NULL if the variable wasn't set */
+	UINT   nScope;       /* previous nScope of the variable */
+	TCHAR  szName[1];    /* variable length */
+} ENVUNDO, *LPENVUNDO;
+
+typedef struct tagENVSCOPE
+{
+	struct tagENVSCOPE *prev;
+	LPENVUNDO lpUndo;
+	UINT   nId;          /* never reused, so stale marks don't match */
+	BOOL   bDelayed;     /* delayed expansion enabled in the scope */
+} ENVSCOPE, *LPENVSCOPE;
+
+
+static LPENVVAR lpEnvHash[ENV_HASH_SIZE];
+static BOOL bEnvLoaded = FALSE;
+
+static LPENVSCOPE lpScope = NULL;  /* innermost scope */
+static INT  nScopeDepth = 0;
+static UINT nNextScopeId = 1;
+static BOOL bDelayedDefault = FALSE;  /* delayed expansion outside scopes */
+
+
+/*
+ * Names are compared without regard to case, as by the system.
+ */
+
+static UINT HashEnvName (LPCTSTR lpName, INT len)
+{
+	UINT h = 0;
+
+	while (len-- > 0)
+		h = h * 31 + (UINT)_totupper (*lpName++);
+
+	return h & (ENV_HASH_SIZE - 1);
+}
+
+
+/*
+ * Returns the link pointing to the variable, or to the NULL at the end
+ * of its hash chain if there is no such variable.
+ */
+
+static LPENVVAR *FindEnvLink (LPCTSTR lpName, INT len)
+{
+	LPENVVAR *lpLink = &lpEnvHash[HashEnvName (lpName, len)];
+
+	while (*lpLink != NULL)
+	{
+		if (!_tcsnicmp ((*lpLink)->szName, lpName, len) &&
+		    (*lpLink)->szName[len] == _T('\0'))
+			break;
+		lpLink = &(*lpLink)->next;
+	}
+
+	return lpLink;
+}
+
+
+/*
+ * Stores a variable in the table only. A NULL value removes it.
+ */
+
+static BOOL StoreEnvVar (LPCTSTR lpName, INT len, LPCTSTR lpValue)
+{
+	LPENVVAR *lpLink = FindEnvLink (lpName, len);
+	LPENVVAR lpVar = *lpLink;
+	LPTSTR lpNewValue;
+
+	if (lpValue == NULL)
+	{
+		if (lpVar != NULL)
+		{
+			free (lpVar->lpValue);
+			lpVar->lpValue = NULL;
+
+			/* the entry still carries the scope mark */
+			if (lpVar->nScope == 0)
+			{
+				*lpLink = lpVar->next;
+				free (lpVar);
+			}
+		}
+		return TRUE;
+	}
+
+	lpNewValue = (LPTSTR)malloc ((_tcslen (lpValue) + 1) * sizeof (TCHAR));
+	if (lpNewValue == NULL)
+		return FALSE;
+	_tcscpy (lpNewValue, lpValue);
+
+	if (lpVar == NULL)
+	{
+		lpVar = (LPENVVAR)malloc (sizeof (ENVVAR) + len * sizeof (TCHAR));
+		if (lpVar == NULL)
+		{
+			free (lpNewValue);
+			return FALSE;
+		}
+		_tcsncpy (lpVar->szName, lpName, len);
+		lpVar->szName[len] = _T('\0');
+		lpVar->lpValue = NULL;
+		lpVar->nScope = 0;
+		lpVar->next = NULL;
+		*lpLink = lpVar;
+	}
+
+	free (lpVar->lpValue);
+	lpVar->lpValue = lpNewValue;
+
+	return TRUE;
+}
+
+
+/*
+ * Fills the table from the process environment.
+ */
+
+static VOID LoadEnvironment (VOID)
+{
+	LPTSTR lpEnv;
+	LPTSTR p;
+	LPTSTR q;
+
+	bEnvLoaded = TRUE;
+
+	lpEnv = (LPTSTR)GetEnvironmentStrings ();
+	if (lpEnv == NULL)
+		return;
+
+	for (p = lpEnv; *p; p += _tcslen (p) + 1)
+	{
+		/* names of the per drive directories start with '=' */
+		q = _tcschr (p + 1, _T('='));
+		if (q != NULL)
+			StoreEnvVar (p, q - p, q + 1);
+	}
+
+	FreeEnvironmentStrings (lpEnv);
+}
+
+
+/*
+ * Returns the value of an environment variable, or NULL if it isn't
+ * set. The value stays valid until the variable is changed.
+ */
+
+LPCTSTR GetEnvVar (LPCTSTR lpName)
+{
+	LPENVVAR lpVar;
+
+	if (!bEnvLoaded)
+		LoadEnvironment ();
+
+	lpVar = *FindEnvLink (lpName, _tcslen (lpName));
+
+	return lpVar ? lpVar->lpValue : NULL;
+}
+
+
+/*
+ * Saves the current value of a variable in the undo log of the
+ * innermost scope, unless it was saved there already.
+ */
+
+static BOOL SaveEnvVar (LPCTSTR lpName)
+{
+	INT len = _tcslen (lpName);
+	LPENVVAR *lpLink = FindEnvLink (lpName, len);
+	LPENVVAR lpVar = *lpLink;
+	LPENVUNDO lpUndo;
+
+	if (lpVar != NULL && lpVar->nScope == lpScope->nId)
+		return TRUE;
+
+	lpUndo = (LPENVUNDO)malloc (sizeof (ENVUNDO) + len * sizeof (TCHAR));
+	if (lpUndo == NULL)
+		return FALSE;
+	_tcscpy (lpUndo->szName, lpName);
+	lpUndo->lpValue = NULL;
+	lpUndo->nScope = 0;
+
+	if (lpVar == NULL)
+	{
+		/* an empty entry, just to hold the scope mark */
+		lpVar = (LPENVVAR)malloc (sizeof (ENVVAR) + len * sizeof (TCHAR));
+		if (lpVar == NULL)
+		{
+			free (lpUndo);
+			return FALSE;
+		}
+		_tcscpy (lpVar->szName, lpName);
+		lpVar->lpValue = NULL;
+		lpVar->next = NULL;
+		*lpLink = lpVar;
+	}
+	else
+	{
+		if (lpVar->lpValue != NULL)
+		{
+			lpUndo->lpValue = (LPTSTR)malloc ((_tcslen (lpVar->lpValue) + 1) * sizeof (TCHAR));
+			if (lpUndo->lpValue == NULL)
+			{
+				free (lpUndo);
+				return FALSE;
+			}
+			_tcscpy (lpUndo->lpValue, lpVar->lpValue);
+		}
+		lpUndo->nScope = lpVar->nScope;
+	}
+
+	lpVar->nScope = lpScope->nId;
+	lpUndo->next = lpScope->lpUndo;
+	lpScope->lpUndo = lpUndo;
+
+	return TRUE;
+}
+
+
+/*
+ * Sets or (with a NULL value) removes an environment variable.
+ */
+
+BOOL SetEnvVar (LPCTSTR lpName, LPCTSTR lpValue)
+{
+	if (!bEnvLoaded)
+		LoadEnvironment ();
+
+	if (lpScope != NULL && !SaveEnvVar (lpName))
+	{
+		error_out_of_memory ();
+		return FALSE;
+	}
+
+	if (!SetEnvironmentVariable (lpName, lpValue))
+		return FALSE;
+
+	if (!StoreEnvVar (lpName, _tcslen (lpName), lpValue))
+	{
+		/* keep the table in step with the process environment */
+		StoreEnvVar (lpName, _tcslen (lpName), NULL);
+		SetEnvironmentVariable (lpName, NULL);
+		error_out_of_memory ();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+/*
+ * Opens a new innermost scope (SETLOCAL).
+ */
+
+BOOL EnterEnvScope (VOID)
+{
+	LPENVSCOPE lpNew = (LPENVSCOPE)malloc (sizeof (ENVSCOPE));
+
+	if (lpNew == NULL)
+	{
+		error_out_of_memory ();
+		return FALSE;
+	}
+
+	lpNew->prev = lpScope;
+	lpNew->lpUndo = NULL;
+	lpNew->nId = nNextScopeId++;
+	lpNew->bDelayed = GetDelayedExpansion ();
+	lpScope = lpNew;
+	nScopeDepth++;
+
+	return TRUE;
+}
+
+
+/*
+ * Closes the innermost scope (ENDLOCAL), putting back the variables
+ * changed in it. Returns FALSE if there is no open scope.
+ */
+
+BOOL LeaveEnvScope (VOID)
+{
+	LPENVSCOPE lpOld = lpScope;
+	LPENVUNDO lpUndo;
+	LPENVVAR *lpLink;
+	LPENVVAR lpVar;
+
+	if (lpOld == NULL)
+		return FALSE;
+
+	while ((lpUndo = lpOld->lpUndo) != NULL)
+	{
+		lpOld->lpUndo = lpUndo->next;
+
+		SetEnvironmentVariable (lpUndo->szName, lpUndo->lpValue);
+
+		lpLink = FindEnvLink (lpUndo->szName, _tcslen (lpUndo->szName));
+		lpVar = *lpLink;
+		if (lpVar != NULL)
+		{
+			/* the saved value goes back into the entry as it is */
+			free (lpVar->lpValue);
+			lpVar->lpValue = lpUndo->lpValue;
+			lpVar->nScope = lpUndo->nScope;
+			if (lpVar->lpValue == NULL && lpVar->nScope == 0)
+			{
+				*lpLink = lpVar->next;
+				free (lpVar);
+			}
+		}
+		else
+		{
+			/* the table was reloaded since */
+			StoreEnvVar (lpUndo->szName, _tcslen (lpUndo->szName), lpUndo->lpValue);
+			free (lpUndo->lpValue);
+		}
+
+		free (lpUndo);
+	}
+
+	lpScope = lpOld->prev;
+	nScopeDepth--;
+	free (lpOld);
+
+	return TRUE;
+}
+
+
+/*
+ * Closes scopes until nDepth of them are left open.
+ */
+
+VOID LeaveEnvScopes (INT nDepth)
+{
+	while (nScopeDepth > nDepth && LeaveEnvScope ())
+		;
+}
+
+
+/*
+ * Returns the number of open scopes.
+ */
+
+INT GetEnvScopeDepth (VOID)
+{
+	return nScopeDepth;
+}
+
+
+/*
+ * Delayed expansion is a setting of the innermost scope, so ENDLOCAL
+ * puts it back along with the variables.
+ */
+
+BOOL GetDelayedExpansion (VOID)
+{
+	return lpScope ? lpScope->bDelayed : bDelayedDefault;
+}
+
+
+VOID SetDelayedExpansion (BOOL bEnable)
+{
+	if (lpScope != NULL)
+		lpScope->bDelayed = bEnable;
+	else
+		bDelayedDefault = bEnable;
+}
+
+
+/*
+ * Sets or removes the variable of an entry of an environment block.
+ */
+
+static VOID SetBlockEntry (LPCTSTR lpEntry, BOOL bRemove)
+{
+	LPCTSTR q = _tcschr (lpEntry + 1, _T('='));
+	LPTSTR lpName;
+
+	if (q == NULL)
+		return;
+
+	lpName = (LPTSTR)malloc ((q - lpEntry + 1) * sizeof (TCHAR));
+	if (lpName == NULL)
+		return;
+	_tcsncpy (lpName, lpEntry, q - lpEntry);
+	lpName[q - lpEntry] = _T('\0');
+
+	SetEnvironmentVariable (lpName, bRemove ? NULL : q + 1);
+
+	free (lpName);
+}
+
+
+/*
+ * Replaces the whole environment by the variables of lpBlock, which is
+ * laid out like the block returned by GetEnvironmentStrings.
+ */
+
+VOID SetEnvironmentBlock (LPCTSTR lpBlock)
+{
+	LPENVVAR lpVar;
+	LPTSTR lpEnv;
+	LPCTSTR p;
+	INT i;
+
+	/* the new block replaces whatever the scopes would put back */
+	LeaveEnvScopes (0);
+
+	lpEnv = (LPTSTR)GetEnvironmentStrings ();
+	if (lpEnv != NULL)
+	{
+		for (p = lpEnv; *p; p += _tcslen (p) + 1)
+			SetBlockEntry (p, TRUE);
+		FreeEnvironmentStrings (lpEnv);
+	}
+
+	for (p = lpBlock; *p; p += _tcslen (p) + 1)
+		SetBlockEntry (p, FALSE);
+
+	/* the table is filled again on the next use */
+	for (i = 0; i < ENV_HASH_SIZE; i++)
+	{
+		while ((lpVar = lpEnvHash[i]) != NULL)
+		{
+			lpEnvHash[i] = lpVar->next;
+			free (lpVar->lpValue);
+			free (lpVar);
+		}
+	}
+	bEnvLoaded = FALSE;
+}
+
+
+/*
+ * Makes room for len more characters (plus the terminator) at position
+ * nPos of the expansion buffer.
+ */
+
+static BOOL GrowBuffer (LPTSTR *lplpBuffer, LPINT lpnSize, INT nPos, INT len)
+{
+	LPTSTR lpNew;
+	INT nSize = *lpnSize;
+
+	if (nPos + len < nSize)
+		return TRUE;
+
+	if (nSize < EXPAND_BUFFER_SIZE)
+		nSize = EXPAND_BUFFER_SIZE;
+	while (nPos + len >= nSize)
+		nSize *= 2;
+
+	lpNew = (LPTSTR)realloc (*lplpBuffer, nSize * sizeof (TCHAR));
+	if (lpNew == NULL)
+		return FALSE;
+
+	*lplpBuffer = lpNew;
+	*lpnSize = nSize;
+
+	return TRUE;
+}
+
+
+static BOOL AppendText (LPTSTR *lplpBuffer, LPINT lpnSize, LPINT lpnPos,
+                        LPCTSTR lpText, INT len)
+{
+	if (!GrowBuffer (lplpBuffer, lpnSize, *lpnPos, len))
+		return FALSE;
+
+	memcpy (*lplpBuffer + *lpnPos, lpText, len * sizeof (TCHAR));
+	*lpnPos += len;
+
+	return TRUE;
+}
+
+
+/*
+ * Returns the value of the variable named by the len characters at
+ * lpName, or NULL if it is not set. Values which are computed are
+ * written to szValue, which holds 32 characters.
+ */
+
+static LPCTSTR LookupVariable (LPCTSTR lpName, INT len, LPTSTR szValue)
+{
+	LPENVVAR lpVar;
+
+	lpVar = *FindEnvLink (lpName, len);
+	if (lpVar != NULL && lpVar->lpValue != NULL)
+		return lpVar->lpValue;
+
+#ifdef FEATURE_TELEMETRY
+	if (len < CMDLINE_LENGTH)
+	{
+		TCHAR szName[CMDLINE_LENGTH];
+
+		_tcsncpy (szName, lpName, len);
+		szName[len] = _T('\0');
+		if (GetTelemetryVariable (szName, szValue, 32))
+			return szValue;
+	}
+#endif
+
+	return NULL;
+}
+
+
+/*
+ * Expands the references in a command line in a single pass:
+ *
+ *   %%       a single %
+ *   %0..%9   batch parameters
+ *   %*       all batch parameters but %0, regardless of SHIFT
+ *   %?       the errorlevel
+ *   %NAME%   environment and dynamic variables, the name ends at the
+ *            next %. Undefined variables expand to nothing, or are kept
+ *            as written if bKeepUndefined is set, as on a line typed at
+ *            the prompt. A % without a closing one is copied as is.
+ *
+ * Control characters are replaced by spaces. The result is written to
+ * *lplpBuffer, which is owned by the caller and grown as needed, so it
+ * can be reused for the next line. Returns FALSE if out of memory.
+ */
+
+BOOL ExpandVariables (LPCTSTR lpLine, LPTSTR *lplpBuffer, LPINT lpnSize,
+                      BOOL bKeepUndefined)
+{
+	LPCTSTR ip = lpLine;
+	LPCTSTR tp;
+	LPCTSTR lpValue;
+	LPBATCH_CONTEXT b;
+	TCHAR szValue[32];
+	INT nPos = 0;
+	INT n;
+
+	if (!bEnvLoaded)
+		LoadEnvironment ();
+
+	while (*ip)
+	{
+		/* copy the text up to the next reference in one go */
+		tp = ip;
+		while (*tp && *tp != _T('%') && !_istcntrl (*tp))
+			tp++;
+		if (tp > ip)
+		{
+			if (!AppendText (lplpBuffer, lpnSize, &nPos, ip, tp - ip))
+				return FALSE;
+			ip = tp;
+			continue;
+		}
+
+		if (*ip != _T('%'))
+		{
+			if (!AppendText (lplpBuffer, lpnSize, &nPos, _T(" "), 1))
+				return FALSE;
+			ip++;
+			continue;
+		}
+
+		lpValue = NULL;
+
+		switch (*++ip)
+		{
+			case _T('%'):
+				lpValue = _T("%");
+				ip++;
+				break;
+
+			case _T('0'):
+			case _T('1'):
+			case _T('2'):
+			case _T('3'):
+			case _T('4'):
+			case _T('5'):
+			case _T('6'):
+			case _T('7'):
+			case _T('8'):
+			case _T('9'):
+				if ((lpValue = FindArg (*ip - _T('0'))))
+					ip++;
+				else
+					lpValue = _T("%");
+				break;
+
+			case _T('*'):
+				/* the parameters of the batch file, not of a FOR */
+				if ((b = GetBatchFileContext ()) == NULL || b->params == NULL)
+				{
+					lpValue = _T("%");
+					break;
+				}
+				for (n = 1; n < b->params->nArgs; n++)
+				{
+					if ((n > 1 && !AppendText (lplpBuffer, lpnSize, &nPos, _T(" "), 1)) ||
+					    !AppendText (lplpBuffer, lpnSize, &nPos, b->params->lpArgs[n],
+					                 _tcslen (b->params->lpArgs[n])))
+						return FALSE;
+				}
+				ip++;
+				break;
+
+			case _T('?'):
+				_stprintf (szValue, _T("%u"), nErrorLevel);
+				lpValue = szValue;
+				ip++;
+				break;
+
+			default:
+				tp = _tcschr (ip, _T('%'));
+				if (tp == NULL || tp == ip)
+				{
+					lpValue = _T("%");
+					break;
+				}
+
+				lpValue = LookupVariable (ip, tp - ip, szValue);
+				if (lpValue == NULL && bKeepUndefined)
+				{
+					/* "%f in (a b) do echo %" is no variable */
+					if (!AppendText (lplpBuffer, lpnSize, &nPos, ip - 1, tp - ip + 2))
+						return FALSE;
+				}
+				ip = tp + 1;
+				break;
+		}
+
+		if (lpValue != NULL &&
+		    !AppendText (lplpBuffer, lpnSize, &nPos, lpValue, _tcslen (lpValue)))
+			return FALSE;
+	}
+
+	if (!GrowBuffer (lplpBuffer, lpnSize, nPos, 0))
+		return FALSE;
+	(*lplpBuffer)[nPos] = _T('\0');
+
+	return TRUE;
+}
+
+#ifdef FEATURE_REDIRECTION
+static VOID AddReference (LPVARIABLE_LINE lpSplit, INT nStart, INT nLength,
+                          INT nType, INT nFlags)
+{
+	LPVARIABLE_SEGMENT lpSeg;
+
+	if (nLength == 0 && nType == VARIABLE_TEXT)
+		return;
+
+	lpSeg = &lpSplit->Segments[lpSplit->nSegments++];
+	lpSeg->nStart = nStart;
+	lpSeg->nLength = nLength;
+	lpSeg->nType = nType;
+	lpSeg->nFlags = nFlags;
+	if (nType != VARIABLE_TEXT)
+		lpSplit->nReferences++;
+}
+
+
+/*
+ * Splits nLength characters of a parsed line into literal text and the
+ * references ExpandVariables would replace, reading them exactly the
+ * way it does. lpLine holds nStages NUL terminated stages followed by
+ * the file names of the redirections, a name ends in the stage or file
+ * name it starts in. Control characters other than the NULs must have
+ * been replaced by spaces. Returns NULL if out of memory.
+ */
+
+LPVARIABLE_LINE SplitVariables (LPCTSTR lpLine, INT nLength, INT nStages)
+{
+	LPVARIABLE_LINE lpSplit;
+	INT nMax = 1;
+	INT nStart = 0;
+	INT nPart = 0;
+	INT nFlags;
+	INT nType;
+	INT nEnd;
+	INT i;
+
+	/* every '%' ends at most two segments */
+	for (i = 0; i < nLength; i++)
+	{
+		if (lpLine[i] == _T('%'))
+			nMax += 2;
+	}
+
+	lpSplit = (LPVARIABLE_LINE)malloc (sizeof (VARIABLE_LINE) +
+	                                   (nMax - 1) * sizeof (VARIABLE_SEGMENT));
+	if (lpSplit == NULL)
+		return NULL;
+	lpSplit->nReferences = 0;
+	lpSplit->nSegments = 0;
+
+	i = 0;
+	while (i < nLength)
+	{
+		if (lpLine[i] != _T('%'))
+		{
+			if (lpLine[i] == _T('\0'))
+				nPart++;
+			i++;
+			continue;
+		}
+
+		nEnd = i + 2;
+		switch (i + 1 < nLength ? lpLine[i + 1] : _T('\0'))
+		{
+			case _T('%'):
+				/* the first '%' is kept as text */
+				AddReference (lpSplit, nStart, i + 1 - nStart, VARIABLE_TEXT, 0);
+				i = nStart = nEnd;
+				continue;
+
+			case _T('0'):
+			case _T('1'):
+			case _T('2'):
+			case _T('3'):
+			case _T('4'):
+			case _T('5'):
+			case _T('6'):
+			case _T('7'):
+			case _T('8'):
+			case _T('9'):
+				nType = VARIABLE_PARAM;
+				break;
+
+			case _T('*'):
+				nType = VARIABLE_ALLPARAMS;
+				break;
+
+			case _T('?'):
+				nType = VARIABLE_ERRORLEVEL;
+				break;
+
+			default:
+				for (nEnd = i + 1; nEnd < nLength; nEnd++)
+				{
+					if (lpLine[nEnd] == _T('%') || lpLine[nEnd] == _T('\0'))
+						break;
+				}
+				if (nEnd == nLength || lpLine[nEnd] != _T('%'))
+				{
+					/* no closing '%', it is copied as is */
+					i++;
+					continue;
+				}
+				nType = VARIABLE_NAME;
+				nEnd++;
+				break;
+		}
+
+		nFlags = 0;
+		if (nPart >= nStages)
+			nFlags |= VARIABLE_FILENAME;
+		else if (nPart == nStages - 1 && nEnd < nLength && lpLine[nEnd] == _T('\0'))
+			nFlags |= VARIABLE_TRAILING;
+
+		AddReference (lpSplit, nStart, i - nStart, VARIABLE_TEXT, 0);
+		if (nType == VARIABLE_NAME)
+			AddReference (lpSplit, i + 1, nEnd - i - 2, nType, nFlags);
+		else
+			AddReference (lpSplit, i + 1, 1, nType, nFlags);
+		i = nStart = nEnd;
+	}
+
+	AddReference (lpSplit, nStart, nLength - nStart, VARIABLE_TEXT, 0);
+
+	return lpSplit;
+}
+
+
+/*
+ * Checks that a value put into a parsed line leaves it as it would
+ * have been parsed with the value in it: no character GetRedirection
+ * acts on, no white space in a file name, and nothing the stripping of
+ * trailing white space would have taken off the line.
+ */
+
+static BOOL IsPlainValue (LPCTSTR lpValue, INT len, INT nFlags)
+{
+	INT i;
+
+	if ((nFlags & VARIABLE_TRAILING) && (len == 0 || _istspace (lpValue[len - 1])))
+		return FALSE;
+
+	for (i = 0; i < len; i++)
+	{
+		if (lpValue[i] == _T('<') || lpValue[i] == _T('>') ||
+		    lpValue[i] == _T('|') || lpValue[i] == _T('&') ||
+		    lpValue[i] == _T('"') || lpValue[i] == _T('\'') ||
+		    ((nFlags & VARIABLE_FILENAME) && _istspace (lpValue[i])))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+/*
+ * Builds the text of a split line with the current values of its
+ * references, the same text ExpandVariables gives for each stage and
+ * file name. The result is written to *lplpBuffer, which is grown as
+ * needed.
+ *
+ * Returns the number of characters written, NULs included,
+ * EXPAND_OUT_OF_MEMORY, or EXPAND_REPARSE if a value would change how
+ * the line is parsed.
+ */
+
+INT ExpandVariableLine (LPCTSTR lpLine, LPVARIABLE_LINE lpSplit,
+                        LPTSTR *lplpBuffer, LPINT lpnSize)
+{
+	LPVARIABLE_SEGMENT lpSeg;
+	LPCTSTR lpValue;
+	LPBATCH_CONTEXT b;
+	TCHAR szValue[32];
+	INT nPos = 0;
+	INT nValue;
+	INT i;
+	INT n;
+
+	if (!bEnvLoaded)
+		LoadEnvironment ();
+
+	for (i = 0, lpSeg = lpSplit->Segments; i < lpSplit->nSegments; i++, lpSeg++)
+	{
+		nValue = nPos;
+		lpValue = NULL;
+
+		switch (lpSeg->nType)
+		{
+			case VARIABLE_TEXT:
+				if (!AppendText (lplpBuffer, lpnSize, &nPos,
+				                 lpLine + lpSeg->nStart, lpSeg->nLength))
+					return EXPAND_OUT_OF_MEMORY;
+				continue;
+
+			case VARIABLE_NAME:
+				lpValue = LookupVariable (lpLine + lpSeg->nStart, lpSeg->nLength, szValue);
+				break;
+
+			case VARIABLE_PARAM:
+				/* a missing parameter is kept as written */
+				lpValue = FindArg (lpLine[lpSeg->nStart] - _T('0'));
+				if (lpValue == NULL &&
+				    !AppendText (lplpBuffer, lpnSize, &nPos, lpLine + lpSeg->nStart - 1, 2))
+					return EXPAND_OUT_OF_MEMORY;
+				break;
+
+			case VARIABLE_ALLPARAMS:
+				if ((b = GetBatchFileContext ()) == NULL || b->params == NULL)
+				{
+					lpValue = _T("%*");
+					break;
+				}
+				for (n = 1; n < b->params->nArgs; n++)
+				{
+					if ((n > 1 && !AppendText (lplpBuffer, lpnSize, &nPos, _T(" "), 1)) ||
+					    !AppendText (lplpBuffer, lpnSize, &nPos, b->params->lpArgs[n],
+					                 _tcslen (b->params->lpArgs[n])))
+						return EXPAND_OUT_OF_MEMORY;
+				}
+				break;
+
+			case VARIABLE_ERRORLEVEL:
+				_stprintf (szValue, _T("%u"), nErrorLevel);
+				lpValue = szValue;
+				break;
+		}
+
+		if (lpValue != NULL &&
+		    !AppendText (lplpBuffer, lpnSize, &nPos, lpValue, _tcslen (lpValue)))
+			return EXPAND_OUT_OF_MEMORY;
+
+		if (!IsPlainValue (*lplpBuffer + nValue, nPos - nValue, lpSeg->nFlags))
+			return EXPAND_REPARSE;
+	}
+
+	return nPos;
+}
+#endif /* FEATURE_REDIRECTION */
+
+#ifdef FEATURE_DELAYED_EXPANSION
+static VOID AddSegment (LPDELAYED_LINE lpSplit, INT nStart, INT nLength, BOOL bVariable)
+{
+	LPDELAYED_SEGMENT lpSeg;
+
+	if (nLength == 0 && !bVariable)
+		return;
+
+	lpSeg = &lpSplit->Segments[lpSplit->nSegments++];
+	lpSeg->nStart = nStart;
+	lpSeg->nLength = nLength;
+	lpSeg->bVariable = bVariable;
+	if (bVariable)
+		lpSplit->nVariables++;
+}
+
+
+/*
+ * Splits nLength characters of lpLine, which may hold several NUL
+ * terminated stages, into literal text and !VAR! references. "^!" is
+ * a literal '!', and a '!' without a closing one in the same stage is
+ * kept as it is. Only the first nExpand characters are looked at, the
+ * rest is literal. Returns NULL if out of memory.
+ */
+
+LPDELAYED_LINE SplitDelayedLine (LPCTSTR lpLine, INT nLength, INT nExpand)
+{
+	LPDELAYED_LINE lpSplit;
+	INT nMax = 1;
+	INT nStart = 0;
+	INT nEnd;
+	INT i;
+
+	/* every '!' or '^' ends at most one segment */
+	for (i = 0; i < nLength; i++)
+	{
+		if (lpLine[i] == _T('!') || lpLine[i] == _T('^'))
+			nMax++;
+	}
+
+	lpSplit = (LPDELAYED_LINE)malloc (sizeof (DELAYED_LINE) +
+	                                  (nMax - 1) * sizeof (DELAYED_SEGMENT));
+	if (lpSplit == NULL)
+		return NULL;
+	lpSplit->nVariables = 0;
+	lpSplit->nSegments = 0;
+
+	i = 0;
+	while (i < nExpand)
+	{
+		if (lpLine[i] == _T('^') && i + 1 < nExpand && lpLine[i + 1] == _T('!'))
+		{
+			/* drop the caret, the '!' starts the next literal */
+			AddSegment (lpSplit, nStart, i - nStart, FALSE);
+			nStart = i + 1;
+			i += 2;
+			continue;
+		}
+
+		if (lpLine[i] == _T('!'))
+		{
+			for (nEnd = i + 1; nEnd < nExpand; nEnd++)
+			{
+				if (lpLine[nEnd] == _T('!') || lpLine[nEnd] == _T('\0'))
+					break;
+			}
+
+			if (nEnd < nExpand && lpLine[nEnd] == _T('!') && nEnd > i + 1)
+			{
+				AddSegment (lpSplit, nStart, i - nStart, FALSE);
+				AddSegment (lpSplit, i + 1, nEnd - i - 1, TRUE);
+				i = nStart = nEnd + 1;
+				continue;
+			}
+		}
+
+		i++;
+	}
+
+	AddSegment (lpSplit, nStart, nLength - nStart, FALSE);
+
+	return lpSplit;
+}
+
+
+/*
+ * Builds the text of a split line with the current values of its
+ * variables. Variables which are not set expand to nothing. Returns a
+ * buffer to be freed by the caller, or NULL if out of memory.
+ */
+
+LPTSTR ExpandDelayedLine (LPCTSTR lpLine, LPDELAYED_LINE lpSplit)
+{
+	LPDELAYED_SEGMENT lpSeg;
+	LPCTSTR lpValue;
+	TCHAR szValue[32];
+	LPTSTR lpBuffer;
+	LPTSTR p;
+	INT nSize = 1;
+	INT i;
+
+	if (!bEnvLoaded)
+		LoadEnvironment ();
+
+	/* the values can't change in between, so size the buffer first */
+	for (i = 0, lpSeg = lpSplit->Segments; i < lpSplit->nSegments; i++, lpSeg++)
+	{
+		if (!lpSeg->bVariable)
+		{
+			nSize += lpSeg->nLength;
+			continue;
+		}
+
+		lpValue = LookupVariable (lpLine + lpSeg->nStart, lpSeg->nLength, szValue);
+		if (lpValue != NULL)
+			nSize += _tcslen (lpValue);
+	}
+
+	lpBuffer = (LPTSTR)malloc (nSize * sizeof (TCHAR));
+	if (lpBuffer == NULL)
+		return NULL;
+
+	p = lpBuffer;
+	for (i = 0, lpSeg = lpSplit->Segments; i < lpSplit->nSegments; i++, lpSeg++)
+	{
+		if (!lpSeg->bVariable)
+		{
+			memcpy (p, lpLine + lpSeg->nStart, lpSeg->nLength * sizeof (TCHAR));
+			p += lpSeg->nLength;
+			continue;
+		}
+
+		lpValue = LookupVariable (lpLine + lpSeg->nStart, lpSeg->nLength, szValue);
+		if (lpValue != NULL)
+		{
+			_tcscpy (p, lpValue);
+			p += _tcslen (p);
+		}
+	}
+	*p = _T('\0');
+
+	return lpBuffer;
+}
+#endif /* FEATURE_DELAYED_EXPANSION */
+
+/* EOF */
@@ -141,6 +141,8 @@ INT cmd_for (LPTSTR cmd, LPTSTR param)
 	bc = lpNew;
 
 	bc->hBatchFile = INVALID_HANDLE_VALUE;
+	bc->lpFile = NULL;
+	bc->dwLine = 0;
 	bc->ffind = NULL;
 	bc->params = BatchParams (_T(""), param); /* Split out list */
 	bc->shiftlevel = 0;
@@ -150,6 +152,8 @@ INT cmd_for (LPTSTR cmd, LPTSTR param)
 		bc->bEcho = bc->prev->bEcho;
 	else
 		bc->bEcho = bEcho;
+	bc->nEnvScopes = bc->prev ? bc->prev->nEnvScopes : GetEnvScopeDepth ();
+	bc->lpProfile = NULL;
 
 	return 0;
 }
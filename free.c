@@ -133,6 +133,8 @@ INT CommandFree (LPTSTR cmd, LPTSTR param)
 	INT argc, i;
 	LPTSTR *arg;
 
+	LoadLocale ();
+
 	if (!_tcsncmp (param, _T("/?"), 2))
 	{
 		ConOutPuts (_T("Displays drive information.\n"
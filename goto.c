@@ -34,17 +34,131 @@
 #include "batch.h"
 
 
+/*
+ * Hash of the first LABEL_LENGTH characters of a label.
+ */
+
+static INT HashLabel (LPCTSTR label)
+{
+	UINT h = 0;
+	INT  n;
+
+	for (n = 0; n < LABEL_LENGTH && label[n]; n++)
+		h = h * 31 + (UINT)label[n];
+
+	return (INT)(h % LABEL_HASH_SIZE);
+}
+
+
+/*
+ * Scans the batch file image once and records the line of each label.
+ * Only the first line carrying a given label is recorded, as the
+ * linear search used to stop there.
+ */
+
+BOOL BuildLabelIndex (LPBATCH_FILE lpFile)
+{
+	TCHAR  szLine[BATCH_BUFFSIZE];
+	LPSTR  p;
+	LPTSTR tmp;
+	DWORD  dwLine;
+	DWORD  dwCount;
+	INT    n;
+
+	for (n = 0; n < LABEL_HASH_SIZE; n++)
+		lpFile->nLabelHash[n] = -1;
+
+	/* count the candidate lines on the raw image first */
+	dwCount = 0;
+	for (dwLine = 0; dwLine < lpFile->dwLines; dwLine++)
+	{
+		p = lpFile->lpData + lpFile->lpLines[dwLine].dwOffset;
+		while (*p != '\r' && *p != '\n' && isspace ((UCHAR)*p))
+			p++;
+		if (*p == ':')
+			dwCount++;
+	}
+
+	lpFile->lpLabels = (LPBATCH_LABEL)malloc ((dwCount + 1) * sizeof (BATCH_LABEL));
+	if (lpFile->lpLabels == NULL)
+	{
+		error_out_of_memory ();
+		return FALSE;
+	}
+	lpFile->dwLabels = 0;
+
+	for (dwLine = 0; dwLine < lpFile->dwLines; dwLine++)
+	{
+		LPBATCH_LABEL lpLabel;
+
+		p = lpFile->lpData + lpFile->lpLines[dwLine].dwOffset;
+		while (*p != '\r' && *p != '\n' && isspace ((UCHAR)*p))
+			p++;
+		if (*p != ':')
+			continue;
+
+		GetBatchLine (lpFile, dwLine, szLine, BATCH_BUFFSIZE);
+
+		/* Strip out any trailing spaces or control chars */
+		tmp = szLine + _tcslen (szLine) - 1;
+		while (tmp >= szLine && (_istcntrl (*tmp) || _istspace (*tmp)))
+			tmp--;
+		*(tmp + 1) = _T('\0');
+
+		/* Then leading spaces and the colon */
+		tmp = szLine;
+		while (_istspace (*tmp))
+			tmp++;
+		if (*tmp++ != _T(':'))
+			continue;
+
+		/* use only 1st 8 chars of label */
+		if (_tcslen (tmp) > LABEL_LENGTH)
+			tmp[LABEL_LENGTH] = _T('\0');
+
+		/* keep the first one of duplicate labels */
+		n = HashLabel (tmp);
+		for (lpLabel = lpFile->nLabelHash[n] < 0 ? NULL : &lpFile->lpLabels[lpFile->nLabelHash[n]];
+		     lpLabel != NULL;
+		     lpLabel = lpLabel->nNext < 0 ? NULL : &lpFile->lpLabels[lpLabel->nNext])
+		{
+			if (!_tcscmp (lpLabel->szLabel, tmp))
+				break;
+		}
+		if (lpLabel != NULL)
+			continue;
+
+		lpLabel = &lpFile->lpLabels[lpFile->dwLabels];
+		_tcscpy (lpLabel->szLabel, tmp);
+		lpLabel->dwLine = dwLine;
+		lpLabel->nNext = lpFile->nLabelHash[n];
+		lpFile->nLabelHash[n] = (INT)lpFile->dwLabels++;
+	}
+
+	lpFile->bLabels = TRUE;
+
+#ifdef _DEBUG
+	DebugPrintf (_T("BuildLabelIndex: %lu labels\n"), lpFile->dwLabels);
+#endif
+
+	return TRUE;
+}
+
+
 /*
  * Perform GOTO command.
  *
  * Only valid if batch file current.
  *
+ * The labels are looked up in an index of the batch file which is built
+ * on the first GOTO, so a jump does not depend on the size of the file.
  */
 
 INT cmd_goto (LPTSTR cmd, LPTSTR param)
 {
+	LPBATCH_FILE lpFile;
 	LPTSTR tmp;
-	LONG   lNewPosHigh;
+	INT    n;
 
 #ifdef _DEBUG
 	DebugPrintf (_T("cmd_goto (\'%s\', \'%s\'\n"), cmd, param);
@@ -80,26 +194,32 @@ INT cmd_goto (LPTSTR cmd, LPTSTR param)
 		tmp++;
 	*tmp = _T('\0');
 
-	/* set file pointer to the beginning of the batch file */
-	lNewPosHigh = 0;
-	SetFilePointer (bc->hBatchFile, 0, &lNewPosHigh, FILE_BEGIN);
+	/* use only 1st 8 chars of label */
+	if (tmp - param > LABEL_LENGTH)
+		param[LABEL_LENGTH] = _T('\0');
 
-	while (FileGetString (bc->hBatchFile, textline, sizeof(textline)))
+	/* the index is only valid as long as the file is unchanged */
+	if (bc->lpFile != NULL && RefreshBatchFile ())
 	{
-		/* Strip out any trailing spaces or control chars */
-		tmp = textline + _tcslen (textline) - 1;
-		while (_istcntrl (*tmp) || _istspace (*tmp))
-			tmp--;
-		*(tmp + 1) = _T('\0');
-
-		/* Then leading spaces... */
-		tmp = textline;
-		while (_istspace (*tmp))
-			tmp++;
-
-		/* use only 1st 8 chars of label */
-		if ((*tmp == _T(':')) && (_tcsncmp (++tmp, param, 8) == 0))
-			return 0;
+		lpFile = bc->lpFile;
+
+		if (lpFile->bLabels || BuildLabelIndex (lpFile))
+		{
+			for (n = lpFile->nLabelHash[HashLabel (param)]; n >= 0;
+			     n = lpFile->lpLabels[n].nNext)
+			{
+				if (!_tcscmp (lpFile->lpLabels[n].szLabel, param))
+				{
+#ifdef FEATURE_TRACE
+					if (bTrace)
+						TraceEvent (TRACE_GOTO, 'i', param, lpFile->lpLabels[n].dwLine + 1);
+#endif
+					/* continue with the line following the label */
+					bc->dwLine = lpFile->lpLabels[n].dwLine + 1;
+					return 0;
+				}
+			}
+		}
 	}
 
 	ConErrPrintf (_T("Label '%s' not found\n"), param);
@@ -0,0 +1,270 @@
+/*
+ *  JOBS.C - background jobs, JOBS and WAIT internal commands.
+ *
+ *
+ *  History:
+ *
+ *    17-Oct-2026
+ *        Started.
+ */
+
+#include "config.h"
+
+#ifdef INCLUDE_CMD_JOBS
+#include <windows.h>
+#include <tchar.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "cmd.h"
+
+
+/* the job table is waited on with a single WaitForMultipleObjects */
+#define MAX_JOBS  MAXIMUM_WAIT_OBJECTS
+
+/* length of the command line kept for JOBS */
+#define JOB_COMMAND_LENGTH  64
+
+
+typedef struct tagJOB
+{
+	INT    nId;
+	DWORD  dwProcessId;
+	TCHAR  szCommand[JOB_COMMAND_LENGTH];
+} JOB, *LPJOB;
+
+
+/* the process handles are kept apart, so they can be waited on as is */
+static JOB    Jobs[MAX_JOBS];
+static HANDLE hJobs[MAX_JOBS];
+static INT    nJobs = 0;
+static INT    nNextJobId = 1;
+static INT    nMaxJobs = 0;    /* 0 means no limit but the table size */
+
+
+static VOID RemoveJob (INT n)
+{
+#ifdef FEATURE_TELEMETRY
+	DWORD dwExitCode;
+
+	if (GetExitCodeProcess (hJobs[n], &dwExitCode) && dwExitCode != STILL_ACTIVE)
+		RecordProcessTelemetry (hJobs[n], Jobs[n].szCommand, dwExitCode, FALSE);
+#endif
+#ifdef FEATURE_TRACE
+	if (bTrace)
+		TraceEvent (TRACE_PROCESS, 'e', Jobs[n].szCommand, Jobs[n].dwProcessId);
+#endif
+
+	CloseHandle (hJobs[n]);
+
+	nJobs--;
+	memmove (&Jobs[n], &Jobs[n + 1], (nJobs - n) * sizeof (JOB));
+	memmove (&hJobs[n], &hJobs[n + 1], (nJobs - n) * sizeof (HANDLE));
+
+	if (nJobs == 0)
+		nNextJobId = 1;
+}
+
+
+/*
+ * Removes the jobs which have finished.
+ */
+
+static VOID ReapJobs (VOID)
+{
+	INT n = 0;
+
+	while (n < nJobs)
+	{
+		if (WaitForSingleObject (hJobs[n], 0) == WAIT_OBJECT_0)
+			RemoveJob (n);
+		else
+			n++;
+	}
+}
+
+
+/*
+ * Called before a background job is started. Blocks until there is
+ * room for a new job, as given by JOBS /MAX.
+ */
+
+VOID ThrottleJobs (VOID)
+{
+	INT nLimit = (nMaxJobs > 0 && nMaxJobs < MAX_JOBS) ? nMaxJobs : MAX_JOBS;
+
+	ReapJobs ();
+
+	while (nJobs >= nLimit)
+	{
+		ConOutFlush ();
+		WaitForMultipleObjects (nJobs, hJobs, FALSE, INFINITE);
+		ReapJobs ();
+	}
+}
+
+
+/*
+ * Adds a started process to the job table. The table owns the process
+ * handle from now on.
+ */
+
+VOID AddJob (HANDLE hProcess, DWORD dwProcessId, LPCTSTR lpCommand)
+{
+	LPJOB lpJob;
+
+	ThrottleJobs ();
+
+	lpJob = &Jobs[nJobs];
+	lpJob->nId = nNextJobId++;
+	lpJob->dwProcessId = dwProcessId;
+	_tcsncpy (lpJob->szCommand, lpCommand, JOB_COMMAND_LENGTH - 1);
+	lpJob->szCommand[JOB_COMMAND_LENGTH - 1] = _T('\0');
+	hJobs[nJobs++] = hProcess;
+
+#ifdef FEATURE_TRACE
+	/* it ends when the job is reaped */
+	if (bTrace)
+		TraceEvent (TRACE_PROCESS, 'b', lpJob->szCommand, dwProcessId);
+#endif
+
+	ConErrPrintf (_T("[%d] %lu\n"), lpJob->nId, dwProcessId);
+}
+
+
+/*
+ * Lets go of all jobs without waiting for them, the ones still running
+ * go on on their own.
+ */
+
+VOID ReleaseJobs (VOID)
+{
+	ReapJobs ();
+
+	while (nJobs > 0)
+		CloseHandle (hJobs[--nJobs]);
+	nNextJobId = 1;
+}
+
+
+INT cmd_jobs (LPTSTR cmd, LPTSTR param)
+{
+	INT n;
+
+	if (!_tcsncmp (param, _T("/?"), 2))
+	{
+		ConOutPuts (_T("Lists the commands running in the background.\n"
+		               "\n"
+		               "JOBS [/MAX n]\n"
+		               "\n"
+		               "  /MAX n  Allows at most n jobs at a time, starting another job\n"
+		               "          waits for one to finish. 0 removes the limit.\n"
+		               "\n"
+		               "A program followed by & or started with START /B runs as a job.\n"
+		               "Internal commands and batch files always run in the shell."));
+		return 0;
+	}
+
+	if (!_tcsnicmp (param, _T("/max"), 4))
+	{
+		param += 4;
+		while (_istspace (*param))
+			param++;
+
+		if (!_istdigit (*param))
+		{
+			error_req_param_missing ();
+			return 1;
+		}
+
+		nMaxJobs = _ttoi (param);
+		return 0;
+	}
+
+	if (*param)
+	{
+		error_invalid_parameter_format (param);
+		return 1;
+	}
+
+	ReapJobs ();
+
+	for (n = 0; n < nJobs; n++)
+	{
+		ConOutPrintf (_T("[%d] %-8lu %s\n"),
+		              Jobs[n].nId, Jobs[n].dwProcessId, Jobs[n].szCommand);
+	}
+
+	return 0;
+}
+
+
+/*
+ * WAIT [id|ALL]
+ *
+ * Sets the errorlevel to the exit code of the job waited for. When
+ * waiting for all jobs, to the exit code of the first one that failed.
+ */
+
+INT cmd_wait (LPTSTR cmd, LPTSTR param)
+{
+	DWORD dwExitCode;
+	INT   nId;
+	INT   n;
+
+	if (!_tcsncmp (param, _T("/?"), 2))
+	{
+		ConOutPuts (_T("Waits for commands running in the background.\n"
+		               "\n"
+		               "WAIT [id | ALL]\n"
+		               "\n"
+		               "  id   Number of the job to wait for, as listed by JOBS.\n"
+		               "  ALL  Waits for all jobs. This is the default."));
+		return 0;
+	}
+
+	/* what was printed before shows while waiting */
+	ConOutFlush ();
+
+	if (*param == _T('\0') || !_tcsicmp (param, _T("all")))
+	{
+		nErrorLevel = 0;
+
+		if (nJobs == 0)
+			return 0;
+
+		WaitForMultipleObjects (nJobs, hJobs, TRUE, INFINITE);
+
+		for (n = 0; n < nJobs; n++)
+		{
+			GetExitCodeProcess (hJobs[n], &dwExitCode);
+			if (nErrorLevel == 0)
+				nErrorLevel = (INT)dwExitCode;
+		}
+
+		while (nJobs > 0)
+			RemoveJob (0);
+
+		return 0;
+	}
+
+	nId = _ttoi (param);
+	for (n = 0; n < nJobs; n++)
+	{
+		if (Jobs[n].nId == nId)
+		{
+			WaitForSingleObject (hJobs[n], INFINITE);
+			GetExitCodeProcess (hJobs[n], &dwExitCode);
+			nErrorLevel = (INT)dwExitCode;
+			RemoveJob (n);
+			return 0;
+		}
+	}
+
+	ConErrPrintf (_T("No such job: %s\n"), param);
+	return 1;
+}
+
+#endif /* INCLUDE_CMD_JOBS */
+
+/* EOF */
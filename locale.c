@@ -30,6 +30,12 @@ INT   nTimeFormat;
 TCHAR aszDayNames[7][8];
 INT   nNumberGroups;
 
+static BOOL bLocaleLoaded = FALSE;
+
+
+/*
+ * Reads the locale settings. Called by CHCP to reread them.
+ */
 
 VOID InitLocale (VOID)
 {
@@ -113,6 +119,20 @@ VOID InitLocale (VOID)
 	for (i = 0; i < 7; i++)
 		_tcscpy (aszDayNames[i], names[i]);
 #endif
+
+	bLocaleLoaded = TRUE;
+}
+
+
+/*
+ * Reads the locale settings on first use, so commands which don't
+ * print dates, times or numbers don't pay for the lookups.
+ */
+
+VOID LoadLocale (VOID)
+{
+	if (!bLocaleLoaded)
+		InitLocale ();
 }
 
 
@@ -121,6 +141,7 @@ VOID PrintDate (VOID)
 #ifdef __REACTOS__
 	SYSTEMTIME st;
 
+	LoadLocale ();
 	GetLocalTime (&st);
 
 	switch (nDateFormat)
@@ -156,6 +177,7 @@ VOID PrintTime (VOID)
 #ifdef __REACTOS__
 	SYSTEMTIME st;
 
+	LoadLocale ();
 	GetLocalTime (&st);
 
 	switch (nTimeFormat)
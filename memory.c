@@ -68,6 +68,8 @@ INT CommandMemory (LPTSTR cmd, LPTSTR param)
 	TCHAR szTotalVirtual[20];
 	TCHAR szAvailVirtual[20];
 
+	LoadLocale ();
+
 	if (!_tcsncmp (param, _T("/?"), 2))
 	{
 		ConOutPuts (_T("Displays the amount of system memory.\n"
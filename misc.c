@@ -46,25 +46,14 @@
  */
 TCHAR cgetchar (VOID)
 {
-	HANDLE hInput = GetStdHandle (STD_INPUT_HANDLE);
 	INPUT_RECORD irBuffer;
-	DWORD  dwRead;
 
-	do
-	{
-		ReadConsoleInput (hInput, &irBuffer, 1, &dwRead);
-		if ((irBuffer.EventType == KEY_EVENT) &&
-			(irBuffer.Event.KeyEvent.bKeyDown == TRUE))
-		{
-			if ((irBuffer.Event.KeyEvent.dwControlKeyState &
-				 (LEFT_CTRL_PRESSED | RIGHT_CTRL_PRESSED)) &
-				(irBuffer.Event.KeyEvent.wVirtualKeyCode == 'C'))
-				bCtrlBreak = TRUE;
-
-			break;
-		}
-	}
-	while (TRUE);
+	/* reads the standard input in headless mode */
+	ConInKey (&irBuffer);
+	if ((irBuffer.Event.KeyEvent.dwControlKeyState &
+		 (LEFT_CTRL_PRESSED | RIGHT_CTRL_PRESSED)) &
+		(irBuffer.Event.KeyEvent.wVirtualKeyCode == 'C'))
+		bCtrlBreak = TRUE;
 
 #ifndef _UNICODE
 	return irBuffer.Event.KeyEvent.uChar.AsciiChar;
@@ -369,41 +358,6 @@ BOOL IsValidDirectory (LPCTSTR pszPath)
 }
 
 
-BOOL FileGetString (HANDLE hFile, LPTSTR lpBuffer, INT nBufferLength)
-{
-	LPSTR lpString;
-	CHAR ch;
-	DWORD  dwRead;
-	INT len;
-#ifdef _UNICODE
-	lpString = malloc(nBufferLength);
-#else
-	lpString = lpBuffer;
-#endif
-	len = 0;
-	while ((--nBufferLength >  0) &&
-		   ReadFile(hFile, &ch, 1, &dwRead, NULL) && dwRead)
-	{
-		if (ch == '\r')
-		{
-			/* overread '\n' */
-			ReadFile (hFile, &ch, 1, &dwRead, NULL);
-			break;
-		}
-                lpString[len++] = ch;
-	}
-
-	if (!dwRead && !len)
-		return FALSE;
-
-	lpString[len++] = '\0';
-#ifdef _UNICODE
-	MultiByteToWideChar(CP_ACP, 0, lpString, len, lpBuffer, len);
-	free(lpString);
-#endif
-	return TRUE;
-}
-
 #ifndef __REACTOS__
 /*
  * GetConsoleWindow - returns the handle to the current console window
@@ -81,7 +81,7 @@ INT cmd_path (LPTSTR cmd, LPTSTR param)
 		param++;
 
 	/* set PATH environment variable */
-	if (!SetEnvironmentVariable (_T("PATH"), param))
+	if (!SetEnvVar (_T("PATH"), param))
 		return 1;
 
 	return 0;
@@ -0,0 +1,452 @@
+/*
+ *  PROFILE.C - batch file profiler.
+ *
+ *
+ *  History:
+ *
+ *    17-Oct-2026
+ *        Started.
+ *
+ *  With /PROFILE[:file] every line run from a batch file is counted,
+ *  along with the wall time spent on it and the CPU time of the external
+ *  programs it started. The lines a FOR runs are counted apart from the
+ *  FOR line itself. The time of a CALL line includes the whole called
+ *  batch file.
+ *
+ *  On exit a report sorted by time is written to the file (cmdprof.txt
+ *  by default), and the same data as comma separated values to the file
+ *  of the same name with the extension .csv.
+ */
+
+#include "config.h"
+
+#ifdef FEATURE_PROFILE
+
+#include <windows.h>
+#include <tchar.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "cmd.h"
+#include "batch.h"
+
+
+/* number of hash chains for the lines, a power of two */
+#define PROFILE_HASH_SIZE  1024
+
+#define REPORT_LINE_LENGTH  (MAX_PATH + 128)
+
+
+typedef struct tagPROFLINE
+{
+	struct tagPROFLINE *next;
+	INT       nFile;         /* index in lpFiles */
+	DWORD     dwLine;        /* line number, from 1 */
+	BOOL      bFor;          /* run by the FOR on that line */
+	DWORD     dwHits;
+	INT       nMaxDepth;     /* deepest CALL level it ran at */
+	ULONGLONG ullWall;       /* performance counter ticks */
+	ULONGLONG ullChild;      /* CPU time of child processes, 100 ns */
+	LARGE_INTEGER liStart;   /* when it started running */
+	ULONGLONG ullChildStart; /* ullChildTotal at that time */
+} PROFLINE, *LPPROFLINE;
+
+/* kept in each batch context, so a CALL line gets the time of the call */
+typedef struct tagPROFFRAME
+{
+	INT        nFile;
+	LPPROFLINE lpCaller;     /* line which started the batch, or NULL */
+	LARGE_INTEGER liStart;
+	ULONGLONG  ullChildStart;
+} PROFFRAME, *LPPROFFRAME;
+
+
+BOOL bProfile = FALSE;
+
+static TCHAR szReportFile[MAX_PATH];
+static LARGE_INTEGER liFrequency;
+
+static LPPROFLINE lpLineHash[PROFILE_HASH_SIZE];
+static DWORD dwLineCount = 0;
+
+static LPTSTR *lpFiles = NULL;    /* full names of the batch files */
+static INT nFiles = 0;
+
+static LPPROFLINE lpPending = NULL;  /* line last returned by ReadBatchLine */
+static LPPROFLINE lpRunning = NULL;  /* line run by ParseCommandLine */
+static ULONGLONG ullChildTotal = 0;
+
+
+/*
+ * Starts profiling. The report goes to lpFileName, or to cmdprof.txt
+ * in the current directory if it is NULL or empty.
+ */
+
+VOID ProfileStart (LPCTSTR lpFileName)
+{
+	LPTSTR lpFilePart;
+
+	if (lpFileName == NULL || *lpFileName == _T('\0'))
+		lpFileName = _T("cmdprof.txt");
+
+	/* the current directory will change on the way */
+	if (!GetFullPathName (lpFileName, MAX_PATH, szReportFile, &lpFilePart))
+		return;
+
+	if (!QueryPerformanceFrequency (&liFrequency) || liFrequency.QuadPart == 0)
+		return;
+
+	bProfile = TRUE;
+}
+
+
+static INT FindProfileFile (LPCTSTR lpName)
+{
+	LPTSTR *lpNewFiles;
+	INT i;
+
+	for (i = 0; i < nFiles; i++)
+	{
+		if (!_tcsicmp (lpFiles[i], lpName))
+			return i;
+	}
+
+	lpNewFiles = (LPTSTR *)realloc (lpFiles, (nFiles + 1) * sizeof (LPTSTR));
+	if (lpNewFiles == NULL)
+		return -1;
+	lpFiles = lpNewFiles;
+
+	lpFiles[nFiles] = _tcsdup (lpName);
+	if (lpFiles[nFiles] == NULL)
+		return -1;
+
+	return nFiles++;
+}
+
+
+static LPPROFLINE FindProfileLine (INT nFile, DWORD dwLine, BOOL bFor)
+{
+	UINT h = ((UINT)nFile * 31 + (UINT)dwLine * 2 + (bFor ? 1 : 0)) & (PROFILE_HASH_SIZE - 1);
+	LPPROFLINE lpLine;
+
+	for (lpLine = lpLineHash[h]; lpLine != NULL; lpLine = lpLine->next)
+	{
+		if (lpLine->nFile == nFile && lpLine->dwLine == dwLine &&
+		    lpLine->bFor == bFor)
+			return lpLine;
+	}
+
+	lpLine = (LPPROFLINE)malloc (sizeof (PROFLINE));
+	if (lpLine == NULL)
+		return NULL;
+
+	memset (lpLine, 0, sizeof (PROFLINE));
+	lpLine->nFile = nFile;
+	lpLine->dwLine = dwLine;
+	lpLine->bFor = bFor;
+	lpLine->next = lpLineHash[h];
+	lpLineHash[h] = lpLine;
+	dwLineCount++;
+
+	return lpLine;
+}
+
+
+/*
+ * Called by Batch for the batch file fullname, which runs in the
+ * current batch context from now on.
+ */
+
+VOID ProfileBatch (LPCTSTR fullname)
+{
+	LPPROFFRAME lpFrame = (LPPROFFRAME)bc->lpProfile;
+
+	if (lpFrame == NULL)
+	{
+		lpFrame = (LPPROFFRAME)malloc (sizeof (PROFFRAME));
+		if (lpFrame == NULL)
+			return;
+
+		lpFrame->lpCaller = lpRunning;
+		lpFrame->ullChildStart = ullChildTotal;
+		QueryPerformanceCounter (&lpFrame->liStart);
+		bc->lpProfile = lpFrame;
+	}
+
+	/* a batch file started without CALL replaces the one running */
+	lpFrame->nFile = FindProfileFile (fullname);
+}
+
+
+/*
+ * Called by ExitBatch for a batch context which ends.
+ */
+
+VOID ProfileBatchExit (LPVOID lpProfile)
+{
+	LPPROFFRAME lpFrame = (LPPROFFRAME)lpProfile;
+	LARGE_INTEGER liNow;
+
+	/* the lines are gone once the report was written */
+	if (bProfile && lpFrame->lpCaller != NULL)
+	{
+		QueryPerformanceCounter (&liNow);
+		lpFrame->lpCaller->ullWall += liNow.QuadPart - lpFrame->liStart.QuadPart;
+		lpFrame->lpCaller->ullChild += ullChildTotal - lpFrame->ullChildStart;
+	}
+
+	free (lpFrame);
+}
+
+
+/*
+ * Called by ReadBatchLine, with TRUE when it returns a line. The line
+ * is timed if it is run by ParseCommandLine.
+ */
+
+VOID ProfileLine (BOOL bBatchLine)
+{
+	LPBATCH_CONTEXT b;
+	LPPROFFRAME lpFrame;
+	INT nDepth = 0;
+
+	lpPending = NULL;
+
+	if (!bBatchLine)
+		return;
+
+	/* the lines of a FOR count for the line of the FOR */
+	for (b = bc; b != NULL && b->forvar; b = b->prev)
+		;
+	if (b == NULL || b->lpProfile == NULL)
+		return;
+
+	lpFrame = (LPPROFFRAME)b->lpProfile;
+	if (lpFrame->nFile < 0)
+		return;
+
+	lpPending = FindProfileLine (lpFrame->nFile, b->dwLine, bc->forvar != _T('\0'));
+	if (lpPending == NULL)
+		return;
+
+	for (; b != NULL; b = b->prev)
+	{
+		if (!b->forvar)
+			nDepth++;
+	}
+
+	lpPending->dwHits++;
+	if (nDepth > lpPending->nMaxDepth)
+		lpPending->nMaxDepth = nDepth;
+}
+
+
+/*
+ * Called by ParseCommandLine before it runs a line. Returns the line
+ * to pass to ProfileEnd, or NULL if the line isn't timed, as are the
+ * commands run by a line.
+ */
+
+LPVOID ProfileBegin (VOID)
+{
+	LPPROFLINE lpLine = lpPending;
+
+	lpPending = NULL;
+	if (lpLine == NULL || lpRunning != NULL)
+		return NULL;
+
+	lpRunning = lpLine;
+	lpLine->ullChildStart = ullChildTotal;
+	QueryPerformanceCounter (&lpLine->liStart);
+
+	return lpLine;
+}
+
+
+VOID ProfileEnd (LPVOID lpProfile)
+{
+	LPPROFLINE lpLine = (LPPROFLINE)lpProfile;
+	LARGE_INTEGER liNow;
+
+	QueryPerformanceCounter (&liNow);
+	lpLine->ullWall += liNow.QuadPart - lpLine->liStart.QuadPart;
+	lpLine->ullChild += ullChildTotal - lpLine->ullChildStart;
+
+	lpRunning = NULL;
+}
+
+
+/*
+ * Called by Execute for a child process which has finished.
+ */
+
+VOID ProfileChildProcess (HANDLE hProcess)
+{
+	FILETIME ftCreation, ftExit, ftKernel, ftUser;
+
+	if (!GetProcessTimes (hProcess, &ftCreation, &ftExit, &ftKernel, &ftUser))
+		return;
+
+	ullChildTotal += ((ULONGLONG)ftKernel.dwHighDateTime << 32) + ftKernel.dwLowDateTime;
+	ullChildTotal += ((ULONGLONG)ftUser.dwHighDateTime << 32) + ftUser.dwLowDateTime;
+}
+
+
+static VOID WriteReportText (HANDLE hFile, LPCTSTR lpText)
+{
+	DWORD dwWritten;
+	INT len = _tcslen (lpText);
+#ifdef _UNICODE
+	CHAR szAnsi[REPORT_LINE_LENGTH * 2];
+
+	len = WideCharToMultiByte (CP_ACP, 0, lpText, len, szAnsi, sizeof (szAnsi), NULL, NULL);
+	WriteFile (hFile, szAnsi, len, &dwWritten, NULL);
+#else
+	WriteFile (hFile, lpText, len, &dwWritten, NULL);
+#endif
+}
+
+
+/* longest time first */
+static int CompareProfileLines (const void *p1, const void *p2)
+{
+	LPPROFLINE l1 = *(LPPROFLINE *)p1;
+	LPPROFLINE l2 = *(LPPROFLINE *)p2;
+
+	if (l1->ullWall != l2->ullWall)
+		return (l1->ullWall < l2->ullWall) ? 1 : -1;
+	if (l1->nFile != l2->nFile)
+		return l1->nFile - l2->nFile;
+	if (l1->dwLine != l2->dwLine)
+		return (l1->dwLine < l2->dwLine) ? -1 : 1;
+	return l1->bFor - l2->bFor;
+}
+
+
+static VOID WriteReports (LPPROFLINE *lpSorted)
+{
+	TCHAR szCsvFile[MAX_PATH];
+	TCHAR szText[REPORT_LINE_LENGTH];
+	HANDLE hReport;
+	HANDLE hCsv;
+	LPPROFLINE lpLine;
+	LPTSTR p;
+	DWORD i;
+
+	/* the .csv file goes next to the report */
+	_tcscpy (szCsvFile, szReportFile);
+	p = _tcsrchr (szCsvFile, _T('.'));
+	if (p == NULL || _tcschr (p, _T('\\')) != NULL)
+		p = szCsvFile + _tcslen (szCsvFile);
+	if (p - szCsvFile + 4 >= MAX_PATH)
+		return;
+	_tcscpy (p, _T(".csv"));
+
+	hReport = CreateFile (szReportFile, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+	                      CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hReport == INVALID_HANDLE_VALUE)
+	{
+		ErrorMessage (GetLastError (), _T("Can't write the profile to %s"), szReportFile);
+		return;
+	}
+
+	hCsv = CreateFile (szCsvFile, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+	                   CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	WriteReportText (hReport, _T("Batch file profile, longest time first. Times include the\r\n")
+	                          _T("called batch files, Child is the CPU time of external programs.\r\n\r\n")
+	                          _T("     Time ms     Child ms       Hits  Depth  Line\r\n"));
+	if (hCsv != INVALID_HANDLE_VALUE)
+		WriteReportText (hCsv, _T("file,line,for,hits,max_depth,wall_us,child_us\r\n"));
+
+	for (i = 0; i < dwLineCount; i++)
+	{
+		lpLine = lpSorted[i];
+
+		_sntprintf (szText, REPORT_LINE_LENGTH,
+		            _T("%12.3f %12.3f %10lu %6d  %s:%lu%s\r\n"),
+		            (double)(LONGLONG)lpLine->ullWall * 1000.0 / (double)liFrequency.QuadPart,
+		            (double)(LONGLONG)lpLine->ullChild / 10000.0,
+		            lpLine->dwHits, lpLine->nMaxDepth,
+		            lpFiles[lpLine->nFile], lpLine->dwLine,
+		            lpLine->bFor ? _T(" (FOR)") : _T(""));
+		szText[REPORT_LINE_LENGTH - 1] = _T('\0');
+		WriteReportText (hReport, szText);
+
+		if (hCsv == INVALID_HANDLE_VALUE)
+			continue;
+
+		_sntprintf (szText, REPORT_LINE_LENGTH,
+		            _T("\"%s\",%lu,%d,%lu,%d,%I64u,%I64u\r\n"),
+		            lpFiles[lpLine->nFile], lpLine->dwLine, lpLine->bFor ? 1 : 0,
+		            lpLine->dwHits, lpLine->nMaxDepth,
+		            (ULONGLONG)((double)(LONGLONG)lpLine->ullWall * 1000000.0 /
+		                        (double)liFrequency.QuadPart),
+		            lpLine->ullChild / 10);
+		szText[REPORT_LINE_LENGTH - 1] = _T('\0');
+		WriteReportText (hCsv, szText);
+	}
+
+	if (hCsv != INVALID_HANDLE_VALUE)
+		CloseHandle (hCsv);
+	CloseHandle (hReport);
+}
+
+
+/*
+ * Writes the reports and stops profiling.
+ */
+
+VOID ProfileStop (VOID)
+{
+	LPPROFLINE *lpSorted;
+	LPPROFLINE lpLine;
+	DWORD n = 0;
+	INT i;
+
+	if (!bProfile)
+		return;
+
+	bProfile = FALSE;
+
+	lpSorted = (LPPROFLINE *)malloc ((dwLineCount + 1) * sizeof (LPPROFLINE));
+	if (lpSorted == NULL)
+	{
+		error_out_of_memory ();
+	}
+	else
+	{
+		for (i = 0; i < PROFILE_HASH_SIZE; i++)
+		{
+			for (lpLine = lpLineHash[i]; lpLine != NULL; lpLine = lpLine->next)
+				lpSorted[n++] = lpLine;
+		}
+
+		qsort (lpSorted, n, sizeof (LPPROFLINE), CompareProfileLines);
+		WriteReports (lpSorted);
+		free (lpSorted);
+	}
+
+	for (i = 0; i < PROFILE_HASH_SIZE; i++)
+	{
+		while ((lpLine = lpLineHash[i]) != NULL)
+		{
+			lpLineHash[i] = lpLine->next;
+			free (lpLine);
+		}
+	}
+	dwLineCount = 0;
+	lpPending = NULL;
+	lpRunning = NULL;
+
+	for (i = 0; i < nFiles; i++)
+		free (lpFiles[i]);
+	free (lpFiles);
+	lpFiles = NULL;
+	nFiles = 0;
+}
+
+#endif /* FEATURE_PROFILE */
+
+/* EOF */
@@ -142,6 +142,11 @@ VOID PrintPrompt(VOID)
 					break;
 
 				case _T('V'):
+					if (osvi.dwOSVersionInfoSize == 0)
+					{
+						osvi.dwOSVersionInfoSize = sizeof(OSVERSIONINFO);
+						GetVersionEx (&osvi);
+					}
 					switch (osvi.dwPlatformId)
 					{
 						case VER_PLATFORM_WIN32_WINDOWS:
@@ -217,7 +222,7 @@ INT cmd_prompt (LPTSTR cmd, LPTSTR param)
 	}
 
 	/* set PROMPT environment variable */
-	if (!SetEnvironmentVariable (_T("PROMPT"), param))
+	if (!SetEnvVar (_T("PROMPT"), param))
 		return 1;
 
 	return 0;
@@ -73,7 +73,8 @@ INT GetRedirection (LPTSTR s, LPTSTR ifn, LPTSTR ofn, LPTSTR efn, LPINT lpnFlags
 				*dp++ = *sp++;
 			while (*sp && *sp != qc);
 
-			*dp++ = *sp++;
+			if (*sp)
+				*dp++ = *sp++;
 		}
 		else if ((*sp == _T('<')) || (*sp == _T('>')) ||
 				 (*sp == _T('2')) || (*sp == _T('&')))
@@ -199,7 +200,8 @@ INT GetRedirection (LPTSTR s, LPTSTR ifn, LPTSTR ofn, LPTSTR efn, LPINT lpnFlags
 				sp++;
 			while (*sp && *sp != qc);
 
-			sp++;
+			if (*sp)
+				sp++;
 		}
 		else if (*sp == _T('|'))
 		{
@@ -0,0 +1,457 @@
+/*
+ *  SERVER.C - command server, /SERVER and /CONNECT.
+ *
+ *
+ *  History:
+ *
+ *    17-Oct-2026
+ *        Started.
+ *
+ *  "cmd /SERVER[:name]" keeps running and serves requests on the named
+ *  pipe \\.\pipe\cmd-name, one at a time. "cmd /CONNECT[:name] command"
+ *  sends the command together with its current directory and environment
+ *  to the server and passes back the output and errorlevel. If no server
+ *  is running, the command is run locally as with /C.
+ *
+ *  Each request runs in the directory and environment of the client,
+ *  with standard input from NUL and the output collected in temporary
+ *  files. Batch files left running at the end of a request are ended,
+ *  and the aliases, background jobs and delayed expansion setting it
+ *  left are dropped, so requests don't see each other's state.
+ *
+ *  The pipe can only be opened by the user the server runs as, and the
+ *  server fails to start if another process owns the pipe name.
+ *
+ *  Request:  DWORD size, then  directory \0 command \0 environment block
+ *  Reply:    SERVERREPLY, then the standard output and the error output
+ */
+
+#include "config.h"
+
+#ifdef FEATURE_SERVER
+#include <windows.h>
+#include <tchar.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "cmd.h"
+#include "batch.h"
+
+
+#define SERVER_PIPE_PREFIX   _T("\\\\.\\pipe\\cmd-")
+#define SERVER_DEFAULT_NAME  _T("default")
+#define SERVER_BUFFER_SIZE   16384
+#define SERVER_MAX_REQUEST   (1024 * 1024)
+#define SERVER_TIMEOUT       5000
+
+
+typedef struct tagSERVERREPLY
+{
+	DWORD dwErrorLevel;
+	DWORD cbOutput;
+	DWORD cbError;
+} SERVERREPLY;
+
+
+static VOID GetPipeName (LPTSTR lpPipe, LPCTSTR lpName)
+{
+	if (lpName == NULL || *lpName == _T('\0'))
+		lpName = SERVER_DEFAULT_NAME;
+
+	_tcscpy (lpPipe, SERVER_PIPE_PREFIX);
+	_tcsncat (lpPipe, lpName, MAX_PATH - _tcslen (SERVER_PIPE_PREFIX) - 1);
+}
+
+
+static BOOL ReadAll (HANDLE hFile, LPVOID lpBuffer, DWORD dwLength)
+{
+	DWORD dwRead;
+
+	while (dwLength > 0)
+	{
+		if (!ReadFile (hFile, lpBuffer, dwLength, &dwRead, NULL) || dwRead == 0)
+			return FALSE;
+		lpBuffer = (LPBYTE)lpBuffer + dwRead;
+		dwLength -= dwRead;
+	}
+
+	return TRUE;
+}
+
+
+static BOOL WriteAll (HANDLE hFile, LPCVOID lpBuffer, DWORD dwLength)
+{
+	DWORD dwWritten;
+
+	while (dwLength > 0)
+	{
+		if (!WriteFile (hFile, lpBuffer, dwLength, &dwWritten, NULL) || dwWritten == 0)
+			return FALSE;
+		lpBuffer = (LPBYTE)lpBuffer + dwWritten;
+		dwLength -= dwWritten;
+	}
+
+	return TRUE;
+}
+
+
+/*
+ * Copies dwLength bytes from one handle to another.
+ */
+
+static BOOL CopyData (HANDLE hFrom, HANDLE hTo, DWORD dwLength)
+{
+	BYTE  Buffer[SERVER_BUFFER_SIZE];
+	DWORD dwChunk;
+
+	while (dwLength > 0)
+	{
+		dwChunk = dwLength < SERVER_BUFFER_SIZE ? dwLength : SERVER_BUFFER_SIZE;
+		if (!ReadAll (hFrom, Buffer, dwChunk) || !WriteAll (hTo, Buffer, dwChunk))
+			return FALSE;
+		dwLength -= dwChunk;
+	}
+
+	return TRUE;
+}
+
+
+/*
+ * Creates an inheritable temporary file to collect output in. It is
+ * deleted when the server ends.
+ */
+
+static HANDLE CreateOutputFile (VOID)
+{
+	SECURITY_ATTRIBUTES sa = {sizeof(SECURITY_ATTRIBUTES), NULL, TRUE};
+	TCHAR szTempPath[MAX_PATH];
+	TCHAR szFileName[MAX_PATH];
+
+	GetTempPath (MAX_PATH, szTempPath);
+	GetTempFileName (szTempPath, _T("CMD"), 0, szFileName);
+
+	return CreateFile (szFileName, GENERIC_READ | GENERIC_WRITE,
+	                   FILE_SHARE_READ | FILE_SHARE_WRITE, &sa, CREATE_ALWAYS,
+	                   FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+}
+
+
+static VOID ResetOutputFile (HANDLE hFile)
+{
+	SetFilePointer (hFile, 0, NULL, FILE_BEGIN);
+	SetEndOfFile (hFile);
+}
+
+
+/*
+ * Runs a command in the context of a request.
+ */
+
+static VOID RunRequest (LPTSTR lpDirectory, LPTSTR lpCommand, LPCTSTR lpEnvironment)
+{
+	BOOL bOldEcho = bEcho;
+	BOOL bOldDelayed = GetDelayedExpansion ();
+
+	SetEnvironmentBlock (lpEnvironment);
+
+	nErrorLevel = 0;
+	if (!SetCurrentDirectory (lpDirectory))
+	{
+		ConErrPrintf (_T("Invalid directory: %s\n"), lpDirectory);
+		nErrorLevel = 1;
+		return;
+	}
+
+	ParseCommandLine (lpCommand);
+	ProcessInput (TRUE);
+
+	/* EXIT only ends this request */
+	while (bc != NULL)
+		ExitBatch (NULL);
+	bExit = FALSE;
+	bEcho = bOldEcho;
+
+	/* the next request starts like the first one */
+	LeaveEnvScopes (0);
+	SetDelayedExpansion (bOldDelayed);
+#ifdef FEATURE_ALIASES
+	DestroyAlias ();
+#endif
+#ifdef INCLUDE_CMD_JOBS
+	ReleaseJobs ();
+#endif
+}
+
+
+static VOID ServeRequest (HANDLE hPipe, HANDLE hOutput, HANDLE hError)
+{
+	SERVERREPLY Reply;
+	LPTSTR lpRequest;
+	LPTSTR lpCommand;
+	LPTSTR lpEnvironment;
+	DWORD  cbRequest;
+	DWORD  nLength;
+
+	if (!ReadAll (hPipe, &cbRequest, sizeof (DWORD)) ||
+	    cbRequest < 4 * sizeof (TCHAR) || cbRequest > SERVER_MAX_REQUEST ||
+	    cbRequest % sizeof (TCHAR) != 0)
+		return;
+
+	lpRequest = (LPTSTR)malloc (cbRequest);
+	if (lpRequest == NULL)
+		return;
+
+	nLength = cbRequest / sizeof (TCHAR);
+	if (!ReadAll (hPipe, lpRequest, cbRequest) ||
+	    lpRequest[nLength - 1] != _T('\0') || lpRequest[nLength - 2] != _T('\0'))
+	{
+		free (lpRequest);
+		return;
+	}
+
+	/* the terminators at the end keep the scans inside the request */
+	lpCommand = lpRequest + _tcslen (lpRequest) + 1;
+	lpEnvironment = lpCommand + _tcslen (lpCommand) + 1;
+	if (lpEnvironment >= lpRequest + nLength)
+	{
+		free (lpRequest);
+		return;
+	}
+
+	ResetOutputFile (hOutput);
+	ResetOutputFile (hError);
+
+	RunRequest (lpRequest, lpCommand, lpEnvironment);
+	ConOutFlush ();
+
+	Reply.dwErrorLevel = (DWORD)nErrorLevel;
+	Reply.cbOutput = SetFilePointer (hOutput, 0, NULL, FILE_CURRENT);
+	Reply.cbError = SetFilePointer (hError, 0, NULL, FILE_CURRENT);
+	SetFilePointer (hOutput, 0, NULL, FILE_BEGIN);
+	SetFilePointer (hError, 0, NULL, FILE_BEGIN);
+
+	if (WriteAll (hPipe, &Reply, sizeof (SERVERREPLY)) &&
+	    CopyData (hOutput, hPipe, Reply.cbOutput))
+		CopyData (hError, hPipe, Reply.cbError);
+
+	free (lpRequest);
+}
+
+
+/*
+ * Fills in a security descriptor which only lets the user the server
+ * runs as open the pipe. The DACL is built in lpAcl.
+ */
+
+static BOOL InitPipeSecurity (PSECURITY_DESCRIPTOR lpSD, PACL lpAcl, DWORD cbAcl)
+{
+	DWORD  TokenBuffer[64];  /* TOKEN_USER and the SID it points to */
+	HANDLE hToken;
+	DWORD  cbToken;
+	BOOL   bResult;
+
+	if (!OpenProcessToken (GetCurrentProcess (), TOKEN_QUERY, &hToken))
+		return FALSE;
+	bResult = GetTokenInformation (hToken, TokenUser, TokenBuffer,
+	                               sizeof (TokenBuffer), &cbToken);
+	CloseHandle (hToken);
+	if (!bResult)
+		return FALSE;
+
+	return InitializeAcl (lpAcl, cbAcl, ACL_REVISION) &&
+	       AddAccessAllowedAce (lpAcl, ACL_REVISION, GENERIC_ALL,
+	                            ((PTOKEN_USER)TokenBuffer)->User.Sid) &&
+	       InitializeSecurityDescriptor (lpSD, SECURITY_DESCRIPTOR_REVISION) &&
+	       SetSecurityDescriptorDacl (lpSD, TRUE, lpAcl, FALSE);
+}
+
+
+/*
+ * Serves requests until the server is killed. Only returns on errors.
+ */
+
+INT RunServer (LPCTSTR lpName)
+{
+	SECURITY_ATTRIBUTES sa = {sizeof(SECURITY_ATTRIBUTES), NULL, TRUE};
+	SECURITY_ATTRIBUTES saPipe = {sizeof(SECURITY_ATTRIBUTES), NULL, FALSE};
+	SECURITY_DESCRIPTOR sd;
+	DWORD  AclBuffer[64];
+	TCHAR  szPipe[MAX_PATH];
+	HANDLE hPipe;
+	HANDLE hInput;
+	HANDLE hOutput;
+	HANDLE hError;
+	DWORD  dwOpenMode = PIPE_ACCESS_DUPLEX;
+	DWORD  dwPipeMode = PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT;
+
+#ifdef FILE_FLAG_FIRST_PIPE_INSTANCE
+	/* fail if someone else got the name first */
+	dwOpenMode |= FILE_FLAG_FIRST_PIPE_INSTANCE;
+#endif
+#ifdef PIPE_REJECT_REMOTE_CLIENTS
+	dwPipeMode |= PIPE_REJECT_REMOTE_CLIENTS;
+#endif
+
+	GetPipeName (szPipe, lpName);
+
+	if (!InitPipeSecurity (&sd, (PACL)AclBuffer, sizeof (AclBuffer)))
+	{
+		ErrorMessage (GetLastError (), _T("Error creating server pipe"));
+		return 1;
+	}
+	saPipe.lpSecurityDescriptor = &sd;
+
+	/* the one instance of the pipe is kept for all requests, so the
+	 * name is never free for another process to take */
+	hPipe = CreateNamedPipe (szPipe, dwOpenMode, dwPipeMode, 1, SERVER_BUFFER_SIZE,
+	                         SERVER_BUFFER_SIZE, 0, &saPipe);
+	if (hPipe == INVALID_HANDLE_VALUE)
+	{
+		ErrorMessage (GetLastError (), _T("Error creating server pipe"));
+		return 1;
+	}
+
+	if (!bHeadless)
+		ConSetHeadless ();
+
+	hInput = CreateFile (_T("NUL"), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+	                     &sa, OPEN_EXISTING, 0, NULL);
+	hOutput = CreateOutputFile ();
+	hError = CreateOutputFile ();
+	if (hInput == INVALID_HANDLE_VALUE || hOutput == INVALID_HANDLE_VALUE ||
+	    hError == INVALID_HANDLE_VALUE)
+	{
+		ErrorMessage (GetLastError (), _T("Error creating server files"));
+		CloseHandle (hPipe);
+		return 1;
+	}
+
+	ConErrPrintf (_T("Serving commands on %s\n"), szPipe);
+	ConOutFlush ();
+
+	/* commands and the programs they start use these from now on */
+	SetStdHandle (STD_INPUT_HANDLE, hInput);
+	SetStdHandle (STD_OUTPUT_HANDLE, hOutput);
+	SetStdHandle (STD_ERROR_HANDLE, hError);
+
+	for (;;)
+	{
+		if (ConnectNamedPipe (hPipe, NULL) || GetLastError () == ERROR_PIPE_CONNECTED)
+		{
+			ServeRequest (hPipe, hOutput, hError);
+			FlushFileBuffers (hPipe);
+		}
+		else if (GetLastError () != ERROR_NO_DATA)
+		{
+			/* ERROR_NO_DATA is a client that is gone already */
+			break;
+		}
+
+		DisconnectNamedPipe (hPipe);
+	}
+
+	CloseHandle (hPipe);
+	return 1;
+}
+
+
+/*
+ * Sends a command to a server. Returns FALSE if there is no server to
+ * send it to, otherwise the errorlevel of the command is returned in
+ * lpnErrorLevel.
+ */
+
+BOOL RunClient (LPCTSTR lpName, LPCTSTR lpCommand, LPINT lpnErrorLevel)
+{
+	SERVERREPLY Reply;
+	TCHAR  szPipe[MAX_PATH];
+	TCHAR  szDirectory[MAX_PATH];
+	LPTSTR lpEnvironment;
+	LPTSTR lpRequest;
+	LPTSTR p;
+	HANDLE hPipe;
+	DWORD  nDirectory;
+	DWORD  nCommand;
+	DWORD  nEnvironment;
+	DWORD  cbRequest;
+	BOOL   bSuccess;
+
+	GetPipeName (szPipe, lpName);
+
+	for (;;)
+	{
+		hPipe = CreateFile (szPipe, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+		                    OPEN_EXISTING, 0, NULL);
+		if (hPipe != INVALID_HANDLE_VALUE)
+			break;
+
+		/* all instances busy, wait for the next one */
+		if (GetLastError () != ERROR_PIPE_BUSY ||
+		    !WaitNamedPipe (szPipe, SERVER_TIMEOUT))
+			return FALSE;
+	}
+
+	nDirectory = GetCurrentDirectory (MAX_PATH, szDirectory);
+	if (nDirectory == 0 || nDirectory >= MAX_PATH)
+		szDirectory[nDirectory = 0] = _T('\0');
+
+	lpEnvironment = (LPTSTR)GetEnvironmentStrings ();
+	nEnvironment = 0;
+	if (lpEnvironment != NULL)
+	{
+		for (p = lpEnvironment; *p; p += _tcslen (p) + 1)
+			;
+		nEnvironment = p - lpEnvironment;
+	}
+
+	nCommand = _tcslen (lpCommand);
+	cbRequest = (nDirectory + 1 + nCommand + 1 + nEnvironment + 2) * sizeof (TCHAR);
+
+	lpRequest = (LPTSTR)malloc (cbRequest);
+	if (lpRequest == NULL)
+	{
+		if (lpEnvironment != NULL)
+			FreeEnvironmentStrings (lpEnvironment);
+		CloseHandle (hPipe);
+		error_out_of_memory ();
+		*lpnErrorLevel = 1;
+		return TRUE;
+	}
+
+	p = lpRequest;
+	memcpy (p, szDirectory, (nDirectory + 1) * sizeof (TCHAR));
+	p += nDirectory + 1;
+	memcpy (p, lpCommand, (nCommand + 1) * sizeof (TCHAR));
+	p += nCommand + 1;
+	if (nEnvironment > 0)
+		memcpy (p, lpEnvironment, nEnvironment * sizeof (TCHAR));
+	p += nEnvironment;
+	p[0] = _T('\0');
+	p[1] = _T('\0');
+
+	if (lpEnvironment != NULL)
+		FreeEnvironmentStrings (lpEnvironment);
+
+	bSuccess = WriteAll (hPipe, &cbRequest, sizeof (DWORD)) &&
+	           WriteAll (hPipe, lpRequest, cbRequest) &&
+	           ReadAll (hPipe, &Reply, sizeof (SERVERREPLY)) &&
+	           CopyData (hPipe, GetStdHandle (STD_OUTPUT_HANDLE), Reply.cbOutput) &&
+	           CopyData (hPipe, GetStdHandle (STD_ERROR_HANDLE), Reply.cbError);
+
+	free (lpRequest);
+	CloseHandle (hPipe);
+
+	if (!bSuccess)
+	{
+		ConErrPrintf (_T("Lost connection to %s\n"), szPipe);
+		*lpnErrorLevel = 1;
+		return TRUE;
+	}
+
+	*lpnErrorLevel = (INT)Reply.dwErrorLevel;
+	return TRUE;
+}
+
+#endif /* FEATURE_SERVER */
+
+/* EOF */
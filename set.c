@@ -43,10 +43,6 @@
 #include "cmd.h"
 
 
-/* initial size of environment variable buffer */
-#define ENV_BUFFER_SIZE  1024
-
-
 INT cmd_set (LPTSTR cmd, LPTSTR param)
 {
 	LPTSTR p;
@@ -98,29 +94,19 @@ INT cmd_set (LPTSTR cmd, LPTSTR param)
 		{
 			p = NULL;
 		}
-		SetEnvironmentVariable (param, p);
+		SetEnvVar (param, p);
 	}
 	else
 	{
 		/* display environment variable */
-		LPTSTR pszBuffer;
-		DWORD dwBuffer;
+		LPCTSTR pszValue = GetEnvVar (param);
 
-		pszBuffer = (LPTSTR)malloc (ENV_BUFFER_SIZE * sizeof(TCHAR));
-		dwBuffer = GetEnvironmentVariable (param, pszBuffer, ENV_BUFFER_SIZE);
-		if (dwBuffer == 0)
+		if (pszValue == NULL)
 		{
 			ConErrPrintf (_T("CMD: Not in environment \"%s\"\n"), param);
 			return 0;
 		}
-		else if (dwBuffer > ENV_BUFFER_SIZE)
-		{
-			pszBuffer = (LPTSTR)realloc (pszBuffer, dwBuffer * sizeof (TCHAR));
-			GetEnvironmentVariable (param, pszBuffer, dwBuffer);
-		}
-		ConOutPrintf (_T("%s\n"), pszBuffer);
-
-		free (pszBuffer);
+		ConOutPuts ((LPTSTR)pszValue);
 
 		return 0;
 	}
@@ -0,0 +1,122 @@
+/*
+ *  SETLOCAL.C - setlocal and endlocal internal batch commands.
+ *
+ *
+ *  History:
+ *
+ *    17-Oct-2026
+ *        Started.
+ *
+ *  The scopes are kept by env.c. Each batch file may only close the
+ *  scopes it opened itself, and the ones it leaves open are closed when
+ *  it ends.
+ */
+
+#include "config.h"
+
+#ifdef INCLUDE_CMD_SETLOCAL
+
+#include <windows.h>
+#include <tchar.h>
+#include <string.h>
+
+#include "cmd.h"
+#include "batch.h"
+
+
+INT cmd_setlocal (LPTSTR cmd, LPTSTR param)
+{
+	LPTSTR *arg;
+	INT argc;
+	INT i;
+#ifdef FEATURE_DELAYED_EXPANSION
+	INT nDelayed = -1;   /* keep the setting of the enclosing scope */
+#endif
+
+#ifdef _DEBUG
+	DebugPrintf (_T("cmd_setlocal: (\'%s\', \'%s\')\n"), cmd, param);
+#endif
+
+	if (!_tcsncmp (param, _T("/?"), 2))
+	{
+		ConOutPuts (_T("Begins localization of environment changes in a batch file. Changes\n"
+					   "made after SETLOCAL are undone by the matching ENDLOCAL, or when the\n"
+					   "batch file ends.\n\n"
+					   "SETLOCAL [ENABLEEXTENSIONS | DISABLEEXTENSIONS]"
+#ifdef FEATURE_DELAYED_EXPANSION
+					   " [ENABLEDELAYEDEXPANSION | DISABLEDELAYEDEXPANSION]\n\n"
+					   "With delayed expansion, !variable! is replaced by the value of the\n"
+					   "variable when the command runs, and on each iteration of a FOR,\n"
+					   "instead of when the line is read"
+#endif
+					   ));
+		return 0;
+	}
+
+	arg = split (param, &argc, FALSE);
+	if (arg == NULL)
+		return 1;
+
+	for (i = 0; i < argc; i++)
+	{
+#ifdef FEATURE_DELAYED_EXPANSION
+		if (!_tcsicmp (arg[i], _T("enabledelayedexpansion")))
+			nDelayed = TRUE;
+		else if (!_tcsicmp (arg[i], _T("disabledelayedexpansion")))
+			nDelayed = FALSE;
+		else
+#endif
+		/* extensions are always on, the options are accepted for
+		 * compatibility */
+		if (_tcsicmp (arg[i], _T("enableextensions")) &&
+		    _tcsicmp (arg[i], _T("disableextensions")))
+		{
+			error_invalid_parameter_format (arg[i]);
+			freep (arg);
+			return 1;
+		}
+	}
+
+	freep (arg);
+
+	/* no effect outside batch files */
+	if (GetBatchFileContext () == NULL)
+		return 0;
+
+	if (!EnterEnvScope ())
+		return 1;
+
+#ifdef FEATURE_DELAYED_EXPANSION
+	if (nDelayed != -1)
+		SetDelayedExpansion (nDelayed);
+#endif
+
+	return 0;
+}
+
+
+INT cmd_endlocal (LPTSTR cmd, LPTSTR param)
+{
+	LPBATCH_CONTEXT b;
+
+#ifdef _DEBUG
+	DebugPrintf (_T("cmd_endlocal: (\'%s\', \'%s\')\n"), cmd, param);
+#endif
+
+	if (!_tcsncmp (param, _T("/?"), 2))
+	{
+		ConOutPuts (_T("Ends localization of environment changes in a batch file, restoring\n"
+					   "the variables as they were before the matching SETLOCAL.\n\n"
+					   "ENDLOCAL"));
+		return 0;
+	}
+
+	/* scopes of the calling batch files are left alone */
+	b = GetBatchFileContext ();
+	if (b != NULL && GetEnvScopeDepth () > b->nEnvScopes)
+		LeaveEnvScope ();
+
+	return 0;
+}
+
+#endif
@@ -24,18 +24,30 @@ INT cmd_start (LPTSTR first, LPTSTR rest)
 {
 	TCHAR szFullName[MAX_PATH];
 	BOOL bWait = FALSE;
+	BOOL bBackground = FALSE;
 	TCHAR *param;
 
 	if (_tcsncmp (rest, _T("/?"), 2) == 0)
 	{
 		ConOutPuts (_T("Starts a command.\n\n"
-				   "START command \n\n"
+				   "START [/B] command \n\n"
+				   "  /B          Runs the command as a background job in this console.\n"
 				   "  command     Specifies the command to run.\n\n"
 				   "At the moment all commands are started asynchronously.\n"));
 
 		return 0;
 	}
 
+#ifdef INCLUDE_CMD_JOBS
+	if (!_tcsnicmp (rest, _T("/b"), 2) && (rest[2] == _T('\0') || _istspace (rest[2])))
+	{
+		bBackground = TRUE;
+		rest += 2;
+		while (_istspace (*rest))
+			rest++;
+	}
+#endif
+
 	/* check for a drive change */
 	if (!_tcscmp (first + 1, _T(":")) && _istalpha (*first))
 	{
@@ -88,7 +100,7 @@ INT cmd_start (LPTSTR first, LPTSTR rest)
 		DebugPrintf (_T("[EXEC: %s %s]\n"), szFullName, rest);
 #endif
 		/* build command line for CreateProcess() */
-		_tcscpy (szFullCmdLine, first);
+		_tcscpy (szFullCmdLine, rest);
 		if( param )
 		  {
 		    _tcscat(szFullCmdLine, _T(" ") );
@@ -101,24 +113,61 @@ INT cmd_start (LPTSTR first, LPTSTR rest)
 		stui.dwFlags = STARTF_USESHOWWINDOW;
 		stui.wShowWindow = SW_SHOWDEFAULT;
 			
-		if (CreateProcess (szFullName, szFullCmdLine, NULL, NULL, FALSE,
-						   CREATE_NEW_CONSOLE, NULL, NULL, &stui, &prci))
+#ifdef INCLUDE_CMD_JOBS
+		if (bBackground)
+			ThrottleJobs ();
+#endif
+
+		ConOutFlush ();
+#ifdef FEATURE_VIRTUAL_TERMINAL
+		ConSuspendVirtualTerminal ();
+#endif
+
+		if (CreateProcess (szFullName, szFullCmdLine, NULL, NULL, bBackground,
+						   bBackground ? CREATE_NEW_PROCESS_GROUP : CREATE_NEW_CONSOLE,
+						   NULL, NULL, &stui, &prci))
 		{
+#ifdef INCLUDE_CMD_JOBS
+			if (bBackground)
+			{
+				AddJob (prci.hProcess, prci.dwProcessId, szFullCmdLine);
+				CloseHandle (prci.hThread);
+#ifdef FEATURE_VIRTUAL_TERMINAL
+				ConResumeVirtualTerminal ();
+#endif
+				return 0;
+			}
+#endif
 			if (bWait)
 			{
 				DWORD dwExitCode;
 				WaitForSingleObject (prci.hProcess, INFINITE);
 				GetExitCodeProcess (prci.hProcess, &dwExitCode);
 				nErrorLevel = (INT)dwExitCode;
+#ifdef FEATURE_TELEMETRY
+				RecordProcessTelemetry (prci.hProcess, szFullCmdLine, dwExitCode, TRUE);
+#endif
 			}
+#ifdef FEATURE_TELEMETRY
+			else
+			{
+				/* recorded once it has finished */
+				WatchProcessTelemetry (prci.hProcess, szFullCmdLine);
+				prci.hProcess = NULL;
+			}
+#endif
 			CloseHandle (prci.hThread);
-			CloseHandle (prci.hProcess);
+			if (prci.hProcess != NULL)
+				CloseHandle (prci.hProcess);
 		}
 		else
 		{
 			ErrorMessage (GetLastError (),
 						  _T("Error executing CreateProcess()!!\n"));
 		}
+#ifdef FEATURE_VIRTUAL_TERMINAL
+		ConResumeVirtualTerminal ();
+#endif
 	}
 
 	return 0;
@@ -0,0 +1,299 @@
+/*
+ *  TELEMETRY.C - resource usage of external commands.
+ *
+ *
+ *  History:
+ *
+ *    17-Oct-2026
+ *        Started.
+ *
+ *  After the shell has waited for an external command, its wall time,
+ *  CPU times, peak working set and I/O counters are kept and can be read
+ *  through the dynamic variables
+ *
+ *    %CMD_LAST_MS%           wall time in milliseconds
+ *    %CMD_LAST_USER_MS%      user CPU time in milliseconds
+ *    %CMD_LAST_KERNEL_MS%    kernel CPU time in milliseconds
+ *    %CMD_LAST_PEAK_KB%      peak working set in KB
+ *    %CMD_LAST_READ_BYTES%   bytes read
+ *    %CMD_LAST_WRITE_BYTES%  bytes written
+ *
+ *  If the environment variable CMD_TELEMETRY_LOG names a file, a tab
+ *  separated record is appended to it for every command. Programs the
+ *  shell doesn't wait for (GUI programs, background jobs) are logged when
+ *  they are reaped, but don't change the CMD_LAST_* variables.
+ */
+
+#include "config.h"
+
+#ifdef FEATURE_TELEMETRY
+#include <windows.h>
+#include <tchar.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "cmd.h"
+
+
+/* the structures of psapi.h, which isn't available everywhere */
+typedef struct tagCMD_PROCESS_MEMORY_COUNTERS
+{
+	DWORD  cb;
+	DWORD  PageFaultCount;
+	SIZE_T PeakWorkingSetSize;
+	SIZE_T WorkingSetSize;
+	SIZE_T QuotaPeakPagedPoolUsage;
+	SIZE_T QuotaPagedPoolUsage;
+	SIZE_T QuotaPeakNonPagedPoolUsage;
+	SIZE_T QuotaNonPagedPoolUsage;
+	SIZE_T PagefileUsage;
+	SIZE_T PeakPagefileUsage;
+} CMD_PROCESS_MEMORY_COUNTERS;
+
+typedef BOOL (WINAPI *GetProcessMemoryInfoProc)(HANDLE, CMD_PROCESS_MEMORY_COUNTERS *, DWORD);
+typedef BOOL (WINAPI *GetProcessIoCountersProc)(HANDLE, PIO_COUNTERS);
+
+
+typedef struct tagTELEMETRY
+{
+	ULONGLONG ullWallMs;
+	ULONGLONG ullUserMs;
+	ULONGLONG ullKernelMs;
+	ULONGLONG ullPeakKb;
+	ULONGLONG ullReadBytes;
+	ULONGLONG ullWriteBytes;
+} TELEMETRY;
+
+
+static TELEMETRY Last;
+static BOOL bLastValid = FALSE;
+
+/* programs which were not waited for, recorded once they have finished */
+static HANDLE hWatched[MAXIMUM_WAIT_OBJECTS];
+static LPTSTR lpWatchedCommand[MAXIMUM_WAIT_OBJECTS];
+static INT    nWatched = 0;
+
+/* Some people like to run ReactOS cmd.exe on Win98, which has neither
+ * of these functions. So they are looked up at run time. */
+static GetProcessMemoryInfoProc GetProcessMemoryInfoPtr = NULL;
+static GetProcessIoCountersProc GetProcessIoCountersPtr = NULL;
+static BOOL bFunctionsChecked = FALSE;
+
+
+static ULONGLONG FileTimeToMs (FILETIME *ft)
+{
+	return (((ULONGLONG)ft->dwHighDateTime << 32) | ft->dwLowDateTime) / 10000;
+}
+
+
+static VOID CheckFunctions (VOID)
+{
+	HMODULE hModule;
+
+	bFunctionsChecked = TRUE;
+
+	hModule = GetModuleHandle (_T("kernel32.dll"));
+	if (hModule != NULL)
+		GetProcessIoCountersPtr = (GetProcessIoCountersProc)
+		                          GetProcAddress (hModule, "GetProcessIoCounters");
+
+	hModule = LoadLibrary (_T("psapi.dll"));
+	if (hModule != NULL)
+		GetProcessMemoryInfoPtr = (GetProcessMemoryInfoProc)
+		                          GetProcAddress (hModule, "GetProcessMemoryInfo");
+}
+
+
+static VOID LogTelemetry (TELEMETRY *lpTel, LPCTSTR lpCommand, DWORD dwExitCode)
+{
+	TCHAR  szLogFile[MAX_PATH];
+	TCHAR  szRecord[CMDLINE_LENGTH + 256];
+	SYSTEMTIME st;
+	HANDLE hFile;
+	DWORD  dwWritten;
+	INT    len;
+#ifdef _UNICODE
+	CHAR   szAnsi[CMDLINE_LENGTH + 256];
+#endif
+
+	if (GetEnvironmentVariable (_T("CMD_TELEMETRY_LOG"), szLogFile, MAX_PATH) == 0 ||
+	    _tcslen (szLogFile) >= MAX_PATH)
+		return;
+
+	hFile = CreateFile (szLogFile, FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE,
+	                    NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return;
+
+	len = 0;
+	if (GetLastError () != ERROR_ALREADY_EXISTS)
+	{
+		len = _stprintf (szRecord, _T("time\twall_ms\tuser_ms\tkernel_ms\tpeak_kb\t")
+		                           _T("read_bytes\twrite_bytes\texit\tcommand\r\n"));
+	}
+
+	GetLocalTime (&st);
+	len += _stprintf (szRecord + len,
+	                  _T("%04d-%02d-%02d %02d:%02d:%02d.%03d\t")
+	                  _T("%I64u\t%I64u\t%I64u\t%I64u\t%I64u\t%I64u\t%lu\t%.*s\r\n"),
+	                  st.wYear, st.wMonth, st.wDay,
+	                  st.wHour, st.wMinute, st.wSecond, st.wMilliseconds,
+	                  lpTel->ullWallMs, lpTel->ullUserMs, lpTel->ullKernelMs,
+	                  lpTel->ullPeakKb, lpTel->ullReadBytes, lpTel->ullWriteBytes,
+	                  dwExitCode, CMDLINE_LENGTH, lpCommand);
+
+#ifdef _UNICODE
+	len = WideCharToMultiByte (CP_ACP, 0, szRecord, len, szAnsi, sizeof (szAnsi), NULL, NULL);
+	WriteFile (hFile, szAnsi, len, &dwWritten, NULL);
+#else
+	WriteFile (hFile, szRecord, len, &dwWritten, NULL);
+#endif
+
+	CloseHandle (hFile);
+}
+
+
+/*
+ * Collects the resource usage of a finished child process. Only if
+ * bLast is TRUE, i.e. the shell waited for it, it becomes the one the
+ * CMD_LAST_* variables report.
+ */
+
+VOID RecordProcessTelemetry (HANDLE hProcess, LPCTSTR lpCommand, DWORD dwExitCode, BOOL bLast)
+{
+	FILETIME ftCreation, ftExit, ftKernel, ftUser;
+	CMD_PROCESS_MEMORY_COUNTERS pmc;
+	IO_COUNTERS io;
+	TELEMETRY tel;
+
+	if (!GetProcessTimes (hProcess, &ftCreation, &ftExit, &ftKernel, &ftUser))
+		return;
+
+	if (!bFunctionsChecked)
+		CheckFunctions ();
+
+	memset (&tel, 0, sizeof (TELEMETRY));
+	tel.ullWallMs = FileTimeToMs (&ftExit) - FileTimeToMs (&ftCreation);
+	tel.ullUserMs = FileTimeToMs (&ftUser);
+	tel.ullKernelMs = FileTimeToMs (&ftKernel);
+
+	pmc.cb = sizeof (pmc);
+	if (GetProcessMemoryInfoPtr != NULL &&
+	    GetProcessMemoryInfoPtr (hProcess, &pmc, sizeof (pmc)))
+		tel.ullPeakKb = pmc.PeakWorkingSetSize / 1024;
+
+	if (GetProcessIoCountersPtr != NULL &&
+	    GetProcessIoCountersPtr (hProcess, &io))
+	{
+		tel.ullReadBytes = io.ReadTransferCount;
+		tel.ullWriteBytes = io.WriteTransferCount;
+	}
+
+	if (bLast)
+	{
+		Last = tel;
+		bLastValid = TRUE;
+	}
+
+	LogTelemetry (&tel, lpCommand, dwExitCode);
+}
+
+
+/*
+ * Logs the programs left running by WatchProcessTelemetry which have
+ * finished since the last call.
+ */
+
+VOID ReapProcessTelemetry (VOID)
+{
+	DWORD dwExitCode;
+	INT i = 0;
+
+	while (i < nWatched)
+	{
+		if (WaitForSingleObject (hWatched[i], 0) != WAIT_OBJECT_0)
+		{
+			i++;
+			continue;
+		}
+
+		if (GetExitCodeProcess (hWatched[i], &dwExitCode))
+			RecordProcessTelemetry (hWatched[i], lpWatchedCommand[i], dwExitCode, FALSE);
+
+		CloseHandle (hWatched[i]);
+		free (lpWatchedCommand[i]);
+
+		nWatched--;
+		hWatched[i] = hWatched[nWatched];
+		lpWatchedCommand[i] = lpWatchedCommand[nWatched];
+	}
+}
+
+
+/*
+ * Keeps a program which isn't waited for until it has finished.
+ * The handle is owned by the watch list afterwards.
+ */
+
+VOID WatchProcessTelemetry (HANDLE hProcess, LPCTSTR lpCommand)
+{
+	LPTSTR lpCopy;
+
+	if (nWatched == MAXIMUM_WAIT_OBJECTS)
+		ReapProcessTelemetry ();
+
+	lpCopy = (nWatched < MAXIMUM_WAIT_OBJECTS) ? _tcsdup (lpCommand) : NULL;
+	if (lpCopy == NULL)
+	{
+		/* no room to keep it, it goes unlogged */
+		CloseHandle (hProcess);
+		return;
+	}
+
+	hWatched[nWatched] = hProcess;
+	lpWatchedCommand[nWatched++] = lpCopy;
+}
+
+
+/*
+ * Gets the value of one of the CMD_LAST_* dynamic variables.
+ * Returns FALSE if lpName isn't one of them or no command ran yet.
+ */
+
+BOOL GetTelemetryVariable (LPCTSTR lpName, LPTSTR lpBuffer, INT nSize)
+{
+	ULONGLONG ullValue;
+	TCHAR szValue[24];
+
+	if (!bLastValid || _tcsnicmp (lpName, _T("CMD_LAST_"), 9))
+		return FALSE;
+
+	lpName += 9;
+
+	if (!_tcsicmp (lpName, _T("MS")))
+		ullValue = Last.ullWallMs;
+	else if (!_tcsicmp (lpName, _T("USER_MS")))
+		ullValue = Last.ullUserMs;
+	else if (!_tcsicmp (lpName, _T("KERNEL_MS")))
+		ullValue = Last.ullKernelMs;
+	else if (!_tcsicmp (lpName, _T("PEAK_KB")))
+		ullValue = Last.ullPeakKb;
+	else if (!_tcsicmp (lpName, _T("READ_BYTES")))
+		ullValue = Last.ullReadBytes;
+	else if (!_tcsicmp (lpName, _T("WRITE_BYTES")))
+		ullValue = Last.ullWriteBytes;
+	else
+		return FALSE;
+
+	_stprintf (szValue, _T("%I64u"), ullValue);
+	if ((INT)_tcslen (szValue) >= nSize)
+		return FALSE;
+
+	_tcscpy (lpBuffer, szValue);
+	return TRUE;
+}
+
+#endif /* FEATURE_TELEMETRY */
+
+/* EOF */
@@ -141,6 +141,8 @@ INT cmd_time (LPTSTR cmd, LPTSTR param)
 	BOOL   bPrompt = TRUE;
 	INT    nTimeString = -1;
 
+	LoadLocale ();
+
 	if (!_tcsncmp (param, _T("/?"), 2))
 	{
 		ConOutPuts (_T("Displays or sets the system time.\n"
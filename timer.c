@@ -103,6 +103,8 @@ INT CommandTimer (LPTSTR cmd, LPTSTR param)
 
 	INT i;
 
+	LoadLocale ();
+
 	if (_tcsncmp (param, _T("/?"), 2) == 0)
 	{
 		ConOutPrintf(_T(
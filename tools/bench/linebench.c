@@ -0,0 +1,262 @@
+/*
+ *  LINEBENCH.C - per-line dispatch benchmark of the shell.
+ *
+ *
+ *  History:
+ *
+ *    17-Oct-2026
+ *        Started.
+ *
+ *  Writes a batch file of many lines of one command and times
+ *  "cmd /c file" for each shell given, so two builds can be compared:
+ *
+ *    linebench [/N:lines] [/R:runs] cmd1.exe [cmd2.exe ...]
+ *
+ *  The time of an empty batch file is taken off, which leaves the cost
+ *  of reading, parsing, dispatching and running the lines. A label line
+ *  is read but not dispatched, so the difference to it is mostly the
+ *  lookup in the internal command table and the command itself. The
+ *  best of the runs is reported in microseconds per line.
+ *
+ *  The shells run with their standard handles on NUL.
+ *
+ *  It is a standalone program:
+ *
+ *    gcc -O2 -o linebench.exe linebench.c
+ *    cl /O2 linebench.c
+ */
+
+#include <windows.h>
+#include <tchar.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define DEFAULT_LINES  20000
+#define DEFAULT_RUNS   5
+#define MAX_SHELLS     8
+
+
+typedef struct tagBENCHCASE
+{
+	LPCTSTR lpName;
+	LPCSTR  lpLine;    /* written to the file as is */
+} BENCHCASE;
+
+/* internal commands from the start, middle and end of the table, a
+ * CMD_SPECIAL form, and a word which is no command at all */
+static BENCHCASE Cases[] =
+{
+	{_T("label"),     ":bench"},
+	{_T("echo"),      "echo bench"},
+	{_T("rem"),       "rem bench"},
+	{_T("verify"),    "verify on"},
+	{_T("cd."),       "cd."},
+	{_T("not found"), "benchnosuchcommand"}
+};
+
+#define NUM_CASES  ((INT)(sizeof (Cases) / sizeof (Cases[0])))
+
+
+static LONGLONG llFrequency;
+
+
+/*
+ * Writes the batch file with nLines times lpLine, or none if lpLine
+ * is NULL.
+ */
+
+static BOOL
+WriteBatchFile (LPCTSTR lpFileName, LPCSTR lpLine, INT nLines)
+{
+	FILE *fp;
+	INT i;
+
+	fp = _tfopen (lpFileName, _T("wb"));
+	if (fp == NULL)
+		return FALSE;
+
+	fputs ("@echo off\r\n", fp);
+	for (i = 0; lpLine != NULL && i < nLines; i++)
+	{
+		fputs (lpLine, fp);
+		fputs ("\r\n", fp);
+	}
+
+	return (fclose (fp) == 0);
+}
+
+
+/*
+ * Runs "shell /c file" once and returns the wall time in seconds, or a
+ * negative value if the shell could not be started.
+ */
+
+static double
+RunShell (LPCTSTR lpShell, LPCTSTR lpFileName, HANDLE hNul)
+{
+	TCHAR szCmdLine[2 * MAX_PATH + 16];
+	PROCESS_INFORMATION prci;
+	STARTUPINFO stui;
+	LARGE_INTEGER liStart, liEnd;
+
+	_stprintf (szCmdLine, _T("\"%s\" /c \"%s\""), lpShell, lpFileName);
+
+	memset (&stui, 0, sizeof (STARTUPINFO));
+	stui.cb = sizeof (STARTUPINFO);
+	stui.dwFlags = STARTF_USESTDHANDLES;
+	stui.hStdInput = hNul;
+	stui.hStdOutput = hNul;
+	stui.hStdError = hNul;
+
+	QueryPerformanceCounter (&liStart);
+
+	if (!CreateProcess (lpShell, szCmdLine, NULL, NULL, TRUE, 0,
+	                    NULL, NULL, &stui, &prci))
+		return -1.0;
+
+	WaitForSingleObject (prci.hProcess, INFINITE);
+	QueryPerformanceCounter (&liEnd);
+
+	CloseHandle (prci.hThread);
+	CloseHandle (prci.hProcess);
+
+	return (double)(liEnd.QuadPart - liStart.QuadPart) / (double)llFrequency;
+}
+
+
+/*
+ * Returns the best time of nRuns runs, or a negative value on error.
+ */
+
+static double
+BestOfRuns (LPCTSTR lpShell, LPCTSTR lpFileName, HANDLE hNul, INT nRuns)
+{
+	double dBest = -1.0;
+	double d;
+	INT i;
+
+	for (i = 0; i < nRuns; i++)
+	{
+		d = RunShell (lpShell, lpFileName, hNul);
+		if (d < 0.0)
+			return d;
+		if (dBest < 0.0 || d < dBest)
+			dBest = d;
+	}
+
+	return dBest;
+}
+
+
+static VOID
+Usage (VOID)
+{
+	_tprintf (_T("Times the lines of a batch file in one or more shells.\n\n")
+	          _T("LINEBENCH [/N:lines] [/R:runs] shell [shell ...]\n\n")
+	          _T("  /N:lines  Lines per batch file (default %d).\n")
+	          _T("  /R:runs   Runs of each batch file, the best one counts (default %d).\n")
+	          _T("  shell     Path of a cmd.exe to time.\n"),
+	          DEFAULT_LINES, DEFAULT_RUNS);
+}
+
+
+int _tmain (int argc, TCHAR *argv[])
+{
+	SECURITY_ATTRIBUTES sa = {sizeof (SECURITY_ATTRIBUTES), NULL, TRUE};
+	LPCTSTR lpShells[MAX_SHELLS];
+	TCHAR szFileName[MAX_PATH];
+	LARGE_INTEGER liFrequency;
+	double dEmpty[MAX_SHELLS];
+	double d;
+	HANDLE hNul;
+	INT nShells = 0;
+	INT nLines = DEFAULT_LINES;
+	INT nRuns = DEFAULT_RUNS;
+	INT nLen;
+	INT i, j;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!_tcscmp (argv[i], _T("/?")))
+		{
+			Usage ();
+			return 0;
+		}
+		else if (!_tcsnicmp (argv[i], _T("/N:"), 3))
+			nLines = _ttoi (argv[i] + 3);
+		else if (!_tcsnicmp (argv[i], _T("/R:"), 3))
+			nRuns = _ttoi (argv[i] + 3);
+		else if (nShells < MAX_SHELLS)
+			lpShells[nShells++] = argv[i];
+	}
+
+	if (nShells == 0 || nLines <= 0 || nRuns <= 0)
+	{
+		Usage ();
+		return 1;
+	}
+
+	if (!QueryPerformanceFrequency (&liFrequency))
+		return 1;
+	llFrequency = liFrequency.QuadPart;
+
+	nLen = GetTempPath (MAX_PATH, szFileName);
+	if (nLen == 0 || nLen + 16 > MAX_PATH)
+		return 1;
+	_tcscpy (szFileName + nLen, _T("linebench.bat"));
+
+	hNul = CreateFile (_T("NUL"), GENERIC_READ | GENERIC_WRITE,
+	                   FILE_SHARE_READ | FILE_SHARE_WRITE, &sa,
+	                   OPEN_EXISTING, 0, NULL);
+	if (hNul == INVALID_HANDLE_VALUE)
+		return 1;
+
+	/* the start up and exit of each shell, taken off below */
+	if (!WriteBatchFile (szFileName, NULL, 0))
+	{
+		_ftprintf (stderr, _T("Can't write %s\n"), szFileName);
+		return 1;
+	}
+	for (j = 0; j < nShells; j++)
+	{
+		dEmpty[j] = BestOfRuns (lpShells[j], szFileName, hNul, nRuns);
+		if (dEmpty[j] < 0.0)
+		{
+			_ftprintf (stderr, _T("Can't run %s\n"), lpShells[j]);
+			return 1;
+		}
+	}
+
+	for (j = 0; j < nShells; j++)
+		_tprintf (_T("[%d] %s, empty batch file %.2f ms\n"), j + 1, lpShells[j], dEmpty[j] * 1000.0);
+	_tprintf (_T("\n%d lines, best of %d runs, microseconds per line\n\n%-12s"),
+	          nLines, nRuns, _T("command"));
+	for (j = 0; j < nShells; j++)
+		_tprintf (_T("%10s[%d]"), _T(""), j + 1);
+	_tprintf (_T("\n"));
+
+	for (i = 0; i < NUM_CASES; i++)
+	{
+		if (!WriteBatchFile (szFileName, Cases[i].lpLine, nLines))
+		{
+			_ftprintf (stderr, _T("Can't write %s\n"), szFileName);
+			break;
+		}
+
+		_tprintf (_T("%-12s"), Cases[i].lpName);
+		for (j = 0; j < nShells; j++)
+		{
+			d = BestOfRuns (lpShells[j], szFileName, hNul, nRuns);
+			_tprintf (_T("%13.3f"), (d - dEmpty[j]) * 1000000.0 / nLines);
+		}
+		_tprintf (_T("\n"));
+	}
+
+	DeleteFile (szFileName);
+	CloseHandle (hNul);
+
+	return 0;
+}
+
+/* EOF */
@@ -0,0 +1,213 @@
+/*
+ *  STARTBENCH.C - startup latency benchmark of the shell.
+ *
+ *
+ *  History:
+ *
+ *    17-Oct-2026
+ *        Started.
+ *
+ *  Starts "cmd /c command" many times for each shell given and reports
+ *  the time from CreateProcess until the shell has exited:
+ *
+ *    startbench [/R:runs] [/C:command] [/NUL] cmd1.exe [cmd2.exe ...]
+ *
+ *  The shells take turns, so a change in the load of the machine hits
+ *  all of them alike. By default the shells get the console of the
+ *  benchmark, which is what a /C command from a build tool run in a
+ *  console sees; with /NUL their standard handles are on NUL instead.
+ *
+ *  It is a standalone program:
+ *
+ *    gcc -O2 -o startbench.exe startbench.c
+ *    cl /O2 startbench.c
+ */
+
+#include <windows.h>
+#include <tchar.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define DEFAULT_RUNS     200
+#define DEFAULT_COMMAND  _T("rem")
+#define MAX_SHELLS       8
+
+
+static LONGLONG llFrequency;
+
+
+/*
+ * Runs "shell /c command" once and returns the wall time in
+ * milliseconds, or a negative value if the shell could not be started.
+ */
+
+static double
+RunShell (LPCTSTR lpShell, LPCTSTR lpCommand, HANDLE hNul)
+{
+	TCHAR szCmdLine[MAX_PATH + 1024];
+	PROCESS_INFORMATION prci;
+	STARTUPINFO stui;
+	LARGE_INTEGER liStart, liEnd;
+
+	_sntprintf (szCmdLine, sizeof (szCmdLine) / sizeof (TCHAR) - 1,
+	            _T("\"%s\" /c %s"), lpShell, lpCommand);
+	szCmdLine[sizeof (szCmdLine) / sizeof (TCHAR) - 1] = _T('\0');
+
+	memset (&stui, 0, sizeof (STARTUPINFO));
+	stui.cb = sizeof (STARTUPINFO);
+	if (hNul != INVALID_HANDLE_VALUE)
+	{
+		stui.dwFlags = STARTF_USESTDHANDLES;
+		stui.hStdInput = hNul;
+		stui.hStdOutput = hNul;
+		stui.hStdError = hNul;
+	}
+
+	QueryPerformanceCounter (&liStart);
+
+	if (!CreateProcess (lpShell, szCmdLine, NULL, NULL, TRUE, 0,
+	                    NULL, NULL, &stui, &prci))
+		return -1.0;
+
+	WaitForSingleObject (prci.hProcess, INFINITE);
+	QueryPerformanceCounter (&liEnd);
+
+	CloseHandle (prci.hThread);
+	CloseHandle (prci.hProcess);
+
+	return (double)(liEnd.QuadPart - liStart.QuadPart) * 1000.0 / (double)llFrequency;
+}
+
+
+static int
+CompareTimes (const void *p1, const void *p2)
+{
+	double d1 = *(const double *)p1;
+	double d2 = *(const double *)p2;
+
+	return (d1 < d2) ? -1 : (d1 > d2);
+}
+
+
+static VOID
+Usage (VOID)
+{
+	_tprintf (_T("Times the startup of one or more shells.\n\n")
+	          _T("STARTBENCH [/R:runs] [/C:command] [/NUL] shell [shell ...]\n\n")
+	          _T("  /R:runs     Runs of each shell (default %d).\n")
+	          _T("  /C:command  Command run by each shell (default %s).\n")
+	          _T("  /NUL        Puts the standard handles of the shells on NUL.\n")
+	          _T("  shell       Path of a cmd.exe to time.\n"),
+	          DEFAULT_RUNS, DEFAULT_COMMAND);
+}
+
+
+int _tmain (int argc, TCHAR *argv[])
+{
+	SECURITY_ATTRIBUTES sa = {sizeof (SECURITY_ATTRIBUTES), NULL, TRUE};
+	LPCTSTR lpShells[MAX_SHELLS];
+	LPCTSTR lpCommand = DEFAULT_COMMAND;
+	LARGE_INTEGER liFrequency;
+	double *lpTimes[MAX_SHELLS];
+	double dSum;
+	HANDLE hNul = INVALID_HANDLE_VALUE;
+	BOOL bNul = FALSE;
+	INT nShells = 0;
+	INT nRuns = DEFAULT_RUNS;
+	INT i, j;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!_tcscmp (argv[i], _T("/?")))
+		{
+			Usage ();
+			return 0;
+		}
+		else if (!_tcsnicmp (argv[i], _T("/R:"), 3))
+			nRuns = _ttoi (argv[i] + 3);
+		else if (!_tcsnicmp (argv[i], _T("/C:"), 3))
+			lpCommand = argv[i] + 3;
+		else if (!_tcsicmp (argv[i], _T("/NUL")))
+			bNul = TRUE;
+		else if (nShells < MAX_SHELLS)
+			lpShells[nShells++] = argv[i];
+	}
+
+	if (nShells == 0 || nRuns <= 0)
+	{
+		Usage ();
+		return 1;
+	}
+
+	if (!QueryPerformanceFrequency (&liFrequency))
+		return 1;
+	llFrequency = liFrequency.QuadPart;
+
+	if (bNul)
+	{
+		hNul = CreateFile (_T("NUL"), GENERIC_READ | GENERIC_WRITE,
+		                   FILE_SHARE_READ | FILE_SHARE_WRITE, &sa,
+		                   OPEN_EXISTING, 0, NULL);
+		if (hNul == INVALID_HANDLE_VALUE)
+			return 1;
+	}
+
+	for (j = 0; j < nShells; j++)
+	{
+		lpTimes[j] = (double *)malloc (nRuns * sizeof (double));
+		if (lpTimes[j] == NULL)
+		{
+			_ftprintf (stderr, _T("Out of memory\n"));
+			return 1;
+		}
+	}
+
+	/* one run of each first, so all of them are in the file cache */
+	for (j = 0; j < nShells; j++)
+	{
+		if (RunShell (lpShells[j], lpCommand, hNul) < 0.0)
+		{
+			_ftprintf (stderr, _T("Can't run %s\n"), lpShells[j]);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < nRuns; i++)
+	{
+		for (j = 0; j < nShells; j++)
+		{
+			lpTimes[j][i] = RunShell (lpShells[j], lpCommand, hNul);
+			if (lpTimes[j][i] < 0.0)
+			{
+				_ftprintf (stderr, _T("Can't run %s\n"), lpShells[j]);
+				return 1;
+			}
+		}
+	}
+
+	_tprintf (_T("/C %s, %d runs, milliseconds\n\n"), lpCommand, nRuns);
+	_tprintf (_T("%10s%10s%10s%10s  shell\n"), _T("min"), _T("median"), _T("mean"), _T("max"));
+
+	for (j = 0; j < nShells; j++)
+	{
+		qsort (lpTimes[j], nRuns, sizeof (double), CompareTimes);
+
+		dSum = 0.0;
+		for (i = 0; i < nRuns; i++)
+			dSum += lpTimes[j][i];
+
+		_tprintf (_T("%10.3f%10.3f%10.3f%10.3f  %s\n"),
+		          lpTimes[j][0], lpTimes[j][nRuns / 2], dSum / nRuns,
+		          lpTimes[j][nRuns - 1], lpShells[j]);
+
+		free (lpTimes[j]);
+	}
+
+	if (hNul != INVALID_HANDLE_VALUE)
+		CloseHandle (hNul);
+
+	return 0;
+}
+
+/* EOF */
@@ -0,0 +1,323 @@
+/*
+ *  TRACE.C - event trace of the shell.
+ *
+ *
+ *  History:
+ *
+ *    17-Oct-2026
+ *        Started.
+ *
+ *  With /TRACE:file the shell records what it does as fixed size events:
+ *  command lines parsed, commands run, internal commands dispatched,
+ *  child processes started and finished, redirections opened and closed,
+ *  batch files entered and left, GOTO and CALL. The events are kept in a
+ *  buffer which is appended to the file as one block when it is full and
+ *  on exit.
+ *
+ *  The file name is passed on to nested shells in CMD_TRACE, and they
+ *  append their blocks to the same file. As all time stamps come from
+ *  the performance counter, /TRACEJSON:file converts the file into the
+ *  trace_event JSON format of Chrome with all processes on one timeline.
+ */
+
+#include "config.h"
+
+#ifdef FEATURE_TRACE
+
+#include <windows.h>
+#include <tchar.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "cmd.h"
+
+
+#define TRACE_MAGIC         0x42525443  /* "CTRB" */
+#define TRACE_BUFFER_EVENTS 1024
+#define TRACE_NAME_LENGTH   45
+
+
+/* 64 bytes each */
+typedef struct tagTRACEEVENT
+{
+	LONGLONG llTime;         /* performance counter */
+	DWORD    dwThread;
+	DWORD    dwArg;          /* meaning depends on wType */
+	WORD     wType;          /* TRACE_* */
+	CHAR     cPhase;         /* as in trace_event: 'B', 'E', 'b', 'e' or 'i' */
+	CHAR     szName[TRACE_NAME_LENGTH]; /* truncated, NUL terminated */
+} TRACEEVENT, *LPTRACEEVENT;
+
+/* a block of events as written by one process */
+typedef struct tagTRACEBLOCK
+{
+	DWORD    dwMagic;
+	DWORD    dwProcess;
+	LONGLONG llFrequency;    /* of the performance counter */
+	DWORD    dwEvents;       /* number of events following */
+	DWORD    dwReserved;
+} TRACEBLOCK, *LPTRACEBLOCK;
+
+
+BOOL bTrace = FALSE;
+
+static HANDLE hTraceFile = INVALID_HANDLE_VALUE;
+
+/* the header is written along with the events */
+static struct
+{
+	TRACEBLOCK Block;
+	TRACEEVENT Events[TRACE_BUFFER_EVENTS];
+} TraceBuffer;
+
+
+/* categories in the JSON file, indexed by TRACE_* */
+static LPCSTR lpCategory[] =
+{
+	"parse", "command", "internal", "process",
+	"redirect", "redirect", "batch", "goto", "call"
+};
+
+
+/*
+ * Appends the buffered events to the file. Each block is written with
+ * a single call, so blocks of nested shells don't mix.
+ */
+
+static VOID FlushTrace (VOID)
+{
+	DWORD dwWritten;
+
+	if (TraceBuffer.Block.dwEvents == 0)
+		return;
+
+	WriteFile (hTraceFile, &TraceBuffer,
+	           sizeof (TRACEBLOCK) + TraceBuffer.Block.dwEvents * sizeof (TRACEEVENT),
+	           &dwWritten, NULL);
+
+	TraceBuffer.Block.dwEvents = 0;
+}
+
+
+/*
+ * Starts tracing into lpFileName. A nested shell (bAppend) adds to the
+ * file, else it is started anew.
+ */
+
+VOID TraceStart (LPCTSTR lpFileName, BOOL bAppend)
+{
+	TCHAR szFullName[MAX_PATH];
+	LARGE_INTEGER liFrequency;
+	LPTSTR lpFilePart;
+
+	TraceStop ();
+
+	if (!GetFullPathName (lpFileName, MAX_PATH, szFullName, &lpFilePart) ||
+	    !QueryPerformanceFrequency (&liFrequency))
+		return;
+
+	hTraceFile = CreateFile (szFullName, FILE_APPEND_DATA,
+	                         FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+	                         bAppend ? OPEN_ALWAYS : CREATE_ALWAYS,
+	                         FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hTraceFile == INVALID_HANDLE_VALUE)
+	{
+		ErrorMessage (GetLastError (), _T("Can't write the trace to %s"), szFullName);
+		return;
+	}
+
+	TraceBuffer.Block.dwMagic = TRACE_MAGIC;
+	TraceBuffer.Block.dwProcess = GetCurrentProcessId ();
+	TraceBuffer.Block.llFrequency = liFrequency.QuadPart;
+	TraceBuffer.Block.dwEvents = 0;
+	TraceBuffer.Block.dwReserved = 0;
+
+	/* nested shells join in */
+	SetEnvVar (_T("CMD_TRACE"), szFullName);
+
+	bTrace = TRUE;
+}
+
+
+VOID TraceStop (VOID)
+{
+	if (!bTrace)
+		return;
+
+	bTrace = FALSE;
+	FlushTrace ();
+	CloseHandle (hTraceFile);
+	hTraceFile = INVALID_HANDLE_VALUE;
+}
+
+
+/*
+ * Records an event. Only the thread of the shell records events.
+ */
+
+VOID TraceEvent (INT nType, CHAR cPhase, LPCTSTR lpName, DWORD dwArg)
+{
+	LPTRACEEVENT lpEvent;
+	LARGE_INTEGER liNow;
+
+	if (TraceBuffer.Block.dwEvents == TRACE_BUFFER_EVENTS)
+		FlushTrace ();
+
+	QueryPerformanceCounter (&liNow);
+
+	lpEvent = &TraceBuffer.Events[TraceBuffer.Block.dwEvents++];
+	lpEvent->llTime = liNow.QuadPart;
+	lpEvent->dwThread = GetCurrentThreadId ();
+	lpEvent->dwArg = dwArg;
+	lpEvent->wType = (WORD)nType;
+	lpEvent->cPhase = cPhase;
+
+#ifdef _UNICODE
+	if (!WideCharToMultiByte (CP_ACP, 0, lpName, -1, lpEvent->szName,
+	                          TRACE_NAME_LENGTH, NULL, NULL))
+		lpEvent->szName[0] = '\0';
+#else
+	strncpy (lpEvent->szName, lpName, TRACE_NAME_LENGTH);
+#endif
+	lpEvent->szName[TRACE_NAME_LENGTH - 1] = '\0';
+}
+
+
+static VOID WriteJson (HANDLE hFile, LPCSTR lpText)
+{
+	DWORD dwWritten;
+
+	WriteFile (hFile, lpText, strlen (lpText), &dwWritten, NULL);
+}
+
+
+/*
+ * Copies an event name into a JSON string, without the quotes.
+ */
+
+static VOID EscapeJson (LPSTR lpBuffer, LPCSTR lpName)
+{
+	for (; *lpName; lpName++)
+	{
+		if (*lpName == '"' || *lpName == '\\')
+		{
+			*lpBuffer++ = '\\';
+			*lpBuffer++ = *lpName;
+		}
+		else if ((UCHAR)*lpName < ' ')
+		{
+			sprintf (lpBuffer, "\\u%04x", (UCHAR)*lpName);
+			lpBuffer += 6;
+		}
+		else
+		{
+			*lpBuffer++ = *lpName;
+		}
+	}
+	*lpBuffer = '\0';
+}
+
+
+/*
+ * Converts a trace file into the trace_event JSON format.
+ */
+
+BOOL ConvertTrace (LPCTSTR lpTraceFile, LPCTSTR lpJsonFile)
+{
+	CHAR szName[TRACE_NAME_LENGTH * 6];
+	CHAR szEvent[TRACE_NAME_LENGTH * 6 + 192];
+	LPTRACEBLOCK lpBlock;
+	LPTRACEEVENT lpEvent;
+	HANDLE hFile;
+	LPBYTE lpData;
+	DWORD dwSize;
+	DWORD dwRead;
+	DWORD dwPos;
+	DWORD i;
+	BOOL bFirst = TRUE;
+
+	hFile = CreateFile (lpTraceFile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+	                    NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		ErrorMessage (GetLastError (), _T("Can't read %s"), lpTraceFile);
+		return FALSE;
+	}
+
+	dwSize = GetFileSize (hFile, NULL);
+	lpData = (LPBYTE)malloc (dwSize + 1);
+	if (lpData == NULL)
+	{
+		CloseHandle (hFile);
+		error_out_of_memory ();
+		return FALSE;
+	}
+
+	if (!ReadFile (hFile, lpData, dwSize, &dwRead, NULL) || dwRead != dwSize)
+	{
+		ErrorMessage (GetLastError (), _T("Can't read %s"), lpTraceFile);
+		CloseHandle (hFile);
+		free (lpData);
+		return FALSE;
+	}
+	CloseHandle (hFile);
+
+	hFile = CreateFile (lpJsonFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+	                    FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		ErrorMessage (GetLastError (), _T("Can't write %s"), lpJsonFile);
+		free (lpData);
+		return FALSE;
+	}
+
+	WriteJson (hFile, "{\"traceEvents\":[\n");
+
+	for (dwPos = 0; dwPos + sizeof (TRACEBLOCK) <= dwSize; )
+	{
+		lpBlock = (LPTRACEBLOCK)(lpData + dwPos);
+		if (lpBlock->dwMagic != TRACE_MAGIC || lpBlock->llFrequency <= 0 ||
+		    lpBlock->dwEvents > (dwSize - dwPos - sizeof (TRACEBLOCK)) / sizeof (TRACEEVENT))
+		{
+			ConErrPrintf (_T("%s: bad trace block at offset %lu\n"), lpTraceFile, dwPos);
+			break;
+		}
+
+		lpEvent = (LPTRACEEVENT)(lpBlock + 1);
+		for (i = 0; i < lpBlock->dwEvents; i++, lpEvent++)
+		{
+			lpEvent->szName[TRACE_NAME_LENGTH - 1] = '\0';
+			EscapeJson (szName, lpEvent->szName);
+
+			sprintf (szEvent,
+			         "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+			         "\"pid\":%lu,\"tid\":%lu,\"id\":\"%lu.%lu\",%s\"args\":{\"arg\":%lu}}",
+			         bFirst ? "" : ",\n",
+			         szName,
+			         lpEvent->wType < sizeof (lpCategory) / sizeof (lpCategory[0]) ?
+			             lpCategory[lpEvent->wType] : "other",
+			         lpEvent->cPhase,
+			         (double)lpEvent->llTime * 1000000.0 / (double)lpBlock->llFrequency,
+			         lpBlock->dwProcess, lpEvent->dwThread,
+			         lpBlock->dwProcess, lpEvent->dwArg,
+			         lpEvent->cPhase == 'i' ? "\"s\":\"t\"," : "",
+			         lpEvent->dwArg);
+			WriteJson (hFile, szEvent);
+			bFirst = FALSE;
+		}
+
+		dwPos += sizeof (TRACEBLOCK) + lpBlock->dwEvents * sizeof (TRACEEVENT);
+	}
+
+	WriteJson (hFile, "\n]}\n");
+
+	CloseHandle (hFile);
+	free (lpData);
+
+	return TRUE;
+}
+
+#endif /* FEATURE_TRACE */
+
+/* EOF */
@@ -45,7 +45,7 @@ INT cmd_type (LPTSTR cmd, LPTSTR param)
 	LPTSTR *argv;
 	LPTSTR errmsg;
 	
-	hConsoleOut=GetStdHandle (STD_OUTPUT_HANDLE);
+	hConsoleOut=ConGetStdHandle (STD_OUTPUT_HANDLE);
 
 	if (!_tcsncmp (param, _T("/?"), 2))
 	{
@@ -66,7 +66,7 @@ INT cmd_type (LPTSTR cmd, LPTSTR param)
 	{
 		if (_T('/') == argv[i][0])
 		{
-			ConErrPrintf(_T("Invalid option \"%S\"\n"), argv[i] + 1);
+			ConErrPrintf(_T("Invalid option \"%s\"\n"), argv[i] + 1);
 			continue;
 		}
 		hFile = CreateFile(argv[i],
@@ -91,6 +91,9 @@ INT cmd_type (LPTSTR cmd, LPTSTR param)
 			continue;
 		}
 
+		/* the file is written directly, after what was printed before */
+		ConOutFlush ();
+
 		do
 		{
 			bRet = ReadFile(hFile,buff,sizeof(buff),&dwRead,NULL);
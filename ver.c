@@ -41,11 +41,11 @@ VOID ShortVersion (VOID)
 	VersionInfo.dwOSVersionInfoSize = sizeof(OSVERSIONINFO);
 	if (GetVersionEx(&VersionInfo) && 0 == _tcsnicmp(VersionInfo.szCSDVersion, _T("ReactOS"), 7))
 	{
-		ConOutPrintf(_T("%S running on %s"), SHELLVER, VersionInfo.szCSDVersion);
+		ConOutPrintf(_T("%hs running on %s"), SHELLVER, VersionInfo.szCSDVersion);
 	}
 	else
 	{
-		ConOutPrintf(_T("%S"), SHELLVER);
+		ConOutPrintf(_T("%hs"), SHELLVER);
 	}
 	ConOutPuts (_T("\n"));
 }
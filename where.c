@@ -81,253 +81,573 @@
 /* initial size of environment variable buffer */
 #define ENV_BUFFER_SIZE  1024
 
+/* number of entries of the executable cache */
+#define EXEC_CACHE_SIZE  64
 
+/* maximum number of extensions taken from PATHEXT */
+#define MAX_EXTENSIONS   32
+
+
+/* used if PATHEXT is not set */
 static LPTSTR ext[]  = {_T(".bat"), _T(".cmd"), _T(".com"), _T(".exe")};
 static INT nExtCount = sizeof(ext) / sizeof(LPTSTR);
 
 
-/* searches for file using path info. */
+/*
+ * A directory searched for executables. The current directory comes
+ * first, followed by the PATH directories. dwGeneration changes each
+ * time the last write time of the directory is seen to change, that is
+ * each time a file is added, removed or renamed in it.
+ */
+typedef struct tagSEARCHDIR
+{
+	TCHAR    szPath[MAX_PATH];    /* with trailing backslash */
+	FILETIME ftLastWrite;
+	BOOL     bStamped;
+	DWORD    dwGeneration;
+} SEARCHDIR, *LPSEARCHDIR;
 
-BOOL
-SearchForExecutable (LPCTSTR pFileName, LPTSTR pFullName)
+/*
+ * A cached result of a search. The result depends on the directories
+ * up to and including nDir, and stays valid as long as none of them
+ * changed after dwGeneration. Failed searches are cached as well.
+ */
+typedef struct tagEXECENTRY
 {
-	TCHAR  szPathBuffer[MAX_PATH];
-	LPTSTR pszBuffer = NULL;
-	DWORD  dwBuffer, len;
+	TCHAR  szName[MAX_PATH];      /* empty for an unused entry */
+	TCHAR  szFullName[MAX_PATH];  /* empty if not found */
+	INT    nDir;
+	DWORD  dwGeneration;
+} EXECENTRY, *LPEXECENTRY;
+
+
+/* the PATH and PATHEXT the cache was built for, and the current
+ * directory in the first search directory */
+static LPTSTR lpCachePath = NULL;
+static TCHAR  szCachePathExt[ENV_BUFFER_SIZE];
+static TCHAR  szCacheCurDir[MAX_PATH];
+
+static LPSEARCHDIR lpSearchDirs = NULL;
+static INT    nSearchDirs = 0;
+
+static TCHAR  szExtBuffer[ENV_BUFFER_SIZE];
+static LPTSTR lpExt[MAX_EXTENSIONS];
+static INT    nExt = 0;
+
+static EXECENTRY ExecCache[EXEC_CACHE_SIZE];
+static DWORD  dwCacheGeneration = 0;
+
+
+/*
+ * Splits PATHEXT into the list of extensions to test, in the order
+ * given there. Only the extensions of the built-in list are taken, the
+ * others (.VBS, .JS, ...) are scripts CreateProcess can't start. If
+ * none is left the built-in list is used.
+ */
+
+static VOID
+ParsePathExt (LPCTSTR pszPathExt)
+{
+	LPTSTR p;
 	INT    n;
-	LPTSTR p,s,f;
 
+	nExt = 0;
 
-	/* initialize full name buffer */
-	*pFullName = _T('\0');
+	if (*pszPathExt)
+	{
+		_tcscpy (szExtBuffer, pszPathExt);
 
-#ifdef _DEBUG
-	DebugPrintf (_T("SearchForExecutable: \'%s\'\n"), pFileName);
-#endif
+		for (p = _tcstok (szExtBuffer, _T(";"));
+		     p != NULL && nExt < MAX_EXTENSIONS;
+		     p = _tcstok (NULL, _T(";")))
+		{
+			for (n = 0; n < nExtCount; n++)
+			{
+				if (!_tcsicmp (p, ext[n]))
+				{
+					lpExt[nExt++] = p;
+					break;
+				}
+			}
+		}
+	}
 
-	if (_tcschr (pFileName, _T('\\')) != NULL)
+	if (nExt == 0)
 	{
-		LPTSTR pFilePart;
-#ifdef _DEBUG
-		DebugPrintf (_T("Absolute or relative path is given.\n"));
-#endif
+		for (nExt = 0; nExt < nExtCount; nExt++)
+			lpExt[nExt] = ext[nExt];
+	}
+}
 
-		if (GetFullPathName (pFileName,
-			             MAX_PATH,
-			             szPathBuffer,
-			             &pFilePart)  ==0)
-			return FALSE;
 
-		if(pFilePart == 0)
-			return FALSE;
+/*
+ * Puts the current directory into the first search directory. It gets
+ * a new generation when it is stamped next, so all results are checked
+ * against it again.
+ */
 
+static VOID
+SetCurDirSlot (LPCTSTR pszCurDir)
+{
+	LPSEARCHDIR lpDir = &lpSearchDirs[0];
+	INT len = _tcslen (pszCurDir);
 
-                if (_tcschr (pFilePart, _T('.')) != NULL)
-                {
-#ifdef _DEBUG
-                        DebugPrintf (_T("Filename extension!\n"));
-#endif
-                        _tcscpy (pFullName, szPathBuffer);
-                        return TRUE;
+	if (len > 0 && len < MAX_PATH - 1)
+	{
+		_tcscpy (lpDir->szPath, pszCurDir);
+		if (lpDir->szPath[len - 1] != _T('\\'))
+			lpDir->szPath[len++] = _T('\\');
+		lpDir->szPath[len] = _T('\0');
+	}
+	else
+		_tcscpy (lpDir->szPath, _T(".\\"));
 
-                }
-                else
-                {
-#ifdef _DEBUG
-                        DebugPrintf (_T("No filename extension!\n"));
-#endif
+	lpDir->bStamped = FALSE;
+	lpDir->dwGeneration = 0;
+}
 
-                        p = szPathBuffer + _tcslen (szPathBuffer);
 
-                        for (n = 0; n < nExtCount; n++)
-                        {
-                                _tcscpy (p, ext[n]);
+/*
+ * Builds the list of directories to search from the current directory
+ * and PATH. Returns FALSE if out of memory.
+ */
 
-#ifdef _DEBUG
-                                DebugPrintf (_T("Testing: \'%s\'\n"), szPathBuffer);
-#endif
+static BOOL
+BuildSearchDirs (LPCTSTR pszCurDir, LPCTSTR pszPath)
+{
+	LPCTSTR s, f;
+	INT    n, len;
 
-                                if (IsValidFileName (szPathBuffer))
-                                {
-#ifdef _DEBUG
-                                        DebugPrintf (_T("Found: \'%s\'\n"), szPathBuffer);
-#endif
-                                        _tcscpy (pFullName, szPathBuffer);
-                                        return TRUE;
-                                }
-                        }
-                        return FALSE;
-                }
-        }
+	free (lpSearchDirs);
+	nSearchDirs = 0;
+
+	/* one more than the number of separators, plus the current dir */
+	n = 2;
+	for (s = pszPath; *s; s++)
+		if (*s == _T(';'))
+			n++;
+
+	lpSearchDirs = (LPSEARCHDIR)malloc (n * sizeof (SEARCHDIR));
+	if (lpSearchDirs == NULL)
+		return FALSE;
+
+	/* the current directory always comes first */
+	SetCurDirSlot (pszCurDir);
+	nSearchDirs = 1;
+
+	for (s = pszPath; s != NULL; s = f ? f + 1 : NULL)
+	{
+		f = _tcschr (s, _T(';'));
+		len = f ? (INT)(f - s) : (INT)_tcslen (s);
+
+		/* empty and overlong entries can't give a result */
+		if (len > 0 && len < MAX_PATH - 1)
+		{
+			LPSEARCHDIR lpDir = &lpSearchDirs[nSearchDirs++];
+
+			_tcsncpy (lpDir->szPath, s, len);
+			if (lpDir->szPath[len - 1] != _T('\\'))
+				lpDir->szPath[len++] = _T('\\');
+			lpDir->szPath[len] = _T('\0');
+			lpDir->bStamped = FALSE;
+			lpDir->dwGeneration = 0;
+		}
+	}
+
+	return TRUE;
+}
+
+
+/*
+ * Makes sure the cache belongs to the current PATH and PATHEXT. If one
+ * of them changed, the cache is flushed. A new current directory only
+ * replaces the first search directory, the results are checked against
+ * it when they are used.
+ * Returns FALSE if the cache can't be used.
+ */
+
+static BOOL
+CheckCacheKey (VOID)
+{
+	TCHAR  szCurDir[MAX_PATH];
+	TCHAR  szPathExt[ENV_BUFFER_SIZE];
+	LPTSTR pszPath;
+	DWORD  dwBuffer;
+	INT    n;
+
+	if (!GetCurrentDirectory (MAX_PATH, szCurDir))
+		return FALSE;
+
+	dwBuffer = GetEnvironmentVariable (_T("PATHEXT"), szPathExt, ENV_BUFFER_SIZE);
+	if (dwBuffer >= ENV_BUFFER_SIZE)
+		return FALSE;
+	if (dwBuffer == 0)
+		*szPathExt = _T('\0');
 
 	/* load environment varable PATH into buffer */
-	pszBuffer = (LPTSTR)malloc (ENV_BUFFER_SIZE * sizeof(TCHAR));
-	dwBuffer = GetEnvironmentVariable (_T("PATH"), pszBuffer, ENV_BUFFER_SIZE);
+	pszPath = (LPTSTR)malloc (ENV_BUFFER_SIZE * sizeof(TCHAR));
+	if (pszPath == NULL)
+		return FALSE;
+	dwBuffer = GetEnvironmentVariable (_T("PATH"), pszPath, ENV_BUFFER_SIZE);
 	if (dwBuffer > ENV_BUFFER_SIZE)
 	{
-		pszBuffer = (LPTSTR)realloc (pszBuffer, dwBuffer * sizeof (TCHAR));
-		GetEnvironmentVariable (_T("PATH"), pszBuffer, dwBuffer * sizeof (TCHAR));
+		LPTSTR pszTemp = (LPTSTR)realloc (pszPath, dwBuffer * sizeof (TCHAR));
+		if (pszTemp == NULL)
+		{
+			free (pszPath);
+			return FALSE;
+		}
+		pszPath = pszTemp;
+		GetEnvironmentVariable (_T("PATH"), pszPath, dwBuffer);
+	}
+	else if (dwBuffer == 0)
+	{
+		*pszPath = _T('\0');
 	}
 
-	if (!(p = _tcsrchr (pFileName, _T('.'))) ||
-		_tcschr (p + 1, _T('\\')))
+	if (lpCachePath != NULL &&
+	    !_tcscmp (lpCachePath, pszPath) &&
+	    !_tcscmp (szCachePathExt, szPathExt))
 	{
-		/* There is no extension ==> test all the extensions. */
+		if (_tcsicmp (szCacheCurDir, szCurDir))
+		{
+			SetCurDirSlot (szCurDir);
+			_tcscpy (szCacheCurDir, szCurDir);
+		}
+		free (pszPath);
+		return TRUE;
+	}
+
 #ifdef _DEBUG
-		DebugPrintf (_T("No filename extension!\n"));
+	DebugPrintf (_T("SearchForExecutable: flushing cache\n"));
 #endif
 
-		/* search in current directory */
-		len = GetCurrentDirectory (MAX_PATH, szPathBuffer);
-		if (szPathBuffer[len - 1] != _T('\\'))
-		{
-			szPathBuffer[len] = _T('\\');
-			szPathBuffer[len + 1] = _T('\0');
-		}
-		_tcscat (szPathBuffer, pFileName);
+	for (n = 0; n < EXEC_CACHE_SIZE; n++)
+		*ExecCache[n].szName = _T('\0');
 
-		p = szPathBuffer + _tcslen (szPathBuffer);
+	free (lpCachePath);
+	lpCachePath = NULL;
 
-		for (n = 0; n < nExtCount; n++)
-		{
-			_tcscpy (p, ext[n]);
+	if (!BuildSearchDirs (szCurDir, pszPath))
+	{
+		free (pszPath);
+		return FALSE;
+	}
+
+	ParsePathExt (szPathExt);
+
+	lpCachePath = pszPath;
+	_tcscpy (szCachePathExt, szPathExt);
+	_tcscpy (szCacheCurDir, szCurDir);
+
+	return TRUE;
+}
+
+
+/*
+ * Reads the last write time of a search directory and returns the
+ * generation of its current contents.
+ */
+
+static DWORD
+StampSearchDir (LPSEARCHDIR lpDir)
+{
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+	FILETIME ft = {0, 0};
+
+	if (GetFileAttributesEx (lpDir->szPath, GetFileExInfoStandard, &fad))
+		ft = fad.ftLastWriteTime;
+
+	if (!lpDir->bStamped || CompareFileTime (&ft, &lpDir->ftLastWrite) != 0)
+	{
+		lpDir->ftLastWrite = ft;
+		lpDir->bStamped = TRUE;
+		lpDir->dwGeneration = ++dwCacheGeneration;
+	}
+
+	return lpDir->dwGeneration;
+}
+
+
+static UINT
+HashExecName (LPCTSTR pFileName)
+{
+	UINT h = 0;
+
+	while (*pFileName)
+		h = h * 31 + (UINT)_totlower (*pFileName++);
 
+	return h % EXEC_CACHE_SIZE;
+}
+
+
+/*
+ * Tests a file name with the extensions (if it has none yet) appended.
+ */
+
+static BOOL
+ProbeExecutable (LPTSTR szPathBuffer, BOOL bHasExt, LPTSTR *lpExtList, INT nExtList)
+{
+	LPTSTR p;
+	INT    n;
+
+	if (bHasExt)
+	{
 #ifdef _DEBUG
-			DebugPrintf (_T("Testing: \'%s\'\n"), szPathBuffer);
+		DebugPrintf (_T("Testing: \'%s\'\n"), szPathBuffer);
 #endif
+		return IsValidFileName (szPathBuffer);
+	}
+
+	p = szPathBuffer + _tcslen (szPathBuffer);
+
+	for (n = 0; n < nExtList; n++)
+	{
+		if ((p - szPathBuffer) + _tcslen (lpExtList[n]) >= MAX_PATH)
+			continue;
+
+		_tcscpy (p, lpExtList[n]);
 
-			if (IsValidFileName (szPathBuffer))
-			{
 #ifdef _DEBUG
-				DebugPrintf (_T("Found: \'%s\'\n"), szPathBuffer);
+		DebugPrintf (_T("Testing: \'%s\'\n"), szPathBuffer);
 #endif
-				free (pszBuffer);
+
+		if (IsValidFileName (szPathBuffer))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+
+/*
+ * Searches the current directory and PATH without the cache, with the
+ * built-in extensions. Used when the cache can't be set up.
+ */
+
+static BOOL
+SearchUncached (LPCTSTR pFileName, LPTSTR pFullName, BOOL bHasExt)
+{
+	TCHAR  szPathBuffer[MAX_PATH];
+	LPTSTR pszPath;
+	LPTSTR s, f;
+	DWORD  dwBuffer;
+	INT    len;
+
+	/* search in current directory */
+	len = (INT)GetCurrentDirectory (MAX_PATH, szPathBuffer);
+	if (len > 0 && len < MAX_PATH - 1)
+	{
+		if (szPathBuffer[len - 1] != _T('\\'))
+			szPathBuffer[len++] = _T('\\');
+		szPathBuffer[len] = _T('\0');
+
+		if (len + _tcslen (pFileName) < MAX_PATH)
+		{
+			_tcscat (szPathBuffer, pFileName);
+			if (ProbeExecutable (szPathBuffer, bHasExt, ext, nExtCount))
+			{
 				_tcscpy (pFullName, szPathBuffer);
 				return TRUE;
 			}
 		}
+	}
 
-		/* search in PATH */
-		s = pszBuffer;
-		while (s && *s)
+	/* search in PATH */
+	dwBuffer = GetEnvironmentVariable (_T("PATH"), NULL, 0);
+	if (dwBuffer == 0)
+		return FALSE;
+
+	pszPath = (LPTSTR)malloc (dwBuffer * sizeof (TCHAR));
+	if (pszPath == NULL)
+		return FALSE;
+	if (GetEnvironmentVariable (_T("PATH"), pszPath, dwBuffer) >= dwBuffer)
+	{
+		free (pszPath);
+		return FALSE;
+	}
+
+	for (s = pszPath; s != NULL; s = f ? f + 1 : NULL)
+	{
+		f = _tcschr (s, _T(';'));
+		len = f ? (INT)(f - s) : (INT)_tcslen (s);
+
+		if (len == 0 || len >= MAX_PATH - 1)
+			continue;
+
+		_tcsncpy (szPathBuffer, s, len);
+		if (szPathBuffer[len - 1] != _T('\\'))
+			szPathBuffer[len++] = _T('\\');
+		szPathBuffer[len] = _T('\0');
+
+		if (len + _tcslen (pFileName) >= MAX_PATH)
+			continue;
+
+		_tcscat (szPathBuffer, pFileName);
+		if (ProbeExecutable (szPathBuffer, bHasExt, ext, nExtCount))
 		{
-			f = _tcschr (s, _T(';'));
+			_tcscpy (pFullName, szPathBuffer);
+			free (pszPath);
+			return TRUE;
+		}
+	}
 
-			if (f)
-			{
-				_tcsncpy (szPathBuffer, s, (size_t)(f-s));
-				szPathBuffer[f-s] = _T('\0');
-				s = f + 1;
-			}
-			else
-			{
-				_tcscpy (szPathBuffer, s);
-				s = NULL;
-			}
+	free (pszPath);
+	return FALSE;
+}
 
-			len = _tcslen(szPathBuffer);
-			if (szPathBuffer[len - 1] != _T('\\'))
-			{
-				szPathBuffer[len] = _T('\\');
-				szPathBuffer[len + 1] = _T('\0');
-			}
-			_tcscat (szPathBuffer, pFileName);
 
-			p = szPathBuffer + _tcslen (szPathBuffer);
+/* searches for file using path info. */
+
+BOOL
+SearchForExecutable (LPCTSTR pFileName, LPTSTR pFullName)
+{
+	TCHAR  szPathBuffer[MAX_PATH];
+	LPEXECENTRY lpEntry;
+	LPTSTR *lpExtList;
+	INT    nExtList;
+	BOOL   bCached;
+	BOOL   bCurDirOnly = FALSE;
+	BOOL   bHasExt;
+	LPTSTR p;
+	INT    n;
 
-			for (n = 0; n < nExtCount; n++)
-			{
-				_tcscpy (p, ext[n]);
 
-#ifdef _DEBUG
-				DebugPrintf (_T("Testing: \'%s\'\n"), szPathBuffer);
-#endif
+	/* initialize full name buffer */
+	*pFullName = _T('\0');
 
-				if (IsValidFileName (szPathBuffer))
-				{
 #ifdef _DEBUG
-					DebugPrintf (_T("Found: \'%s\'\n"), szPathBuffer);
+	DebugPrintf (_T("SearchForExecutable: \'%s\'\n"), pFileName);
 #endif
-					free (pszBuffer);
-					_tcscpy (pFullName, szPathBuffer);
-					return TRUE;
-				}
-			}
-		}
+
+	/* without the cache, the search is done the slow way */
+	bCached = CheckCacheKey ();
+	if (bCached)
+	{
+		lpExtList = lpExt;
+		nExtList = nExt;
 	}
 	else
 	{
-		/* There is an extension and it is in the last path component, */
-		/* so don't test all the extensions. */
+		lpExtList = ext;
+		nExtList = nExtCount;
+	}
+
+	if (_tcschr (pFileName, _T('\\')) != NULL)
+	{
+		LPTSTR pFilePart;
 #ifdef _DEBUG
-		DebugPrintf (_T("Filename extension!\n"));
+		DebugPrintf (_T("Absolute or relative path is given.\n"));
 #endif
 
-		/* search in current directory */
-		len = GetCurrentDirectory (MAX_PATH, szPathBuffer);
-		if (szPathBuffer[len - 1] != _T('\\'))
-		{
-			szPathBuffer[len] = _T('\\');
-			szPathBuffer[len + 1] = _T('\0');
-		}
-		_tcscat (szPathBuffer, pFileName);
+		if (GetFullPathName (pFileName,
+			             MAX_PATH,
+			             szPathBuffer,
+			             &pFilePart)  ==0)
+			return FALSE;
 
-#ifdef _DEBUG
-		DebugPrintf (_T("Testing: \'%s\'\n"), szPathBuffer);
-#endif
-		if (IsValidFileName (szPathBuffer))
+		if(pFilePart == 0)
+			return FALSE;
+
+		if (_tcschr (pFilePart, _T('.')) != NULL)
 		{
 #ifdef _DEBUG
-			DebugPrintf (_T("Found: \'%s\'\n"), szPathBuffer);
+			DebugPrintf (_T("Filename extension!\n"));
 #endif
-			free (pszBuffer);
 			_tcscpy (pFullName, szPathBuffer);
 			return TRUE;
 		}
 
+#ifdef _DEBUG
+		DebugPrintf (_T("No filename extension!\n"));
+#endif
+		if (!ProbeExecutable (szPathBuffer, FALSE, lpExtList, nExtList))
+			return FALSE;
 
-		/* search in PATH */
-		s = pszBuffer;
-		while (s && *s)
-		{
-			f = _tcschr (s, _T(';'));
-
-			if (f)
-			{
-				_tcsncpy (szPathBuffer, s, (size_t)(f-s));
-				szPathBuffer[f-s] = _T('\0');
-				s = f + 1;
-			}
-			else
-			{
-				_tcscpy (szPathBuffer, s);
-				s = NULL;
-			}
+#ifdef _DEBUG
+		DebugPrintf (_T("Found: \'%s\'\n"), szPathBuffer);
+#endif
+		_tcscpy (pFullName, szPathBuffer);
+		return TRUE;
+	}
 
-			len = _tcslen(szPathBuffer);
-			if (szPathBuffer[len - 1] != _T('\\'))
-			{
-				szPathBuffer[len] = _T('\\');
-				szPathBuffer[len + 1] = _T('\0');
-			}
-			_tcscat (szPathBuffer, pFileName);
+	if (_tcslen (pFileName) >= MAX_PATH)
+		return FALSE;
 
+	/* If there is an extension and it is in the last path component, */
+	/* don't test all the extensions. */
+	bHasExt = ((p = _tcsrchr (pFileName, _T('.'))) != NULL);
 #ifdef _DEBUG
-			DebugPrintf (_T("Testing: \'%s\'\n"), szPathBuffer);
+	DebugPrintf (bHasExt ? _T("Filename extension!\n")
+	                     : _T("No filename extension!\n"));
 #endif
-			if (IsValidFileName (szPathBuffer))
+
+	if (!bCached)
+		return SearchUncached (pFileName, pFullName, bHasExt);
+
+	/* look for an earlier result which is still valid */
+	lpEntry = &ExecCache[HashExecName (pFileName)];
+	if (!_tcsicmp (lpEntry->szName, pFileName))
+	{
+		for (n = 1; n <= lpEntry->nDir; n++)
+		{
+			if (StampSearchDir (&lpSearchDirs[n]) > lpEntry->dwGeneration)
+				break;
+		}
+
+		if (n > lpEntry->nDir)
+		{
+			if (StampSearchDir (&lpSearchDirs[0]) <= lpEntry->dwGeneration)
 			{
 #ifdef _DEBUG
-				DebugPrintf (_T("Found: \'%s\'\n"), szPathBuffer);
+				DebugPrintf (_T("Cached: \'%s\'\n"), lpEntry->szFullName);
 #endif
-				free (pszBuffer);
-				_tcscpy (pFullName, szPathBuffer);
-				return TRUE;
+				_tcscpy (pFullName, lpEntry->szFullName);
+				return (*pFullName != _T('\0'));
 			}
+
+			/* Only the current directory changed, after a CD for
+			 * instance. A result which wasn't found there holds
+			 * unless the current directory has the file now. */
+			bCurDirOnly = (lpEntry->nDir > 0 || *lpEntry->szFullName == _T('\0'));
 		}
 	}
 
-	free (pszBuffer);
+	/* search in current directory, then in PATH */
+	for (n = 0; n < (bCurDirOnly ? 1 : nSearchDirs); n++)
+	{
+		/* the time stamp is taken before the directory is searched,
+		 * so a file added during the search invalidates the result */
+		StampSearchDir (&lpSearchDirs[n]);
 
-	return FALSE;
+		if (_tcslen (lpSearchDirs[n].szPath) + _tcslen (pFileName) >= MAX_PATH)
+			continue;
+
+		_tcscpy (szPathBuffer, lpSearchDirs[n].szPath);
+		_tcscat (szPathBuffer, pFileName);
+
+		if (ProbeExecutable (szPathBuffer, bHasExt, lpExt, nExt))
+		{
+#ifdef _DEBUG
+			DebugPrintf (_T("Found: \'%s\'\n"), szPathBuffer);
+#endif
+			_tcscpy (pFullName, szPathBuffer);
+			break;
+		}
+	}
+
+	if (bCurDirOnly && *pFullName == _T('\0'))
+	{
+		lpEntry->dwGeneration = dwCacheGeneration;
+		_tcscpy (pFullName, lpEntry->szFullName);
+		return (*pFullName != _T('\0'));
+	}
+
+	/* remember the result, a failed search depends on all directories */
+	_tcscpy (lpEntry->szName, pFileName);
+	_tcscpy (lpEntry->szFullName, pFullName);
+	lpEntry->nDir = (n < nSearchDirs) ? n : nSearchDirs - 1;
+	lpEntry->dwGeneration = dwCacheGeneration;
+
+	return (*pFullName != _T('\0'));
 }